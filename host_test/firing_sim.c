@@ -0,0 +1,304 @@
+/*
+ * Host-side simulation of the heater firing path. The scheduling, phase
+ * linearisation, SSR window and frequency measurement code from
+ * main/firing.c runs unmodified against a virtual mains, with the same glue
+ * as the interrupt handlers and firing task in main/actuator.c. Each case
+ * reports the power actually delivered by the modelled TRIAC or SSR against
+ * the commanded and metered power.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "firing.h"
+#include "mains_sim.h"
+
+#define SIM_SECONDS 120
+#define CHANNELS_MAX 3
+
+#define ZC_WINDOW_US 200       // zero-cross optocoupler and SSR trigger window
+#define GATE_PULSE_US 100      // RMT gate pulse width, as in actuator.c
+#define TASK_LATENCY_MIN_US 20 // firing task wake-up latency after the interrupt
+#define TASK_LATENCY_MAX_US 200
+#define SSR_PERIOD (1 << 13)   // LEDC resolution, as in actuator.c
+#define SSR_PERIOD_US 1000000  // 1 Hz slow PWM
+
+typedef enum {
+    STRATEGY_BURST,
+    STRATEGY_PHASE,
+    STRATEGY_SSR,
+} strategy_t;
+
+static const char *strategy_names[] = { "burst", "phase", "ssr" };
+
+typedef struct sim_result_t {
+    double delivered[CHANNELS_MAX];
+    double metered[CHANNELS_MAX];
+    double expected[CHANNELS_MAX];
+    int max_concurrent;
+    double freq_error; // relative error of the last frequency measurement
+} sim_result_t;
+
+/* Firmware state, mirroring the statics of actuator.c */
+typedef struct firmware_t {
+    strategy_t strategy;
+    int channels;
+    int max_concurrent;
+    uint16_t power[CHANNELS_MAX];
+    firing_scheduler_t scheduler;
+    uint32_t zerocross_last;
+    uint32_t pcnt_last;
+    int pcnt_count;
+    uint32_t half_ac_freq;
+    bool gate[CHANNELS_MAX];
+    double conduction_us[CHANNELS_MAX];
+    uint32_t ssr_hpoint[CHANNELS_MAX];
+    uint32_t ssr_duty[CHANNELS_MAX];
+    bool ssr_invert[CHANNELS_MAX];
+    uint16_t ssr_applied[CHANNELS_MAX];
+} firmware_t;
+
+/* TRIAC trigger offsets of the half-cycles still in flight */
+#define TRIGGER_SLOTS 4
+static double trigger[TRIGGER_SLOTS][CHANNELS_MAX];
+
+static void on_edge(firmware_t *fw, mains_t *mains, double time) {
+    uint32_t now = (uint32_t)time;
+
+    /* pcnt_ac_intr_handler */
+    if (++fw->pcnt_count == FIRING_PCNT_EDGES) {
+        fw->half_ac_freq = firing_half_ac_freq(now - fw->pcnt_last);
+        fw->pcnt_last = now;
+        fw->pcnt_count = 0;
+    }
+
+    /* zerocross_isr_handler */
+    if (!firing_debounce(&fw->zerocross_last, now)) {
+        return;
+    }
+    uint32_t half_period = firing_half_period_us(fw->half_ac_freq);
+
+    if (fw->strategy == STRATEGY_BURST) {
+        uint32_t fire = firing_schedule(&fw->scheduler, fw->power, fw->channels, fw->max_concurrent);
+        for (int ch = 0; ch < fw->channels; ch++) {
+            fw->gate[ch] = (fire >> ch) & 1;
+            if (fw->gate[ch]) {
+                fw->conduction_us[ch] += half_period;
+            }
+        }
+    } else if (fw->strategy == STRATEGY_PHASE) {
+        /* firing_task */
+        uint32_t latency = TASK_LATENCY_MIN_US +
+            mains_random(mains) * (TASK_LATENCY_MAX_US - TASK_LATENCY_MIN_US);
+        uint32_t delay[CHANNELS_MAX];
+        uint16_t conducted[CHANNELS_MAX];
+        uint32_t fire = firing_phase_half_cycle(&fw->scheduler, fw->power, fw->channels,
+                                                fw->max_concurrent, half_period,
+                                                delay, conducted);
+        for (int ch = 0; ch < fw->channels; ch++) {
+            if (!((fire >> ch) & 1) || delay[ch] <= latency) {
+                continue;
+            }
+            fw->conduction_us[ch] += (double)conducted[ch] * half_period / FIRING_POWER_MAX;
+
+            double pulse = time + delay[ch];
+            uint64_t j = (uint64_t)(pulse / mains->half_period_us);
+            double offset = pulse - mains_zero_time(mains, j);
+            if (offset < trigger[j % TRIGGER_SLOTS][ch]) {
+                trigger[j % TRIGGER_SLOTS][ch] = offset;
+            }
+            /* A pulse straddling the zero crossing also fires the next half-cycle */
+            if (offset + GATE_PULSE_US > mains->half_period_us) {
+                trigger[(j + 1) % TRIGGER_SLOTS][ch] = 0;
+            }
+        }
+    }
+}
+
+static bool ssr_control(const firmware_t *fw, int ch, double time) {
+    uint32_t pos = fmod(time, SSR_PERIOD_US) * SSR_PERIOD / SSR_PERIOD_US;
+    bool in = pos >= fw->ssr_hpoint[ch] && pos < fw->ssr_hpoint[ch] + fw->ssr_duty[ch];
+    return fw->ssr_invert[ch] ? !in : in;
+}
+
+static void simulate(strategy_t strategy, const mains_config_t *cfg, const uint16_t *power,
+                     int channels, int max_concurrent, sim_result_t *result) {
+    mains_t mains;
+    firmware_t fw = {
+        .strategy = strategy,
+        .channels = channels,
+        .max_concurrent = max_concurrent,
+    };
+    double delivered[CHANNELS_MAX] = {0};
+
+    mains_init(&mains, cfg);
+    memcpy(fw.power, power, channels * sizeof power[0]);
+    for (int slot = 0; slot < TRIGGER_SLOTS; slot++) {
+        for (int ch = 0; ch < CHANNELS_MAX; ch++) {
+            trigger[slot][ch] = INFINITY;
+        }
+    }
+    if (strategy == STRATEGY_SSR) {
+        firing_ssr_windows(fw.power, channels, max_concurrent, SSR_PERIOD,
+                           fw.ssr_hpoint, fw.ssr_duty, fw.ssr_invert, fw.ssr_applied);
+    }
+
+    memset(result, 0, sizeof *result);
+    uint64_t half_cycles = (uint64_t)(SIM_SECONDS * cfg->frequency * 2);
+    /* Start at 1 so that early edges never fall before t = 0 */
+    for (uint64_t k = 1; k <= half_cycles; k++) {
+        double edges[MAINS_MAX_EDGES];
+        int count = mains_edges(&mains, k, edges);
+        double zero = mains_zero_time(&mains, k);
+        bool on[CHANNELS_MAX];
+        int i = 0;
+
+        while (i < count && edges[i] <= zero) {
+            on_edge(&fw, &mains, edges[i++]);
+        }
+        for (int ch = 0; ch < channels; ch++) {
+            on[ch] = fw.gate[ch];
+        }
+        while (i < count && edges[i] <= zero + ZC_WINDOW_US) {
+            on_edge(&fw, &mains, edges[i++]);
+            for (int ch = 0; ch < channels; ch++) {
+                on[ch] |= fw.gate[ch];
+            }
+        }
+        while (i < count) {
+            on_edge(&fw, &mains, edges[i++]);
+        }
+
+        int concurrent = 0;
+        if (strategy == STRATEGY_PHASE) {
+            /* Every pulse landing in half-cycle k - 1 has been issued by now */
+            double *slot = trigger[(k - 1) % TRIGGER_SLOTS];
+            for (int ch = 0; ch < channels; ch++) {
+                double conduction = triac_conduction(slot[ch], mains.half_period_us);
+                delivered[ch] += conduction;
+                concurrent += conduction > 0;
+                slot[ch] = INFINITY;
+            }
+        } else {
+            for (int ch = 0; ch < channels; ch++) {
+                if (strategy == STRATEGY_SSR) {
+                    on[ch] = ssr_control(&fw, ch, zero);
+                }
+                delivered[ch] += on[ch];
+                concurrent += on[ch];
+            }
+        }
+        if (concurrent > result->max_concurrent) {
+            result->max_concurrent = concurrent;
+        }
+    }
+
+    double duration_us = half_cycles * mains.half_period_us;
+    for (int ch = 0; ch < channels; ch++) {
+        result->delivered[ch] = delivered[ch] / half_cycles;
+        if (strategy == STRATEGY_SSR) {
+            result->metered[ch] = fw.ssr_applied[ch] / (double)FIRING_POWER_MAX;
+            result->expected[ch] = result->metered[ch];
+        } else {
+            result->metered[ch] = fw.conduction_us[ch] / duration_us;
+            result->expected[ch] = power[ch] / (double)FIRING_POWER_MAX;
+        }
+    }
+    double true_freq = 2 * cfg->frequency * 100;
+    result->freq_error = (fw.half_ac_freq - true_freq) / true_freq;
+}
+
+typedef struct scenario_t {
+    const char *name;
+    mains_config_t mains;
+    unsigned checked; // strategies held to the tolerances below, the others are only reported
+} scenario_t;
+
+#define CHECK(strategy) (1u << (strategy))
+#define CHECK_ALL (CHECK(STRATEGY_BURST) | CHECK(STRATEGY_PHASE) | CHECK(STRATEGY_SSR))
+
+static const scenario_t scenarios[] = {
+    { "50Hz",         { .frequency = 50, .seed = 1 }, CHECK_ALL },
+    { "60Hz",         { .frequency = 60, .seed = 2 }, CHECK_ALL },
+    /* Edges lagging the zero crossing let the previous burst gate leak */
+    { "50Hz jitter",  { .frequency = 50, .jitter_us = 150, .seed = 3 },
+      CHECK(STRATEGY_PHASE) | CHECK(STRATEGY_SSR) },
+    /* A detector leading the zero crossing advances the uncompensated phase delay */
+    { "50Hz early",   { .frequency = 50, .lead_us = 200, .jitter_us = 150, .seed = 4 },
+      CHECK(STRATEGY_BURST) | CHECK(STRATEGY_SSR) },
+    { "50Hz dropout", { .frequency = 50, .dropout = 0.01, .seed = 5 }, 0 },
+    { "50Hz noise",   { .frequency = 50, .noise = 0.005, .seed = 6 }, 0 },
+};
+
+/* Delivered-power tolerance in percentage points, per strategy */
+static const double tolerance[] = { 0.5, 2.5, 1.5 };
+#define FREQ_TOLERANCE 0.001
+
+static const uint16_t power_levels[] = { 0, 100, 250, 500, 750, 1000 };
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static int failures;
+
+static void check(bool ok, const char *what, const char *scenario, const char *strategy) {
+    if (!ok) {
+        printf("FAIL: %s (%s, %s)\n", what, scenario, strategy);
+        failures++;
+    }
+}
+
+int main(void) {
+    clock_t start = clock();
+    double simulated = 0;
+
+    printf("%-13s %-6s %7s %10s %8s %8s %9s\n",
+           "scenario", "mode", "command", "delivered", "error", "meter", "freq err");
+    for (size_t s = 0; s < ARRAY_SIZE(scenarios); s++) {
+        const scenario_t *scenario = &scenarios[s];
+        for (int strategy = STRATEGY_BURST; strategy <= STRATEGY_SSR; strategy++) {
+            for (size_t p = 0; p < ARRAY_SIZE(power_levels); p++) {
+                sim_result_t result;
+                simulate(strategy, &scenario->mains, &power_levels[p], 1, 1, &result);
+                simulated += SIM_SECONDS;
+
+                double error = 100 * (result.delivered[0] - result.expected[0]);
+                double meter = 100 * (result.metered[0] - result.delivered[0]);
+                printf("%-13s %-6s %6.1f%% %9.2f%% %+7.2fpp %+7.2fpp %+8.3f%%\n",
+                       scenario->name, strategy_names[strategy], power_levels[p] / 10.0,
+                       100 * result.delivered[0], error, meter, 100 * result.freq_error);
+                if (scenario->checked & CHECK(strategy)) {
+                    check(fabs(error) <= tolerance[strategy], "delivered power",
+                          scenario->name, strategy_names[strategy]);
+                    check(fabs(result.freq_error) <= FREQ_TOLERANCE, "mains frequency",
+                          scenario->name, strategy_names[strategy]);
+                }
+            }
+        }
+    }
+
+    /* Two elements sharing a circuit that allows only one on at a time */
+    printf("\n%-13s %-6s %15s %19s %5s\n", "interleave", "mode", "command", "delivered", "peak");
+    const uint16_t shared[] = { 400, 550 };
+    for (int strategy = STRATEGY_BURST; strategy <= STRATEGY_SSR; strategy++) {
+        sim_result_t result;
+        simulate(strategy, &scenarios[0].mains, shared, 2, 1, &result);
+        simulated += SIM_SECONDS;
+
+        printf("%-13s %-6s %6.1f%% %6.1f%% %8.2f%% %8.2f%% %5d\n",
+               scenarios[0].name, strategy_names[strategy], shared[0] / 10.0, shared[1] / 10.0,
+               100 * result.delivered[0], 100 * result.delivered[1], result.max_concurrent);
+        check(result.max_concurrent <= 1, "concurrent elements",
+              "interleave", strategy_names[strategy]);
+        for (int ch = 0; ch < 2; ch++) {
+            check(fabs(100 * (result.delivered[ch] - result.expected[ch])) <= tolerance[strategy],
+                  "interleaved power", "interleave", strategy_names[strategy]);
+        }
+    }
+
+    double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("\n%.0f s of mains simulated in %.2f s (%.0fx real time)\n",
+           simulated, elapsed, elapsed > 0 ? simulated / elapsed : 0);
+    printf("%d failure(s)\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,11 @@
+/* Host build: controller.h only needs the handle type, and what the IDF header pulls in */
+#ifndef H_HOST_SPI_MASTER_
+#define H_HOST_SPI_MASTER_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct spi_device_t *spi_device_handle_t;
+
+#endif
@@ -0,0 +1,18 @@
+/* Host build: warnings and errors go to stderr, the rest is compiled out */
+#ifndef H_HOST_ESP_LOG_
+#define H_HOST_ESP_LOG_
+
+#include <stdio.h>
+
+#define ESP_LOG_HOST(level, tag, format, ...) \
+    fprintf(stderr, level " (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOG_NONE(tag, format, ...) \
+    do { if (0) fprintf(stderr, "%s" format, tag, ##__VA_ARGS__); } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_LOG_HOST("E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_HOST("W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_NONE(tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_NONE(tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_NONE(tag, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,18 @@
+/* Host build: bitwise equivalent of the ROM CRC32 (IEEE 802.3, reflected) */
+#ifndef H_HOST_ESP_ROM_CRC_
+#define H_HOST_ESP_ROM_CRC_
+
+#include <stdint.h>
+
+static inline uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+#endif
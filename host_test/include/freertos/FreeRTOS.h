@@ -0,0 +1,11 @@
+/* Host build: single threaded, critical sections are no-ops */
+#ifndef H_HOST_FREERTOS_
+#define H_HOST_FREERTOS_
+
+typedef int portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portENTER_CRITICAL(mux) ((void)(mux))
+#define portEXIT_CRITICAL(mux) ((void)(mux))
+
+#endif
@@ -0,0 +1,5 @@
+/* Host build: nothing of the NimBLE logging is used */
+#ifndef H_HOST_MODLOG_
+#define H_HOST_MODLOG_
+
+#endif
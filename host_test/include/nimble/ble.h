@@ -0,0 +1,7 @@
+/* Host build: bler946.h only needs the declarations of its own functions */
+#ifndef H_HOST_NIMBLE_BLE_
+#define H_HOST_NIMBLE_BLE_
+
+#include <stdint.h>
+
+#endif
@@ -0,0 +1,55 @@
+#include <math.h>
+#include "mains_sim.h"
+
+void mains_init(mains_t *mains, const mains_config_t *cfg) {
+    mains->cfg = *cfg;
+    mains->rng = cfg->seed ? cfg->seed : 1;
+    mains->half_period_us = 1000000.0 / cfg->frequency / 2;
+}
+
+/* xorshift64*, uniform in [0, 1) */
+double mains_random(mains_t *mains) {
+    mains->rng ^= mains->rng >> 12;
+    mains->rng ^= mains->rng << 25;
+    mains->rng ^= mains->rng >> 27;
+    return (mains->rng * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double mains_zero_time(const mains_t *mains, uint64_t k) {
+    return k * mains->half_period_us;
+}
+
+int mains_edges(mains_t *mains, uint64_t k, double *edges) {
+    double zero = mains_zero_time(mains, k);
+    int count = 0;
+
+    /* Draw every random number unconditionally to keep runs comparable */
+    double jitter = (2 * mains_random(mains) - 1) * mains->cfg.jitter_us;
+    bool dropped = mains_random(mains) < mains->cfg.dropout;
+    bool noisy = mains_random(mains) < mains->cfg.noise;
+    double noise_at = mains_random(mains) * mains->half_period_us;
+
+    if (!dropped) {
+        edges[count++] = zero - mains->cfg.lead_us + jitter;
+    }
+    if (noisy) {
+        edges[count++] = zero + noise_at;
+        if (count == 2 && edges[0] > edges[1]) {
+            double tmp = edges[0];
+            edges[0] = edges[1];
+            edges[1] = tmp;
+        }
+    }
+    return count;
+}
+
+double triac_conduction(double offset_us, double half_period_us) {
+    if (offset_us <= 0) {
+        return 1.0;
+    }
+    if (offset_us >= half_period_us) {
+        return 0.0;
+    }
+    double theta = M_PI * offset_us / half_period_us;
+    return 1.0 - theta / M_PI + sin(2 * theta) / (2 * M_PI);
+}
@@ -0,0 +1,47 @@
+#ifndef H_MAINS_SIM_
+#define H_MAINS_SIM_
+
+/*
+ * Virtual mains for host-side testing of the firing path. Generates the
+ * zero-cross detector edges of each half-cycle and models how a TRIAC or a
+ * zero-cross SSR conducts from the gate timing. Everything is driven by a
+ * seeded generator so runs are deterministic.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAINS_MAX_EDGES 4
+
+typedef struct mains_config_t {
+    double frequency;   /* Hz */
+    double lead_us;     /* zero-cross detector edge ahead of the true zero crossing */
+    double jitter_us;   /* zero-cross detector jitter, uniform within +/- */
+    double dropout;     /* probability that the edge of a half-cycle is missed */
+    double noise;       /* probability of a spurious edge within a half-cycle */
+    uint32_t seed;
+} mains_config_t;
+
+typedef struct mains_t {
+    mains_config_t cfg;
+    uint64_t rng;
+    double half_period_us;
+} mains_t;
+
+void mains_init(mains_t *mains, const mains_config_t *cfg);
+double mains_random(mains_t *mains);
+
+/* True start of half-cycle k, in microseconds */
+double mains_zero_time(const mains_t *mains, uint64_t k);
+
+/* Detector edges of half-cycle k, sorted; returns their count */
+int mains_edges(mains_t *mains, uint64_t k, double *edges);
+
+/*
+ * Energy delivered to a resistive load during a half-cycle, as a fraction of
+ * a full half-cycle, when the TRIAC is triggered offset_us after the zero
+ * crossing.
+ */
+double triac_conduction(double offset_us, double half_period_us);
+
+#endif
@@ -0,0 +1,238 @@
+#include <string.h>
+#include "profile.h"
+#include "energy.h"
+#include "oven_sim.h"
+
+oven_sim_t oven;
+
+atomic_int ato_target;
+atomic_uint ato_half_ac_freq;
+
+void oven_sim_reset(void) {
+    memset(&oven, 0, sizeof oven);
+    oven.step = -1;
+    oven.profile.steps = 2;
+    oven.profile.data[0] = (reflow_step_t){ .duration = 90, .temperature = 150 };
+    oven.profile.data[1] = (reflow_step_t){ .duration = 30, .temperature = 235 };
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        oven.manual_power[ch] = -1;
+    }
+    for (int stream = 0; stream < TELEMETRY_STREAMS; stream++) {
+        oven.rate[stream] = TELEMETRY_RATE_DEFAULT;
+    }
+    oven.library.version = LIBRARY_VERSION;
+    oven.library.active = LIBRARY_NONE;
+    oven.quality.version = QUALITY_VERSION;
+    oven.logged_run = 7;
+    oven.logged_len = 40;
+    for (int i = 0; i < oven.logged_len; i++) {
+        oven.logged[i] = i;
+    }
+    atomic_store(&ato_target, 25);
+    atomic_store(&ato_half_ac_freq, 10000);
+}
+
+esp_err_t reflow_start(void) {
+    if (oven.running) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    oven.running = true;
+    oven.phase = REFLOW_RAMP;
+    oven.step = 0;
+    oven.starts++;
+    return ESP_OK;
+}
+
+void reflow_stop(void) {
+    oven.running = false;
+    oven.phase = REFLOW_IDLE;
+    oven.step = -1;
+    oven.stops++;
+}
+
+bool reflow_is_running(void) {
+    return oven.running;
+}
+
+int reflow_get_step(void) {
+    return oven.step;
+}
+
+reflow_phase_t reflow_get_phase(void) {
+    return oven.phase;
+}
+
+void reflow_get_progress(reflow_progress_t *progress) {
+    *progress = (reflow_progress_t){
+        .phase = oven.phase,
+        .step = oven.step,
+        .steps = oven.profile.steps,
+        .elapsed = oven.elapsed,
+        .heating_rate = 100,
+    };
+}
+
+esp_err_t store_profile(const reflow_profile_t *profile) {
+    if (oven.store_fails) {
+        return ESP_FAIL;
+    }
+    oven.stored = *profile;
+    oven.has_stored = true;
+    return ESP_OK;
+}
+
+esp_err_t load_profile(reflow_profile_t *profile) {
+    if (!oven.has_stored) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *profile = oven.stored;
+    return ESP_OK;
+}
+
+void library_get_index(library_index_t *index) {
+    *index = oven.library;
+}
+
+esp_err_t library_store(int slot, const char *name, size_t name_len, const reflow_profile_t *profile) {
+    library_entry_t *entry = &oven.library.slots[slot];
+
+    if (slot < 0 || slot >= LIBRARY_SLOTS || name_len > LIBRARY_NAME_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (oven.store_fails) {
+        return ESP_FAIL;
+    }
+    if (oven.store_busy) {
+        return ESP_ERR_NO_MEM;
+    }
+    *entry = (library_entry_t){
+        .used = 1,
+        .steps = profile->steps,
+        .crc = profile_crc(profile),
+    };
+    memcpy(entry->name, name, name_len);
+    oven.library_profiles[slot] = *profile;
+    return ESP_OK;
+}
+
+esp_err_t library_select(int slot) {
+    if (slot < 0 || slot >= LIBRARY_SLOTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!oven.library.slots[slot].used) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    oven.library.active = slot;
+    oven.profile = oven.library_profiles[slot];
+    return ESP_OK;
+}
+
+esp_err_t library_delete(int slot) {
+    if (slot < 0 || slot >= LIBRARY_SLOTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!oven.library.slots[slot].used) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    memset(&oven.library.slots[slot], 0, sizeof oven.library.slots[slot]);
+    if (oven.library.active == slot) {
+        oven.library.active = LIBRARY_NONE;
+    }
+    return ESP_OK;
+}
+
+void persist_get_stats(persist_stats_t *stats) {
+    *stats = oven.storage;
+}
+
+void get_profile(reflow_profile_t *profile) {
+    *profile = oven.profile;
+}
+
+void set_profile(const reflow_profile_t *profile) {
+    oven.profile = *profile;
+}
+
+int get_profile_steps(void) {
+    return oven.profile.steps;
+}
+
+uint32_t get_profile_crc(void) {
+    return profile_crc(&oven.profile);
+}
+
+void set_manual_power(int channel, uint16_t power) {
+    oven.manual_power[channel] = power;
+}
+
+int get_manual_power(int channel) {
+    return oven.manual_power[channel];
+}
+
+void set_zone_offset(int channel, int offset) {
+    oven.zone_offset[channel] = offset;
+}
+
+int get_zone_offset(int channel) {
+    return oven.zone_offset[channel];
+}
+
+void quality_get_history(quality_history_t *history) {
+    *history = oven.quality;
+}
+
+uint32_t quality_get_total(void) {
+    return oven.quality.total;
+}
+
+void reset_calibration(void) {
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        oven.zone_offset[ch] = 0;
+    }
+}
+
+uint16_t actuator_get_power(int channel) {
+    return oven.manual_power[channel] >= 0 ? oven.manual_power[channel] : 0;
+}
+
+uint32_t energy_get_run(void) {
+    return oven.run_energy;
+}
+
+uint32_t energy_get_step(void) {
+    return oven.step_energy;
+}
+
+void telemetry_set_rate(int stream, uint8_t hz) {
+    oven.rate[stream] = hz;
+}
+
+uint8_t telemetry_get_rate(int stream) {
+    return oven.rate[stream];
+}
+
+int runlog_read(uint32_t stream, uint32_t offset, uint8_t *buf, int len) {
+    runlog_index_t index = {
+        .run = oven.logged_run,
+        .size = oven.logged_len,
+        .status = RUNLOG_COMPLETE,
+    };
+    const uint8_t *data = (const uint8_t *)&index;
+    uint32_t size = sizeof index;
+
+    if (stream != RUNLOG_STREAM_INDEX) {
+        if (stream != oven.logged_run) {
+            return -1;
+        }
+        data = oven.logged;
+        size = oven.logged_len;
+    }
+    if (offset >= size) {
+        return 0;
+    }
+    if (len > size - offset) {
+        len = size - offset;
+    }
+    memcpy(buf, &data[offset], len);
+    return len;
+}
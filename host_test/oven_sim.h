@@ -0,0 +1,50 @@
+#ifndef H_OVEN_SIM_
+#define H_OVEN_SIM_
+
+/*
+ * Stand-in for the controller, actuator, energy and telemetry modules, so
+ * the protocol layer links and runs on the host. Every call only reads or
+ * writes this state, which the harness sets up and checks directly.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "controller.h"
+#include "actuator.h"
+#include "telemetry.h"
+#include "runlog.h"
+#include "library.h"
+#include "persist.h"
+#include "quality.h"
+
+typedef struct oven_sim_t {
+    bool running;
+    reflow_phase_t phase;
+    int step;
+    reflow_profile_t profile;
+    reflow_profile_t stored;
+    bool has_stored;
+    bool store_fails;
+    bool store_busy;     // no room left for another pending write
+    int manual_power[ACTUATOR_CHANNELS]; // -1 when under control of the loop
+    int zone_offset[ACTUATOR_CHANNELS];
+    uint32_t run_energy;
+    uint32_t step_energy;
+    uint8_t rate[TELEMETRY_STREAMS];
+    uint16_t elapsed;
+    int starts;
+    int stops;
+    uint32_t logged_run;  // single run kept by the run log
+    uint8_t logged[64];   // its stream
+    uint16_t logged_len;
+    library_index_t library;
+    reflow_profile_t library_profiles[LIBRARY_SLOTS];
+    persist_stats_t storage;
+    quality_history_t quality;
+} oven_sim_t;
+
+extern oven_sim_t oven;
+
+void oven_sim_reset(void);
+
+#endif
@@ -0,0 +1,802 @@
+/*
+ * Host-side loopback test of the BLE protocol layer. main/protocol.c runs
+ * unmodified behind a loopback transport standing in for gatt_svr.c:
+ * scripted read, write and change poll sequences are replayed from several
+ * virtual connections, and every response, status, indication and update
+ * is checked against the script. Each handler call is timed, and a final
+ * pass measures the steady-state cost of every operation.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "protocol.h"
+#include "history.h"
+#include "command.h"
+#include "oven_sim.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CONNS_MAX TELEMETRY_STREAMS
+#define BENCH_ITERATIONS 20000
+
+/* Connection handles, as the host would hand them out */
+#define CONN_A 1
+#define CONN_B 2
+#define CONN_SMALL 3 // default ATT MTU
+#define CONN_UNKNOWN 9
+
+#define BIT(chr) (1u << (chr))
+
+/* Loopback transport state */
+static struct {
+    uint16_t handle;
+    uint16_t mtu;
+    bool connected;
+    uint8_t indication[PROTO_WRITE_MAX];
+    uint16_t indication_len;
+} conns[CONNS_MAX] = {
+    { .handle = CONN_A, .mtu = 247, .connected = true },
+    { .handle = CONN_B, .mtu = 247, .connected = true },
+    { .handle = CONN_SMALL, .mtu = 23, .connected = true },
+};
+static uint32_t updated;
+static struct {
+    uint8_t value[PROTO_VALUE_MAX];
+    uint16_t len;
+} notification[PROTO_CHRS];
+static int64_t now_us;
+
+static int loopback_slot(uint16_t conn) {
+    for (int slot = 0; slot < CONNS_MAX; slot++) {
+        if (conns[slot].handle == conn && conns[slot].connected) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+static bool loopback_connected(uint16_t conn) {
+    return loopback_slot(conn) >= 0;
+}
+
+static uint16_t loopback_mtu(uint16_t conn) {
+    int slot = loopback_slot(conn);
+    return slot >= 0 ? conns[slot].mtu : 23;
+}
+
+/* The host reads the payload back without a connection, as NimBLE does */
+static void loopback_updated(proto_chr_t chr) {
+    updated |= BIT(chr);
+    if (proto_read(PROTO_CONN_NONE, chr, notification[chr].value, sizeof notification[chr].value,
+                   &notification[chr].len) != PROTO_OK) {
+        notification[chr].len = 0;
+    }
+}
+
+static void loopback_indicate(uint16_t conn, proto_chr_t chr, const void *data, uint16_t len) {
+    int slot = loopback_slot(conn);
+    if (slot >= 0) {
+        memcpy(conns[slot].indication, data, len);
+        conns[slot].indication_len = len;
+    }
+}
+
+static int64_t loopback_time_us(void) {
+    return now_us;
+}
+
+static const proto_transport_t loopback = {
+    .slot = loopback_slot,
+    .connected = loopback_connected,
+    .mtu = loopback_mtu,
+    .updated = loopback_updated,
+    .indicate = loopback_indicate,
+    .time_us = loopback_time_us,
+};
+
+/*
+ * A script step. Values are hex strings, spaces are ignored. For reads,
+ * expect is the exact response; for writes, the indication sent back to
+ * the writer, if any. A poll checks the set of characteristics flagged as
+ * updated and, with expect, the notification of chr.
+ */
+typedef enum {
+    OP_READ,
+    OP_WRITE,
+    OP_POLL,
+    OP_ADVANCE,    // virtual clock, by ms
+    OP_DISCONNECT,
+    OP_CONNECT,
+    OP_CALL,       // change the oven state behind the protocol's back
+} op_t;
+
+typedef struct step_t {
+    op_t op;
+    uint16_t conn;
+    proto_chr_t chr;
+    const char *data;
+    proto_status_t status;
+    const char *expect;
+    uint32_t notified;
+    uint32_t ms;
+    void (*call)(void);
+} step_t;
+
+typedef struct sequence_t {
+    const char *name;
+    const step_t *steps;
+    size_t count;
+} sequence_t;
+
+#define SEQUENCE(name, steps) { name, steps, ARRAY_SIZE(steps) }
+
+static const char *chr_names[PROTO_CHRS] = {
+    [PROTO_TARGET] = "target",
+    [PROTO_PROFILE] = "profile",
+    [PROTO_NVS_PROFILE] = "nvs profile",
+    [PROTO_AC_FREQ] = "ac freq",
+    [PROTO_DUTY] = "duty",
+    [PROTO_ZONE_OFFSET] = "zone offset",
+    [PROTO_ENERGY] = "energy",
+    [PROTO_TELEMETRY_RATE] = "telemetry rate",
+    [PROTO_RUN_STATE] = "run state",
+    [PROTO_COMMAND] = "command",
+    [PROTO_HISTORY] = "history",
+    [PROTO_PROGRESS] = "progress",
+    [PROTO_RUNLOG] = "run log",
+    [PROTO_LIBRARY] = "library",
+    [PROTO_STORAGE] = "storage",
+    [PROTO_PRESETS] = "presets",
+    [PROTO_QUALITY] = "quality",
+};
+
+/* Handler cost, per characteristic and direction */
+static struct {
+    uint32_t count;
+    double total_ns;
+    double max_ns;
+} cost[PROTO_CHRS][2];
+
+static int failures;
+
+static void start_phase(void) {
+    oven.running = true;
+    oven.phase = REFLOW_RAMP;
+    oven.step = 0;
+}
+
+static void next_step(void) {
+    oven.phase = REFLOW_HOLD;
+    oven.step = 1;
+}
+
+static void tick_elapsed(void) {
+    oven.elapsed += 2;
+}
+
+static void push_history(void) {
+    telemetry_sample_t sample = {
+        .target = 150,
+        .power = 500,
+        .cold_junction = 400,
+        .step = 0,
+    };
+    for (int i = 1; i <= 3; i++) {
+        sample.timestamp = i * 1000;
+        sample.temperature = 380 + i * 20;
+        history_push(&sample);
+    }
+}
+
+static void queue_write(void) {
+    oven.storage.pending = 2;
+    oven.storage.coalesced = 1;
+}
+
+static void complete_write(void) {
+    oven.storage = (persist_stats_t){
+        .writes = 2,
+        .bytes = 400,
+        .coalesced = 1,
+        .last_us = 12000,
+        .max_us = 15000,
+    };
+}
+
+static void fail_write(void) {
+    oven.storage.failed_last = 1;
+    oven.storage.failed = 1;
+}
+
+static void fill_store(void) {
+    oven.store_busy = true;
+}
+
+static void fail_store(void) {
+    oven.store_fails = true;
+}
+
+/* A lead free run that peaked too hot */
+static const quality_summary_t hot_run = {
+    .run = 7,
+    .epoch = 1700000000,
+    .status = RUNLOG_COMPLETE,
+    .flags = QUALITY_FLAG_PEAK_HIGH,
+    .peak = 255 * 4,
+    .liquidus = 217,
+    .time_above_liquidus = 75,
+    .soak = 180,
+    .max_ramp = 180,
+    .max_cooling = 250,
+    .error_mean = -40,
+    .error_max = 300,
+    .error_rms = 120,
+    .duration = 420,
+};
+
+static void summarize_run(void) {
+    oven.quality.runs[0] = hot_run;
+    oven.quality.count = 1;
+    oven.quality.total = 1;
+}
+
+/* Filled in by main() from an encoded profile, see profile_sequence(); reads are offset prefixed */
+static char profile_image[2 * PROFILE_IMAGE_MAX + 1];
+static char profile_read_first[2 * PROTO_READ_MAX + 1];
+static char profile_read_last[2 * PROTO_READ_MAX + 1];
+static char profile_read_body[2 * PROTO_READ_MAX + 1];
+static char profile_notified[2 * sizeof(profile_header_t) + 1];
+static char profile_chunk_first[2 * PROTO_WRITE_MAX + 1];
+static char profile_chunk_last[2 * PROTO_WRITE_MAX + 1];
+static char profile_chunk_stray[2 * PROTO_WRITE_MAX + 1];
+static char profile_corrupt[2 * PROTO_WRITE_MAX + 1];
+static char default_profile_image[2 * PROFILE_IMAGE_MAX + 1];
+
+/* Filled in by main(), see library_sequence() */
+static char library_empty[2 * sizeof(library_index_t) + 1];
+static char library_stored[2 * sizeof(library_index_t) + 1];
+static char library_selected[2 * sizeof(library_index_t) + 1];
+
+/* Filled in by main(), see presets_sequence() */
+static char snbi_image[2 * PROFILE_IMAGE_MAX + 1];
+
+/* Filled in by main(), see quality_sequence() */
+static char quality_one[2 * sizeof(quality_history_t) + 1];
+
+static const step_t basic_steps[] = {
+    { OP_POLL, .notified = 0 },
+    { OP_READ, CONN_A, PROTO_TARGET, .expect = "fa 00" },
+    { OP_WRITE, CONN_A, PROTO_TARGET, "c4 09" },
+    { OP_READ, CONN_B, PROTO_TARGET, .expect = "c4 09" },
+    { OP_WRITE, CONN_A, PROTO_TARGET, "c4 09 00", PROTO_ERR_LENGTH },
+    /* Same range as the command: 0 to 300 °C */
+    { OP_WRITE, CONN_A, PROTO_TARGET, "ffff", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_A, PROTO_TARGET, "b90b", PROTO_ERR_VALUE },
+    { OP_READ, CONN_A, PROTO_TARGET, .expect = "c4 09" },
+    { OP_POLL, .notified = BIT(PROTO_TARGET) },
+    { OP_POLL, .notified = 0 },
+    { OP_READ, CONN_A, PROTO_AC_FREQ, .expect = "10 27" },
+    { OP_WRITE, CONN_A, PROTO_AC_FREQ, "10 27", PROTO_ERR_NOT_PERMITTED },
+    { OP_READ, CONN_A, PROTO_ENERGY, .expect = "00000000 00000000" },
+    { OP_READ, CONN_A, PROTO_COMMAND, .status = PROTO_ERR_NOT_PERMITTED },
+};
+
+static const step_t duty_steps[] = {
+    { OP_POLL },
+    { OP_READ, CONN_A, PROTO_DUTY, .expect = "0000 0000" },
+    { OP_READ, CONN_A, PROTO_RUN_STATE, .expect = "00 ffff 00" },
+    { OP_WRITE, CONN_A, PROTO_DUTY, "f4 01" },
+    { OP_READ, CONN_B, PROTO_DUTY, .expect = "f401 f401" },
+    { OP_READ, CONN_B, PROTO_RUN_STATE, .expect = "00 ffff 03" },
+    /* Rate limited, flagged once the interval has passed */
+    { OP_POLL, .notified = BIT(PROTO_RUN_STATE) },
+    { OP_ADVANCE, .ms = 600 },
+    { OP_POLL, .notified = BIT(PROTO_DUTY) },
+    { OP_WRITE, CONN_A, PROTO_DUTY, "6400 c800" },
+    { OP_READ, CONN_A, PROTO_DUTY, .expect = "6400 c800" },
+    { OP_POLL, .notified = 0 },
+    { OP_ADVANCE, .ms = 600 },
+    { OP_POLL, .notified = BIT(PROTO_DUTY) },
+    { OP_WRITE, CONN_A, PROTO_DUTY, "e9 03", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_A, PROTO_DUTY, "6400 c800 0000", PROTO_ERR_LENGTH },
+    { OP_READ, CONN_A, PROTO_DUTY, .expect = "6400 c800" },
+    { OP_WRITE, CONN_A, PROTO_ZONE_OFFSET, "0000 ceff" },
+    { OP_READ, CONN_B, PROTO_ZONE_OFFSET, .expect = "0000 ceff" },
+    { OP_WRITE, CONN_A, PROTO_ZONE_OFFSET, "0000", PROTO_ERR_LENGTH },
+};
+
+static const step_t telemetry_rate_steps[] = {
+    { OP_READ, CONN_A, PROTO_TELEMETRY_RATE, .expect = "0a" },
+    { OP_WRITE, CONN_A, PROTO_TELEMETRY_RATE, "05" },
+    { OP_READ, CONN_A, PROTO_TELEMETRY_RATE, .expect = "05" },
+    { OP_READ, CONN_B, PROTO_TELEMETRY_RATE, .expect = "0a" },
+    { OP_WRITE, CONN_B, PROTO_TELEMETRY_RATE, "00", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_B, PROTO_TELEMETRY_RATE, "15", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_B, PROTO_TELEMETRY_RATE, "0505", PROTO_ERR_LENGTH },
+    { OP_READ, CONN_UNKNOWN, PROTO_TELEMETRY_RATE, .status = PROTO_ERR_UNLIKELY },
+};
+
+static const step_t command_steps[] = {
+    /* Set the target and start: two OK statuses indicated to the writer */
+    { OP_WRITE, CONN_A, PROTO_COMMAND, "01 02 dc05 04 00", .expect = "02 00 00" },
+    { OP_READ, CONN_B, PROTO_TARGET, .expect = "dc 05" },
+    { OP_READ, CONN_B, PROTO_RUN_STATE, .expect = "01 0000 00" },
+    /* Starting again does not start anything */
+    { OP_WRITE, CONN_B, PROTO_COMMAND, "04 00", .expect = "01 05" },
+    /* A rejected command leaves the oven untouched */
+    { OP_WRITE, CONN_B, PROTO_COMMAND, "05 00 02 03 00 e903", .expect = "02 04 03" },
+    { OP_READ, CONN_B, PROTO_RUN_STATE, .expect = "01 0000 00" },
+    { OP_WRITE, CONN_B, PROTO_COMMAND, "01 05 00", PROTO_ERR_LENGTH },
+    { OP_WRITE, CONN_B, PROTO_COMMAND, "05", PROTO_ERR_LENGTH },
+    /* The calibration reset also clears the zone offsets */
+    { OP_WRITE, CONN_A, PROTO_COMMAND, "03 03 01 ceff 09 00", .expect = "02 00 00" },
+    { OP_READ, CONN_B, PROTO_ZONE_OFFSET, .expect = "0000 0000" },
+    { OP_WRITE, CONN_A, PROTO_COMMAND, "09 01 00", .expect = "01 02" },
+};
+
+static const step_t progress_steps[] = {
+    { OP_POLL },
+    { OP_CALL, .call = start_phase },
+    { OP_POLL, .notified = BIT(PROTO_RUN_STATE) | BIT(PROTO_PROGRESS) },
+    { OP_READ, CONN_A, PROTO_PROGRESS, .expect = "01 0000 0200 0000 0000 0000 6400 0000" },
+    /* Running times alone only every few seconds */
+    { OP_CALL, .call = tick_elapsed },
+    { OP_POLL, .notified = 0 },
+    { OP_CALL, .call = tick_elapsed },
+    { OP_CALL, .call = tick_elapsed },
+    { OP_POLL, .notified = BIT(PROTO_PROGRESS) },
+    { OP_CALL, .call = next_step },
+    { OP_POLL, .notified = BIT(PROTO_RUN_STATE) | BIT(PROTO_PROGRESS) },
+};
+
+static const step_t history_steps[] = {
+    { OP_READ, CONN_SMALL, PROTO_HISTORY, .expect = "00000000 01 00" },
+    { OP_CALL, .call = push_history },
+    /* A 23 bytes MTU carries a single sample per read */
+    { OP_READ, CONN_SMALL, PROTO_HISTORY, .expect = "00000000 01 01 e8030000 9001 9600 f401 9001 0000 00" },
+    { OP_READ, CONN_SMALL, PROTO_HISTORY, .expect = "01000000 01 01 d0070000 a401 9600 f401 9001 0000 00" },
+    { OP_READ, CONN_SMALL, PROTO_HISTORY, .expect = "02000000 01 00" },
+    { OP_READ, CONN_A, PROTO_HISTORY,
+      .expect = "00000000 01 02 e8030000 9001 9600 f401 9001 0000 00 d0070000 a401 9600 f401 9001 0000 00" },
+    { OP_WRITE, CONN_SMALL, PROTO_HISTORY, "01000000" },
+    { OP_READ, CONN_SMALL, PROTO_HISTORY, .expect = "01000000 01 01 d0070000 a401 9600 f401 9001 0000 00" },
+    { OP_WRITE, CONN_SMALL, PROTO_HISTORY, "0100", PROTO_ERR_LENGTH },
+};
+
+static const step_t runlog_steps[] = {
+    /* The index stream is selected after connecting */
+    { OP_READ, CONN_SMALL, PROTO_RUNLOG, .expect = "00000000 00000000 07000000 00000000 28000000 00" },
+    { OP_READ, CONN_SMALL, PROTO_RUNLOG, .expect = "00000000 0d000000" },
+    /* A 23 bytes MTU carries 14 bytes of the run per read */
+    { OP_WRITE, CONN_SMALL, PROTO_RUNLOG, "07000000" },
+    { OP_READ, CONN_SMALL, PROTO_RUNLOG, .expect = "07000000 00000000 000102030405060708090a0b0c0d" },
+    { OP_READ, CONN_SMALL, PROTO_RUNLOG, .expect = "07000000 0e000000 0e0f101112131415161718191a1b" },
+    { OP_WRITE, CONN_SMALL, PROTO_RUNLOG, "07000000 24000000" },
+    { OP_READ, CONN_SMALL, PROTO_RUNLOG, .expect = "07000000 24000000 24252627" },
+    { OP_READ, CONN_SMALL, PROTO_RUNLOG, .expect = "07000000 28000000" },
+    { OP_READ, CONN_A, PROTO_RUNLOG, .expect = "00000000 00000000 07000000 00000000 28000000 00" },
+    { OP_WRITE, CONN_A, PROTO_RUNLOG, "08000000" },
+    { OP_READ, CONN_A, PROTO_RUNLOG, .status = PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_A, PROTO_RUNLOG, "0700", PROTO_ERR_LENGTH },
+};
+
+static const step_t library_steps[] = {
+    { OP_POLL },
+    { OP_READ, CONN_A, PROTO_LIBRARY, .expect = library_empty },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "01 02", PROTO_ERR_VALUE },
+    /* The oven profile into slot 2, as "Lead free" */
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "03 02 4c65616420667265 65" },
+    { OP_READ, CONN_B, PROTO_LIBRARY, .expect = library_stored },
+    { OP_WRITE, CONN_A, PROTO_PROFILE, profile_chunk_first },
+    { OP_WRITE, CONN_A, PROTO_PROFILE, profile_chunk_last },
+    { OP_POLL, .notified = BIT(PROTO_PROFILE) | BIT(PROTO_PROGRESS) },
+    /* Selecting brings the stored profile back */
+    { OP_WRITE, CONN_B, PROTO_LIBRARY, "01 02" },
+    { OP_READ, CONN_A, PROTO_PROFILE, .expect = default_profile_image },
+    { OP_POLL, .notified = BIT(PROTO_PROFILE) | BIT(PROTO_PROGRESS) },
+    { OP_READ, CONN_A, PROTO_LIBRARY, .expect = library_selected },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "02 02" },
+    { OP_READ, CONN_A, PROTO_LIBRARY, .expect = library_empty },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "02 02", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "01 10", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "07 00", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "01", PROTO_ERR_LENGTH },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "03 00", PROTO_ERR_LENGTH },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "03 00 3031323334353637 3839303132333435 36", PROTO_ERR_LENGTH },
+    { OP_CALL, .call = fill_store },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "03 00 41", PROTO_ERR_BUSY },
+    { OP_CALL, .call = fail_store },
+    { OP_WRITE, CONN_A, PROTO_LIBRARY, "03 00 41", PROTO_ERR_FAILED },
+};
+
+static const step_t storage_steps[] = {
+    { OP_POLL },
+    { OP_READ, CONN_A, PROTO_STORAGE, .expect = "00 00 00000000 00000000 00000000 00000000 00000000 00000000 00000000" },
+    { OP_WRITE, CONN_A, PROTO_STORAGE, "00", PROTO_ERR_NOT_PERMITTED },
+    /* Requests, then their completion, are notified */
+    { OP_CALL, .call = queue_write },
+    { OP_POLL, .notified = BIT(PROTO_STORAGE) },
+    { OP_READ, CONN_B, PROTO_STORAGE, .expect = "02 00 00000000 00000000 00000000 01000000 00000000 00000000 00000000" },
+    { OP_CALL, .call = complete_write },
+    { OP_POLL, .notified = BIT(PROTO_STORAGE) },
+    { OP_READ, CONN_B, PROTO_STORAGE, .expect = "00 00 02000000 00000000 90010000 01000000 00000000 e02e0000 983a0000" },
+    { OP_CALL, .call = fail_write },
+    { OP_POLL, .notified = BIT(PROTO_STORAGE) },
+    { OP_READ, CONN_A, PROTO_STORAGE, .expect = "00 01 02000000 00000000 90010000 01000000 01000000 e02e0000 983a0000" },
+    { OP_POLL, .notified = 0 },
+};
+
+static const step_t presets_steps[] = {
+    { OP_POLL },
+    { OP_READ, CONN_A, PROTO_PRESETS },
+    /* Selected straight into the oven profile */
+    { OP_WRITE, CONN_B, PROTO_PRESETS, "02" },
+    { OP_READ, CONN_A, PROTO_PROFILE, .expect = snbi_image },
+    { OP_POLL, .notified = BIT(PROTO_PROFILE) | BIT(PROTO_PROGRESS) },
+    { OP_READ, CONN_A, PROTO_NVS_PROFILE, .expect = "0000" },
+    { OP_WRITE, CONN_B, PROTO_PRESETS, "05", PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_B, PROTO_PRESETS, "0200", PROTO_ERR_LENGTH },
+    { OP_READ, CONN_A, PROTO_PROFILE, .expect = snbi_image },
+};
+
+static const step_t quality_steps[] = {
+    { OP_POLL },
+    { OP_READ, CONN_A, PROTO_QUALITY, .expect = "01 00 0000 00000000" },
+    { OP_CALL, .call = summarize_run },
+    /* Notified with the total alone, the history is read */
+    { OP_POLL, .chr = PROTO_QUALITY, .expect = "01000000", .notified = BIT(PROTO_QUALITY) },
+    { OP_READ, CONN_B, PROTO_QUALITY, .expect = quality_one },
+    { OP_POLL, .notified = 0 },
+    { OP_WRITE, CONN_A, PROTO_QUALITY, "00", PROTO_ERR_NOT_PERMITTED },
+};
+
+static const step_t profile_steps[] = {
+    { OP_POLL },
+    { OP_READ, CONN_A, PROTO_NVS_PROFILE, .expect = "0000" },
+    /* Chunked upload, another central cannot take over meanwhile */
+    { OP_WRITE, CONN_A, PROTO_PROFILE, profile_chunk_first },
+    { OP_WRITE, CONN_B, PROTO_PROFILE, profile_chunk_first, PROTO_ERR_BUSY },
+    { OP_READ, CONN_B, PROTO_PROFILE, .expect = default_profile_image },
+    { OP_POLL, .notified = 0 },
+    { OP_WRITE, CONN_A, PROTO_PROFILE, profile_chunk_last },
+    { OP_READ, CONN_B, PROTO_PROFILE, .expect = profile_image },
+    /* Notified with the header alone, whatever the image size */
+    { OP_POLL, .chr = PROTO_PROFILE, .expect = profile_notified,
+      .notified = BIT(PROTO_PROFILE) | BIT(PROTO_PROGRESS) },
+    /* Out of sequence chunks abort the upload */
+    { OP_WRITE, CONN_A, PROTO_NVS_PROFILE, profile_chunk_first },
+    { OP_WRITE, CONN_A, PROTO_NVS_PROFILE, profile_chunk_stray, PROTO_ERR_OFFSET },
+    { OP_WRITE, CONN_A, PROTO_NVS_PROFILE, profile_chunk_last, PROTO_ERR_OFFSET },
+    /* An upload left behind by a disconnected central is taken over */
+    { OP_WRITE, CONN_A, PROTO_NVS_PROFILE, profile_chunk_first },
+    { OP_DISCONNECT, CONN_A },
+    { OP_WRITE, CONN_B, PROTO_NVS_PROFILE, profile_chunk_first },
+    { OP_WRITE, CONN_B, PROTO_NVS_PROFILE, profile_chunk_last },
+    { OP_READ, CONN_B, PROTO_NVS_PROFILE, .expect = profile_image },
+    { OP_CONNECT, CONN_A },
+    { OP_WRITE, CONN_A, PROTO_PROFILE, profile_corrupt, PROTO_ERR_VALUE },
+    { OP_WRITE, CONN_A, PROTO_PROFILE, "00", PROTO_ERR_LENGTH },
+    { OP_CALL, .call = fail_store },
+    { OP_WRITE, CONN_A, PROTO_NVS_PROFILE, profile_chunk_first },
+    { OP_WRITE, CONN_A, PROTO_NVS_PROFILE, profile_chunk_last, PROTO_ERR_FAILED },
+    { OP_READ, CONN_A, PROTO_PROFILE, .expect = profile_image },
+    /* A 23 bytes MTU reads the image in two chunks, then starts over */
+    { OP_READ, CONN_SMALL, PROTO_PROFILE, .expect = profile_read_first },
+    { OP_READ, CONN_SMALL, PROTO_PROFILE, .expect = profile_read_last },
+    { OP_READ, CONN_SMALL, PROTO_PROFILE, .expect = profile_read_first },
+    { OP_WRITE, CONN_SMALL, PROTO_PROFILE, "0800" },
+    { OP_READ, CONN_SMALL, PROTO_PROFILE, .expect = profile_read_body },
+    { OP_READ, CONN_SMALL, PROTO_PROFILE, .expect = profile_read_first },
+    { OP_WRITE, CONN_SMALL, PROTO_PROFILE, "ffff", PROTO_ERR_OFFSET },
+    /* Each profile has its own cursor */
+    { OP_WRITE, CONN_SMALL, PROTO_NVS_PROFILE, "1000" },
+    { OP_READ, CONN_SMALL, PROTO_NVS_PROFILE, .expect = "1000 2800 b400 1e00 f500" },
+    { OP_READ, CONN_SMALL, PROTO_PROFILE, .expect = profile_read_last },
+};
+
+static const sequence_t sequences[] = {
+    SEQUENCE("basic", basic_steps),
+    SEQUENCE("duty", duty_steps),
+    SEQUENCE("telemetry rate", telemetry_rate_steps),
+    SEQUENCE("command", command_steps),
+    SEQUENCE("progress", progress_steps),
+    SEQUENCE("history", history_steps),
+    SEQUENCE("run log", runlog_steps),
+    SEQUENCE("library", library_steps),
+    SEQUENCE("storage", storage_steps),
+    SEQUENCE("presets", presets_steps),
+    SEQUENCE("quality", quality_steps),
+    SEQUENCE("profile", profile_steps),
+};
+
+static uint16_t from_hex(const char *hex, uint8_t *buf, size_t size) {
+    uint16_t len = 0;
+
+    while (*hex) {
+        if (isspace((unsigned char)*hex)) {
+            hex++;
+            continue;
+        }
+        if (len == size || !isxdigit((unsigned char)hex[0]) || !isxdigit((unsigned char)hex[1])) {
+            fprintf(stderr, "bad hex string\n");
+            exit(EXIT_FAILURE);
+        }
+        char byte[3] = { hex[0], hex[1], 0 };
+        buf[len++] = strtoul(byte, NULL, 16);
+        hex += 2;
+    }
+    return len;
+}
+
+static void to_hex(const uint8_t *data, size_t len, char *hex) {
+    for (size_t i = 0; i < len; i++) {
+        sprintf(&hex[2 * i], "%02x", data[i]);
+    }
+    hex[2 * len] = 0;
+}
+
+static void chunk_hex(uint16_t offset, const uint8_t *data, size_t len, char *hex) {
+    uint8_t chunk[PROTO_WRITE_MAX];
+    memcpy(chunk, &offset, sizeof offset);
+    memcpy(&chunk[sizeof offset], data, len);
+    to_hex(chunk, sizeof offset + len, hex);
+}
+
+/* A three step profile, uploaded in two chunks and read back in two at the default MTU */
+static void profile_sequence(void) {
+    reflow_profile_t profile = {
+        .steps = 3,
+        .cooling_rate = 30,
+        .unload_temperature = 60,
+        .data = { { 60, 150 }, { 40, 180 }, { 30, 245 } },
+    };
+    uint8_t image[PROFILE_IMAGE_MAX];
+    size_t len = profile_encode(&oven.profile, image, sizeof image);
+    size_t split;
+
+    chunk_hex(0, image, len, default_profile_image);
+
+    len = profile_encode(&profile, image, sizeof image);
+    split = len / 2;
+    chunk_hex(0, image, len, profile_image);
+    chunk_hex(0, image, 23 - 1 - 2, profile_read_first);
+    chunk_hex(23 - 1 - 2, &image[23 - 1 - 2], len - (23 - 1 - 2), profile_read_last);
+    chunk_hex(8, &image[8], len - 8, profile_read_body);
+    to_hex(image, sizeof(profile_header_t), profile_notified);
+    chunk_hex(0, image, split, profile_chunk_first);
+    chunk_hex(split, &image[split], len - split, profile_chunk_last);
+    chunk_hex(split + 2, &image[split], 2, profile_chunk_stray);
+    image[len - 1] ^= 0xff;
+    chunk_hex(0, image, len, profile_corrupt);
+}
+
+/* The index of an empty library, then with the default profile in slot 2 */
+static void library_sequence(void) {
+    library_index_t index = {
+        .version = LIBRARY_VERSION,
+        .active = LIBRARY_NONE,
+    };
+
+    to_hex((const uint8_t *)&index, sizeof index, library_empty);
+    index.slots[2] = (library_entry_t){
+        .used = 1,
+        .steps = oven.profile.steps,
+        .crc = profile_crc(&oven.profile),
+        .name = "Lead free",
+    };
+    to_hex((const uint8_t *)&index, sizeof index, library_stored);
+    index.active = 2;
+    to_hex((const uint8_t *)&index, sizeof index, library_selected);
+}
+
+/* Sn42Bi58, as its paste datasheet has it */
+static void presets_sequence(void) {
+    reflow_profile_t profile = {
+        .steps = 4,
+        .cooling_rate = 20,
+        .data = { { 60, 90 }, { 90, 120 }, { 30, 138 }, { 15, 170 } },
+    };
+    uint8_t image[PROFILE_IMAGE_MAX];
+    size_t len = profile_encode(&profile, image, sizeof image);
+
+    chunk_hex(0, image, len, snbi_image);
+}
+
+/* The history header, then the single summary */
+static void quality_sequence(void) {
+    quality_history_t history = {
+        .version = QUALITY_VERSION,
+        .count = 1,
+        .total = 1,
+        .runs = { hot_run },
+    };
+
+    to_hex((const uint8_t *)&history, offsetof(quality_history_t, runs) + sizeof hot_run, quality_one);
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+static void record(proto_chr_t chr, int write, double ns) {
+    cost[chr][write].count++;
+    cost[chr][write].total_ns += ns;
+    if (ns > cost[chr][write].max_ns) {
+        cost[chr][write].max_ns = ns;
+    }
+}
+
+static void check(bool ok, const sequence_t *sequence, size_t index, const char *what) {
+    if (!ok) {
+        printf("FAIL: %s, step %zu: %s\n", sequence->name, index, what);
+        failures++;
+    }
+}
+
+static void check_bytes(const uint8_t *data, uint16_t len, const char *expect,
+                        const sequence_t *sequence, size_t index, const char *what) {
+    uint8_t buf[PROTO_READ_MAX];
+    uint16_t expect_len = from_hex(expect, buf, sizeof buf);
+
+    if (len != expect_len || memcmp(data, buf, len) != 0) {
+        char hex[2 * PROTO_READ_MAX + 1];
+        to_hex(data, len, hex);
+        printf("FAIL: %s, step %zu: %s\n  got      %s\n  expected %s\n",
+               sequence->name, index, what, hex, expect);
+        failures++;
+    }
+}
+
+static void replay(const sequence_t *sequence) {
+    for (size_t i = 0; i < sequence->count; i++) {
+        const step_t *step = &sequence->steps[i];
+        int slot = loopback_slot(step->conn);
+        uint8_t buf[PROTO_READ_MAX];
+        struct timespec start, end;
+        proto_status_t status;
+        uint16_t len;
+
+        switch (step->op) {
+        case OP_READ:
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            status = proto_read(step->conn, step->chr, buf, sizeof buf, &len);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            record(step->chr, 0, elapsed_ns(&start, &end));
+            check(status == step->status, sequence, i, "read status");
+            if (status == PROTO_OK && step->expect) {
+                check_bytes(buf, len, step->expect, sequence, i, chr_names[step->chr]);
+            }
+            break;
+
+        case OP_WRITE:
+            len = from_hex(step->data, buf, PROTO_WRITE_MAX);
+            if (slot >= 0) {
+                conns[slot].indication_len = 0;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            status = proto_write(step->conn, step->chr, buf, len);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            record(step->chr, 1, elapsed_ns(&start, &end));
+            check(status == step->status, sequence, i, "write status");
+            if (step->expect && slot >= 0) {
+                check_bytes(conns[slot].indication, conns[slot].indication_len, step->expect,
+                            sequence, i, "indication");
+            }
+            break;
+
+        case OP_POLL:
+            updated = 0;
+            proto_poll_changes();
+            check(updated == step->notified, sequence, i, "updated characteristics");
+            if (step->expect) {
+                check_bytes(notification[step->chr].value, notification[step->chr].len, step->expect,
+                            sequence, i, "notification");
+            }
+            break;
+
+        case OP_ADVANCE:
+            now_us += (int64_t)step->ms * 1000;
+            break;
+
+        case OP_DISCONNECT:
+        case OP_CONNECT:
+            for (int s = 0; s < CONNS_MAX; s++) {
+                if (conns[s].handle == step->conn) {
+                    conns[s].connected = step->op == OP_CONNECT;
+                }
+            }
+            break;
+
+        case OP_CALL:
+            step->call();
+            break;
+        }
+    }
+}
+
+/* Steady-state cost of the handlers, without the script bookkeeping */
+static void benchmark(void) {
+    static const struct {
+        proto_chr_t chr;
+        const char *data; // NULL for a read
+    } ops[] = {
+        { PROTO_TARGET },
+        { PROTO_TARGET, "c4 09" },
+        { PROTO_DUTY },
+        { PROTO_DUTY, "f401 f401" },
+        { PROTO_RUN_STATE },
+        { PROTO_PROGRESS },
+        { PROTO_PROFILE },
+        { PROTO_HISTORY },
+        { PROTO_COMMAND, "01 02 c409 03 03 00 0000" },
+    };
+
+    printf("\n%-16s %-5s %10s\n", "characteristic", "op", "ns/op");
+    for (size_t i = 0; i < ARRAY_SIZE(ops); i++) {
+        uint8_t buf[PROTO_READ_MAX];
+        uint16_t len = ops[i].data ? from_hex(ops[i].data, buf, PROTO_WRITE_MAX) : 0;
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int n = 0; n < BENCH_ITERATIONS; n++) {
+            if (ops[i].data) {
+                proto_write(CONN_A, ops[i].chr, buf, len);
+            } else {
+                proto_read(CONN_A, ops[i].chr, buf, sizeof buf, &len);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("%-16s %-5s %10.0f\n", chr_names[ops[i].chr], ops[i].data ? "write" : "read",
+               elapsed_ns(&start, &end) / BENCH_ITERATIONS);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n = 0; n < BENCH_ITERATIONS; n++) {
+        proto_poll_changes();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%-16s %-5s %10.0f\n", "change poll", "", elapsed_ns(&start, &end) / BENCH_ITERATIONS);
+}
+
+int main(void) {
+    for (size_t s = 0; s < ARRAY_SIZE(sequences); s++) {
+        /* Every sequence starts from a freshly booted device */
+        oven_sim_reset();
+        history_init();
+        proto_init(&loopback);
+        profile_sequence();
+        library_sequence();
+        presets_sequence();
+        quality_sequence();
+        for (int slot = 0; slot < CONNS_MAX; slot++) {
+            conns[slot].connected = true;
+        }
+
+        int before = failures;
+        replay(&sequences[s]);
+        printf("%-16s %3zu steps %s\n", sequences[s].name, sequences[s].count,
+               failures == before ? "ok" : "FAILED");
+    }
+
+    printf("\n%-16s %-5s %6s %10s %10s\n", "characteristic", "op", "calls", "mean ns", "max ns");
+    for (int chr = 0; chr < PROTO_CHRS; chr++) {
+        for (int write = 0; write < 2; write++) {
+            if (cost[chr][write].count) {
+                printf("%-16s %-5s %6u %10.0f %10.0f\n", chr_names[chr], write ? "write" : "read",
+                       cost[chr][write].count, cost[chr][write].total_ns / cost[chr][write].count,
+                       cost[chr][write].max_ns);
+            }
+        }
+    }
+
+    oven_sim_reset();
+    proto_init(&loopback);
+    benchmark();
+
+    printf("\n%d failure(s)\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,298 @@
+/*
+ * Host-side round trip of the telemetry batches. main/telemetry.c runs
+ * unmodified with bler_tx_telemetry() captured here: synthetic controller
+ * samples are pushed at the controller rate, every notification is decoded
+ * the way a client does, and the decoded samples are checked against the
+ * pushed ones. Each case also checks the notification size against the
+ * ATT payload, the flush latency and the field masks the deltas used.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "bler946.h"
+#include "telemetry.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CONTROLLER_PERIOD_MS 50 // as in controller.c
+#define FLUSH_MS 500            // TELEMETRY_FLUSH_MS, as in telemetry.c
+#define HEADER_LEN 2
+#define FIELDS 7
+#define SAMPLES_MAX 2000
+
+typedef enum {
+    WAVE_STEADY,   // temperature dithering by one LSB, nothing else moving
+    WAVE_RUN,      // a reflow run: ramps, steps, power cycling, a fault
+    WAVE_EXTREME,  // every field jumping across its whole range
+} wave_t;
+
+typedef struct case_t {
+    const char *name;
+    wave_t wave;
+    uint8_t rate;           // Hz, 0 keeps the default
+    uint16_t max_len;       // ATT payload, 0 when not subscribed
+    int jitter_ms;          // added to the controller period, which never runs short
+    int rate_change_at;     // sample index, 0 for none
+    int reset_at;           // sample index, 0 for none
+    double max_bytes;       // per sample after the first of a batch, 0 unchecked
+    int masks;              // fields the deltas must have carried, -1 unchecked
+} case_t;
+
+static const case_t cases[] = {
+    { "steady",        WAVE_STEADY,  10, 244, 0,  0,   0,   2.0, 0x02 },
+    { "steady-20hz",   WAVE_STEADY,  20, 244, 0,  0,   0,   2.0, 0x02 },
+    { "steady-mtu23",  WAVE_STEADY,  10, 20,  0,  0,   0,   2.0, 0x02 },
+    { "run",           WAVE_RUN,     10, 244, 15, 0,   0,   0,   0x7f },
+    { "run-1hz",       WAVE_RUN,     1,  244, 15, 0,   0,   0,   0 },    // one sample per batch
+    { "run-mtu23",     WAVE_RUN,     20, 20,  15, 0,   0,   0,   -1 },
+    { "run-rate",      WAVE_RUN,     5,  244, 15, 400, 0,   0,   0x7f },
+    { "run-reset",     WAVE_RUN,     20, 100, 15, 0,   600, 0,   0x7f },
+    { "extreme",       WAVE_EXTREME, 20, 244, 15, 0,   0,   0,   0x7f },
+    { "extreme-mtu23", WAVE_EXTREME, 20, 20,  15, 0,   0,   0,   0 },    // no delta fits
+    { "unsubscribed",  WAVE_RUN,     10, 0,   0,  0,   0,   0,   0 },
+};
+
+/* What the stream under test notified, decoded */
+static struct {
+    uint16_t max_len;
+    telemetry_sample_t decoded[SAMPLES_MAX];
+    int decoded_count;
+    int batches;
+    int bytes;              // of the deltas
+    int deltas;
+    uint8_t masks;          // fields any delta carried
+    bool oversized;
+    bool malformed;
+    uint32_t max_span_ms;   // first to last sample of a batch
+} rx;
+
+static int failures;
+
+static void check(bool ok, const char *what, const char *name) {
+    if (!ok) {
+        printf("FAIL: %s (%s)\n", what, name);
+        failures++;
+    }
+}
+
+static int get_varint(const uint8_t *buf, int len, int32_t *value) {
+    uint32_t zigzag = 0;
+    int pos = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (pos >= len) {
+            return -1;
+        }
+        zigzag |= (uint32_t)(buf[pos] & 0x7f) << shift;
+        if (!(buf[pos++] & 0x80)) {
+            *value = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+            return pos;
+        }
+    }
+    return -1;
+}
+
+/* Client side of the notification layout documented in telemetry.c */
+static bool decode(const uint8_t *buf, int len) {
+    telemetry_sample_t sample;
+    int pos = HEADER_LEN + sizeof sample;
+
+    if (len < pos || buf[0] == 0 || buf[1] == 0) {
+        return false;
+    }
+    uint32_t interval = 1000 / buf[1];
+    memcpy(&sample, &buf[HEADER_LEN], sizeof sample);
+    uint32_t first = sample.timestamp;
+    for (int n = 0; n < buf[0]; n++) {
+        if (n > 0) {
+            int start = pos;
+            if (pos >= len) {
+                return false;
+            }
+            uint8_t mask = buf[pos++];
+            int32_t delta[FIELDS] = {0};
+            for (int field = 0; field < FIELDS; field++) {
+                if (mask & (1 << field)) {
+                    int used = get_varint(&buf[pos], len - pos, &delta[field]);
+                    if (used < 0) {
+                        return false;
+                    }
+                    pos += used;
+                }
+            }
+            if (mask >> FIELDS) {
+                return false;
+            }
+            sample.timestamp += interval + delta[0];
+            sample.temperature += delta[1];
+            sample.target += delta[2];
+            sample.power += delta[3];
+            sample.cold_junction += delta[4];
+            sample.step += delta[5];
+            sample.faults += delta[6];
+            rx.masks |= mask;
+            rx.bytes += pos - start;
+            rx.deltas++;
+        }
+        if (rx.decoded_count < SAMPLES_MAX) {
+            rx.decoded[rx.decoded_count++] = sample;
+        }
+    }
+    if (sample.timestamp - first > rx.max_span_ms) {
+        rx.max_span_ms = sample.timestamp - first;
+    }
+    return pos == len;
+}
+
+/* Transport glue, standing in for gatt_svr.c: slot 0 is the stream under test */
+void bler_tx_telemetry(int slot, const void *data, uint16_t len) {
+    if (slot != 0) {
+        return;
+    }
+    rx.batches++;
+    if (len > rx.max_len) {
+        rx.oversized = true;
+    }
+    if (!decode(data, len)) {
+        rx.malformed = true;
+    }
+}
+
+uint16_t bler_tx_telemetry_max_len(int slot) {
+    return slot == 0 ? rx.max_len : 0;
+}
+
+static uint32_t rng = 1;
+
+static int32_t random_int(int32_t low, int32_t high) {
+    rng = rng * 1103515245 + 12345;
+    return low + (int32_t)((rng >> 8) % (uint32_t)(high - low + 1));
+}
+
+static void wave_sample(wave_t wave, int n, uint32_t timestamp, telemetry_sample_t *sample) {
+    *sample = (telemetry_sample_t){
+        .timestamp = timestamp,
+        .temperature = 25 * 4 + (n % 3 == 0),
+        .target = 25,
+        .cold_junction = 24 * 16,
+        .step = -1,
+    };
+    if (wave == WAVE_RUN) {
+        int step = n / 150;
+        sample->step = step < 5 ? step : -1;
+        sample->target = step < 5 ? 150 + step * 20 : 25;
+        sample->temperature = (25 + n / 4) * 4 + random_int(-2, 2);
+        sample->power = (n / 7) % 3 ? 1000 : 0;
+        sample->cold_junction = (24 * 16) + n / 40;
+        sample->faults = n >= 500 && n < 503 ? TELEMETRY_FAULT_OPEN : 0;
+    } else if (wave == WAVE_EXTREME) {
+        sample->temperature = random_int(INT16_MIN, INT16_MAX);
+        sample->target = random_int(INT16_MIN, INT16_MAX);
+        sample->power = random_int(0, UINT16_MAX);
+        sample->cold_junction = random_int(INT16_MIN, INT16_MAX);
+        sample->step = random_int(INT16_MIN, INT16_MAX);
+        sample->faults = random_int(0, UINT8_MAX);
+    }
+}
+
+static void run_case(const case_t *c) {
+    static telemetry_sample_t pushed[SAMPLES_MAX];
+    const int count = 1000;
+    uint32_t timestamp = 1000;
+    uint8_t rate = c->rate ? c->rate : TELEMETRY_RATE_DEFAULT;
+
+    memset(&rx, 0, sizeof rx);
+    rx.max_len = c->max_len;
+    rng = 1;
+    telemetry_init();
+    if (c->rate) {
+        telemetry_set_rate(0, c->rate);
+    }
+
+    int reset_decoded = 0;
+    for (int n = 0; n < count; n++) {
+        if (c->rate_change_at && n == c->rate_change_at) {
+            rate = TELEMETRY_RATE_MAX;
+            telemetry_set_rate(0, rate);
+        }
+        if (c->reset_at && n == c->reset_at) {
+            telemetry_reset(0);
+            rate = TELEMETRY_RATE_DEFAULT;
+            reset_decoded = rx.decoded_count;
+        }
+        wave_sample(c->wave, n, timestamp, &pushed[n]);
+        telemetry_push(&pushed[n]);
+        timestamp += CONTROLLER_PERIOD_MS + (c->jitter_ms ? random_int(0, c->jitter_ms) : 0);
+    }
+
+    /* Every decoded sample is one that was pushed, in order, none twice */
+    int matched = 0, from = 0;
+    for (int d = 0; d < rx.decoded_count; d++) {
+        int n = from;
+        while (n < count && memcmp(&pushed[n], &rx.decoded[d], sizeof pushed[n])) {
+            n++;
+        }
+        if (n == count) {
+            break;
+        }
+        matched++;
+        from = n + 1;
+    }
+
+    /* Decimation keeps the asked rate, the last rate of the run in effect */
+    int span = pushed[count - 1].timestamp - pushed[0].timestamp;
+    int slowest = c->rate_change_at && c->rate < rate ? c->rate : rate;
+    uint32_t gap = 0;
+    for (int d = 1; d < rx.decoded_count; d++) {
+        if (rx.decoded[d].timestamp - rx.decoded[d - 1].timestamp > gap) {
+            gap = rx.decoded[d].timestamp - rx.decoded[d - 1].timestamp;
+        }
+    }
+    double per_sample = rx.deltas ? (double)rx.bytes / rx.deltas : 0;
+
+    printf("%-14s %3u %4u %7d %8d %7.2f %6u %7u  0x%02x\n", c->name, rate, c->max_len,
+           rx.batches, rx.decoded_count, per_sample, gap, rx.max_span_ms, rx.masks);
+
+    check(!rx.malformed, "notification decodes to its length", c->name);
+    check(!rx.oversized, "notification fits the ATT payload", c->name);
+    check(matched == rx.decoded_count, "decoded samples match the pushed ones", c->name);
+    /* The flush expects the next sample one interval on, it may come a period later */
+    check(rx.max_span_ms < (uint32_t)(FLUSH_MS + CONTROLLER_PERIOD_MS + c->jitter_ms),
+          "batch flushed within the latency budget", c->name);
+    if (c->max_len == 0) {
+        check(rx.batches == 0, "nothing sent without a subscription", c->name);
+        return;
+    }
+    /* At most one batch of the latency budget is still pending at the end */
+    if (!c->rate_change_at && !c->reset_at) {
+        int expected = span * rate / 1000 < count ? span * rate / 1000 : count;
+        check(rx.decoded_count >= expected - rate * FLUSH_MS / 1000 - 1 && rx.decoded_count <= expected + 1,
+              "samples at the asked rate", c->name);
+    }
+    if (c->reset_at) {
+        /* The batch pending at the reset is dropped, not sent to the next connection */
+        bool stale = false;
+        for (int d = reset_decoded; d < rx.decoded_count; d++) {
+            stale |= rx.decoded[d].timestamp < pushed[c->reset_at].timestamp;
+        }
+        check(rx.decoded_count > reset_decoded && !stale, "pending batch dropped at the reset", c->name);
+    } else {
+        check(gap < (uint32_t)(1000 / slowest + CONTROLLER_PERIOD_MS + c->jitter_ms), "no sample lost", c->name);
+    }
+    if (c->max_bytes) {
+        check(per_sample <= c->max_bytes, "steady delta size", c->name);
+    }
+    if (c->masks >= 0) {
+        check(rx.masks == c->masks, "fields delta-encoded", c->name);
+    }
+}
+
+int main(void) {
+    printf("%-14s %3s %4s %7s %8s %7s %6s %7s  %s\n",
+           "case", "hz", "max", "batches", "samples", "B/delta", "gap", "span", "fields");
+    for (size_t i = 0; i < ARRAY_SIZE(cases); i++) {
+        run_case(&cases[i]);
+    }
+    printf("%d failure(s)\n", failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,459 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_intr_alloc.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "driver/pcnt.h"
+#if defined(CONFIG_ZERO_CROSSING_DRIVER)
+#include "soc/gpio_struct.h"
+#include "hal/gpio_ll.h"
+#elif defined(CONFIG_PHASE_ANGLE_DRIVER)
+#include "driver/rmt.h"
+#elif defined(CONFIG_SSR_PWM_DRIVER)
+#include "driver/ledc.h"
+#endif
+#ifdef CONFIG_FAN_OUTPUT
+#include "driver/ledc.h"
+#endif
+#include "actuator.h"
+#include "firing.h"
+
+static const char *tag = "Actuator";
+
+#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+
+#define GPIO_INPUT_ZEROCROSS  4
+
+_Static_assert(ACTUATOR_POWER_MAX == FIRING_POWER_MAX, "power scales differ");
+_Static_assert(ACTUATOR_CHANNELS <= FIRING_MAX_CHANNELS, "too many heater channels");
+
+/*
+ * The zero-cross interrupt is allocated with ESP_INTR_FLAG_IRAM, so that it
+ * keeps firing while the flash cache is disabled by NVS, OTA and run log
+ * writes. Everything it reaches is kept out of flash: the firing helpers
+ * are IRAM_ATTR, the pin table and the atomics live in DRAM.
+ */
+static DRAM_ATTR const int heater_gpio[ACTUATOR_CHANNELS] = {
+    CONFIG_HEATER_CH0_GPIO,
+#if ACTUATOR_CHANNELS >= 2
+    CONFIG_HEATER_CH1_GPIO,
+#endif
+#if ACTUATOR_CHANNELS >= 3
+    CONFIG_HEATER_CH2_GPIO,
+#endif
+};
+
+atomic_uint ato_half_ac_freq;
+static atomic_uint ato_power[ACTUATOR_CHANNELS];
+/* Free-running time of full conduction, wraps every ~71 min of full power */
+static atomic_uint ato_conduction_us[ACTUATOR_CHANNELS];
+
+static inline uint32_t IRAM_ATTR half_period_us(void) {
+    return firing_half_period_us(atomic_load(&ato_half_ac_freq));
+}
+
+static inline void IRAM_ATTR load_power(uint16_t *power) {
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        power[ch] = atomic_load(&ato_power[ch]);
+    }
+}
+
+#if defined(CONFIG_ZERO_CROSSING_DRIVER)
+/*
+ * Burst fire: the optocoupler only switches at the next zero crossing, so
+ * power is modulated by whole half-cycles handed out by the scheduler.
+ */
+static firing_scheduler_t scheduler;
+
+static void IRAM_ATTR zerocross_isr_handler(void *arg) {
+    static uint32_t last_time = 0;
+    if (!firing_debounce(&last_time, esp_timer_get_time())) {
+        return;
+    }
+
+    uint16_t power[ACTUATOR_CHANNELS];
+    load_power(power);
+    uint32_t fire = firing_schedule(&scheduler, power, ACTUATOR_CHANNELS, CONFIG_HEATER_MAX_CONCURRENT);
+    uint32_t half_period = half_period_us();
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        gpio_ll_set_level(&GPIO, heater_gpio[ch], (fire >> ch) & 1);
+        if ((fire >> ch) & 1) {
+            atomic_fetch_add(&ato_conduction_us[ch], half_period);
+        }
+    }
+}
+
+static void backend_init(void) {
+    gpio_config_t opto_io = {0};
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        opto_io.pin_bit_mask |= 1ULL<<heater_gpio[ch];
+    }
+    opto_io.mode = GPIO_MODE_OUTPUT;
+    gpio_config(&opto_io);
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        gpio_set_level(heater_gpio[ch], 0);
+    }
+
+    gpio_config_t io_conf = {0};
+    io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    io_conf.pin_bit_mask = 1ULL<<GPIO_INPUT_ZEROCROSS;
+    io_conf.mode = GPIO_MODE_INPUT;
+    gpio_config(&io_conf);
+}
+
+static void backend_start(void) {
+    gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+    gpio_isr_handler_add(GPIO_INPUT_ZEROCROSS, zerocross_isr_handler, (void*) GPIO_INPUT_ZEROCROSS);
+}
+
+static void backend_apply(void) {
+    /* Picked up by the zero-cross interrupt on the next half-cycle */
+}
+
+static void backend_account(void) {
+    /* Accounted by the zero-cross interrupt */
+}
+
+#elif defined(CONFIG_PHASE_ANGLE_DRIVER)
+/*
+ * Phase angle: the gate is pulsed once per half-cycle after a delay computed
+ * by firing_phase_half_cycle(), from a task woken by the zero-cross
+ * interrupt.
+ */
+static firing_scheduler_t scheduler;
+static TaskHandle_t firing_handle;
+
+static rmt_config_t firing_conf[ACTUATOR_CHANNELS];
+static rmt_item32_t firing_pulse;
+
+static void IRAM_ATTR zerocross_isr_handler(void *arg) {
+    static uint32_t last_time = 0;
+    uint32_t cross_time = esp_timer_get_time();
+    if (!firing_debounce(&last_time, cross_time)) {
+        return;
+    }
+    xTaskNotifyFromISR(firing_handle, cross_time, eSetValueWithOverwrite, NULL);
+    portYIELD_FROM_ISR();
+}
+
+static void firing_task(void *param) {
+    firing_handle = xTaskGetCurrentTaskHandle();
+    gpio_install_isr_service(ESP_INTR_FLAG_IRAM);
+    gpio_isr_handler_add(GPIO_INPUT_ZEROCROSS, zerocross_isr_handler, (void*) GPIO_INPUT_ZEROCROSS);
+
+    for( ;; ) {
+        uint32_t isr_time;
+        xTaskNotifyWait(0, ULONG_MAX, &isr_time, portMAX_DELAY);
+
+        /* Account for the latency between the interrupt and this task */
+        uint32_t elapsed_time = esp_timer_get_time() - isr_time;
+        uint32_t half_period = half_period_us();
+
+        uint16_t power[ACTUATOR_CHANNELS];
+        uint16_t conducted[ACTUATOR_CHANNELS];
+        uint32_t delay[ACTUATOR_CHANNELS];
+        load_power(power);
+        uint32_t fire = firing_phase_half_cycle(&scheduler, power, ACTUATOR_CHANNELS,
+                                                CONFIG_HEATER_MAX_CONCURRENT, half_period,
+                                                delay, conducted);
+
+        for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+            if (!((fire >> ch) & 1) || delay[ch] <= elapsed_time) {
+                continue;
+            }
+            firing_pulse.duration0 = delay[ch] - elapsed_time;
+            ESP_ERROR_CHECK(rmt_write_items(firing_conf[ch].channel, &firing_pulse, 1, 0));
+            /* The delay table is linear in delivered power */
+            atomic_fetch_add(&ato_conduction_us[ch], (uint32_t)conducted[ch] * half_period / ACTUATOR_POWER_MAX);
+        }
+    }
+}
+
+static void backend_init(void) {
+    gpio_config_t io_conf = {0};
+    io_conf.intr_type = GPIO_INTR_NEGEDGE;
+    io_conf.pin_bit_mask = 1ULL<<GPIO_INPUT_ZEROCROSS;
+    io_conf.mode = GPIO_MODE_INPUT;
+    gpio_config(&io_conf);
+
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        firing_conf[ch].rmt_mode = RMT_MODE_TX;
+        firing_conf[ch].channel = RMT_CHANNEL_0 + ch;
+        firing_conf[ch].gpio_num = heater_gpio[ch];
+        firing_conf[ch].mem_block_num = 1;
+        firing_conf[ch].tx_config.loop_en = 0;
+        firing_conf[ch].tx_config.carrier_en = 0;
+        firing_conf[ch].tx_config.idle_output_en = 1;
+        firing_conf[ch].tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+        firing_conf[ch].clk_div = 80; // 80MHz / 80 = 1MHz or 1uS per count
+        ESP_ERROR_CHECK(rmt_config(&firing_conf[ch]));
+        ESP_ERROR_CHECK(rmt_driver_install(firing_conf[ch].channel, 0, 0));
+    }
+
+    firing_pulse.duration0 = 0;
+    firing_pulse.level0 = 0;
+    firing_pulse.duration1 = 100; // pulse duration
+    firing_pulse.level1 = 1;
+}
+
+static void backend_start(void) {
+    static TaskHandle_t handle;
+    xTaskCreate(firing_task, "firing_task", 8192, NULL, configMAX_PRIORITIES-1, &handle);
+}
+
+static void backend_apply(void) {
+    /* Picked up by the firing task on the next half-cycle */
+}
+
+static void backend_account(void) {
+    /* Accounted by the firing task */
+}
+
+#elif defined(CONFIG_SSR_PWM_DRIVER)
+/*
+ * Slow PWM for DC-controlled SSRs. The SSR does its own zero-cross
+ * switching, so the PWM period only has to be long compared to the mains
+ * half-period to keep a fine power resolution. The channel windows are
+ * placed by firing_ssr_windows().
+ */
+#define SSR_LEDC_MODE       LEDC_HIGH_SPEED_MODE
+#define SSR_LEDC_TIMER      LEDC_TIMER_0
+#define SSR_LEDC_RESOLUTION LEDC_TIMER_13_BIT
+#define SSR_LEDC_PERIOD     (1 << 13)
+
+static bool ssr_inverted[ACTUATOR_CHANNELS];
+
+/* Power actually applied since ssr_account_time, after capacity scaling */
+static portMUX_TYPE ssr_account_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint16_t ssr_power[ACTUATOR_CHANNELS];
+static int64_t ssr_account_time;
+
+/* Under ssr_account_lock */
+static void ssr_account(void) {
+    int64_t now = esp_timer_get_time();
+    uint32_t elapsed = now - ssr_account_time;
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        atomic_fetch_add(&ato_conduction_us[ch], (uint64_t)ssr_power[ch] * elapsed / ACTUATOR_POWER_MAX);
+    }
+    ssr_account_time = now;
+}
+
+static void backend_account(void) {
+    portENTER_CRITICAL(&ssr_account_lock);
+    ssr_account();
+    portEXIT_CRITICAL(&ssr_account_lock);
+}
+
+static void ssr_channel_config(int ch, uint32_t hpoint, uint32_t duty, bool invert) {
+    ledc_channel_config_t channel_conf = {
+        .gpio_num = heater_gpio[ch],
+        .speed_mode = SSR_LEDC_MODE,
+        .channel = LEDC_CHANNEL_0 + ch,
+        .timer_sel = SSR_LEDC_TIMER,
+        .duty = duty,
+        .hpoint = hpoint,
+        .flags.output_invert = invert,
+    };
+    ESP_ERROR_CHECK(ledc_channel_config(&channel_conf));
+    ssr_inverted[ch] = invert;
+}
+
+static void backend_init(void) {
+    ledc_timer_config_t timer_conf = {
+        .speed_mode = SSR_LEDC_MODE,
+        .duty_resolution = SSR_LEDC_RESOLUTION,
+        .timer_num = SSR_LEDC_TIMER,
+        .freq_hz = CONFIG_SSR_PWM_FREQ_HZ,
+        .clk_cfg = LEDC_USE_REF_TICK, // 1MHz, low enough for a 1 Hz period
+    };
+    ESP_ERROR_CHECK(ledc_timer_config(&timer_conf));
+
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        ssr_channel_config(ch, 0, 0, false);
+    }
+    ssr_account_time = esp_timer_get_time();
+}
+
+static void backend_start(void) {
+}
+
+static void backend_apply(void) {
+    uint16_t power[ACTUATOR_CHANNELS];
+    uint16_t applied[ACTUATOR_CHANNELS];
+    uint32_t hpoint[ACTUATOR_CHANNELS];
+    uint32_t duty[ACTUATOR_CHANNELS];
+    bool invert[ACTUATOR_CHANNELS];
+
+    load_power(power);
+    firing_ssr_windows(power, ACTUATOR_CHANNELS, CONFIG_HEATER_MAX_CONCURRENT,
+                       SSR_LEDC_PERIOD, hpoint, duty, invert, applied);
+
+    /* The time so far at the previous power, from now on at the new one */
+    portENTER_CRITICAL(&ssr_account_lock);
+    ssr_account();
+    memcpy(ssr_power, applied, sizeof ssr_power);
+    portEXIT_CRITICAL(&ssr_account_lock);
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        if (invert[ch] != ssr_inverted[ch]) {
+            ssr_channel_config(ch, hpoint[ch], duty[ch], invert[ch]);
+        } else {
+            ledc_set_duty_with_hpoint(SSR_LEDC_MODE, LEDC_CHANNEL_0 + ch, duty[ch], hpoint[ch]);
+            ledc_update_duty(SSR_LEDC_MODE, LEDC_CHANNEL_0 + ch);
+        }
+    }
+}
+
+#else
+#error "No heater actuator selected"
+#endif
+
+/*
+ * Cooling fan or door output. A fan is driven by a fast PWM on the low-speed
+ * LEDC group, which the heater backends leave alone; on/off loads such as a
+ * door solenoid are switched at half power.
+ */
+static atomic_uint ato_fan_power;
+
+#ifdef CONFIG_FAN_OUTPUT
+#define FAN_LEDC_MODE       LEDC_LOW_SPEED_MODE
+#define FAN_LEDC_TIMER      LEDC_TIMER_0
+#define FAN_LEDC_CHANNEL    LEDC_CHANNEL_0
+#define FAN_LEDC_RESOLUTION LEDC_TIMER_10_BIT
+#define FAN_LEDC_PERIOD     (1 << 10)
+
+static void fan_init(void) {
+    ledc_timer_config_t timer_conf = {
+        .speed_mode = FAN_LEDC_MODE,
+        .duty_resolution = FAN_LEDC_RESOLUTION,
+        .timer_num = FAN_LEDC_TIMER,
+        .freq_hz = CONFIG_FAN_PWM_FREQ_HZ,
+        .clk_cfg = LEDC_AUTO_CLK,
+    };
+    ESP_ERROR_CHECK(ledc_timer_config(&timer_conf));
+
+    ledc_channel_config_t channel_conf = {
+        .gpio_num = CONFIG_FAN_GPIO,
+        .speed_mode = FAN_LEDC_MODE,
+        .channel = FAN_LEDC_CHANNEL,
+        .timer_sel = FAN_LEDC_TIMER,
+        .duty = 0,
+        .hpoint = 0,
+    };
+    ESP_ERROR_CHECK(ledc_channel_config(&channel_conf));
+}
+
+static void fan_apply(uint16_t power) {
+#ifdef CONFIG_FAN_ON_OFF
+    uint32_t duty = power >= ACTUATOR_POWER_MAX / 2 ? FAN_LEDC_PERIOD : 0;
+#else
+    uint32_t duty = (uint32_t)power * FAN_LEDC_PERIOD / ACTUATOR_POWER_MAX;
+#endif
+    ledc_set_duty(FAN_LEDC_MODE, FAN_LEDC_CHANNEL, duty);
+    ledc_update_duty(FAN_LEDC_MODE, FAN_LEDC_CHANNEL);
+}
+#else
+static void fan_init(void) {
+}
+
+static void fan_apply(uint16_t power) {
+}
+#endif
+
+void actuator_set_fan(uint16_t power) {
+    power = CLAMP(power, 0, ACTUATOR_POWER_MAX);
+    if (atomic_exchange(&ato_fan_power, power) != power) {
+        fan_apply(power);
+    }
+}
+
+uint16_t actuator_get_fan(void) {
+    return atomic_load(&ato_fan_power);
+}
+
+void actuator_set_power(int channel, uint16_t power) {
+    power = CLAMP(power, 0, ACTUATOR_POWER_MAX);
+    if (atomic_exchange(&ato_power[channel], power) != power) {
+        backend_apply();
+    }
+}
+
+uint16_t actuator_get_power(int channel) {
+    return atomic_load(&ato_power[channel]);
+}
+
+uint32_t actuator_get_conduction_us(int channel) {
+    backend_account();
+    return atomic_load(&ato_conduction_us[channel]);
+}
+
+static void IRAM_ATTR pcnt_ac_intr_handler(void *arg)
+{
+    static unsigned long last_time = 0;
+    unsigned long pcnt_time = esp_timer_get_time();
+    unsigned long elapsed = pcnt_time - last_time;
+    atomic_store(&ato_half_ac_freq, firing_half_ac_freq(elapsed));
+    last_time = pcnt_time;
+    pcnt_counter_clear(PCNT_UNIT_0);
+}
+
+static void pcnt_ac_init()
+{
+    pcnt_unit_t unit = PCNT_UNIT_0;
+    /* Prepare configuration for the PCNT unit */
+    pcnt_config_t pcnt_config = {
+        // Set PCNT input signal and control GPIOs
+        .pulse_gpio_num = GPIO_INPUT_ZEROCROSS,
+        .ctrl_gpio_num = -1,
+        .channel = PCNT_CHANNEL_0,
+        .unit = unit,
+        // What to do on the positive / negative edge of pulse input?
+        .pos_mode = PCNT_COUNT_DIS,   // Keep the counter value on the positive edge
+        .neg_mode = PCNT_COUNT_INC,   // Count up on the negative edge
+        // Set the maximum and minimum limit values to watch
+        .counter_h_lim = FIRING_PCNT_EDGES,
+        .counter_l_lim = 0,
+    };
+    /* Initialize PCNT unit */
+    pcnt_unit_config(&pcnt_config);
+
+    /* Configure and enable the input filter */
+    pcnt_set_filter_value(unit, 1023);
+    pcnt_filter_enable(unit);
+
+    pcnt_event_enable(unit, PCNT_EVT_H_LIM);
+
+    /* Initialize PCNT's counter */
+    pcnt_counter_pause(unit);
+    pcnt_counter_clear(unit);
+
+    /* Install interrupt service and add isr callback handler */
+    pcnt_isr_service_install(0);
+    pcnt_isr_handler_add(unit, pcnt_ac_intr_handler, (void *)unit);
+
+    /* Everything is set up, now go to counting */
+    pcnt_counter_resume(unit);
+}
+
+void actuator_init(void) {
+    atomic_init(&ato_half_ac_freq, 0);
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        atomic_init(&ato_power[ch], 0);
+        atomic_init(&ato_conduction_us[ch], 0);
+    }
+    atomic_init(&ato_fan_power, 0);
+
+    pcnt_ac_init();
+    backend_init();
+    fan_init();
+}
+
+void actuator_start(void) {
+    ESP_LOGI(tag, "Starting heater actuator");
+    backend_start();
+}
@@ -0,0 +1,22 @@
+#ifndef H_ACTUATOR_
+#define H_ACTUATOR_
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define ACTUATOR_POWER_MAX 1000 // power is expressed in per-mille
+#define ACTUATOR_CHANNELS CONFIG_HEATER_CHANNELS
+
+extern atomic_uint ato_half_ac_freq;
+
+void actuator_init(void);
+void actuator_start(void);
+
+void actuator_set_power(int channel, uint16_t power);
+uint16_t actuator_get_power(int channel);
+uint32_t actuator_get_conduction_us(int channel);
+
+void actuator_set_fan(uint16_t power);
+uint16_t actuator_get_fan(void);
+
+#endif
@@ -20,6 +20,7 @@
 #ifndef H_BLER946_
 #define H_BLER946_
 
+#include <stdbool.h>
 #include "nimble/ble.h"
 #include "modlog/modlog.h"
 
@@ -35,20 +36,69 @@ extern "C" {
 #define GATT_RS_DUTY_UUID                       0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x04,0x02,0x6c,0x94
 #define GATT_RS_PROFILE_UUID                    0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x05,0x02,0x6c,0x94
 #define GATT_RS_NVS_PROFILE_UUID                0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x06,0x02,0x6c,0x94
+#define GATT_RS_ZONE_OFFSET_UUID                0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x07,0x02,0x6c,0x94
+#define GATT_RS_ENERGY_UUID                     0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x08,0x02,0x6c,0x94
+#define GATT_RS_TELEMETRY_UUID                  0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x09,0x02,0x6c,0x94
+#define GATT_RS_TELEMETRY_RATE_UUID             0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x0a,0x02,0x6c,0x94
+#define GATT_RS_RUN_STATE_UUID                  0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x0b,0x02,0x6c,0x94
+#define GATT_RS_DIAGNOSTICS_UUID                0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x0c,0x02,0x6c,0x94
+#define GATT_RS_COMMAND_UUID                    0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x0d,0x02,0x6c,0x94
+#define GATT_RS_HISTORY_UUID                    0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x0e,0x02,0x6c,0x94
+#define GATT_RS_PROGRESS_UUID                   0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x0f,0x02,0x6c,0x94
+#define GATT_RS_RUNLOG_UUID                     0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x10,0x02,0x6c,0x94
+#define GATT_RS_LIBRARY_UUID                    0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x11,0x02,0x6c,0x94
+#define GATT_RS_STORAGE_UUID                    0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x12,0x02,0x6c,0x94
+#define GATT_RS_PRESETS_UUID                    0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x13,0x02,0x6c,0x94
+#define GATT_RS_QUALITY_UUID                    0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x14,0x02,0x6c,0x94
+#define GATT_OTA_UUID                           0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x00,0x03,0x6c,0x94
+#define GATT_OTA_CONTROL_UUID                   0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x01,0x03,0x6c,0x94
+#define GATT_OTA_DATA_UUID                      0xde,0xc1,0x88,0x0a,0x99,0x45,0x29,0x68,0x5f,0xa4,0x89,0xca,0x02,0x03,0x6c,0x94
 #define GATT_DEVICE_INFO_UUID                   0x180A
 #define GATT_MANUFACTURER_NAME_UUID             0x2A29
 #define GATT_MODEL_NUMBER_UUID                  0x2A24
 #define GATT_TEMPERATURE_CELCIUS_UUID           0x2A1F
 
 extern uint16_t rs_temperature_handle;
+extern uint16_t rs_telemetry_handle;
+extern uint16_t rs_command_handle;
+extern uint16_t ota_control_handle;
 
 struct ble_hs_cfg;
 struct ble_gatt_register_ctxt;
 
 void gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 int gatt_svr_init(void);
+void gatt_svr_check_db_hash(void);
+
+typedef struct bler_reconnect_stats_t {
+    uint32_t last_ms;   // connection to first notification of the last client
+    uint32_t max_ms;
+    uint32_t count;
+} bler_reconnect_stats_t;
+
+void bler_get_reconnect_stats(bler_reconnect_stats_t *stats);
+
+typedef struct bler_link_stats_t {
+    uint16_t mtu;
+    uint16_t conn_itvl;           // 1.25 ms
+    uint16_t conn_latency;
+    uint16_t supervision_timeout; // 10 ms
+    bool bulk;                    // short interval parameter set requested
+    uint32_t tx_rate;             // B/s over the last second
+    uint32_t rx_rate;
+    uint32_t tx_peak;
+    uint32_t rx_peak;
+} bler_link_stats_t;
+
+void bler_count_traffic(uint16_t conn_handle, uint32_t tx, uint32_t rx);
+int bler_get_link_stats(uint16_t conn_handle, bler_link_stats_t *stats);
 
 void bler_tx_temperature(float celcius);
+void bler_tx_telemetry(int slot, const void *data, uint16_t len);
+uint16_t bler_tx_telemetry_max_len(int slot);
+void bler_tx_command_result(uint16_t conn_handle, const void *data, uint16_t len);
+void bler_tx_ota(uint16_t conn_handle, const void *data, uint16_t len);
+int bler_conn_slot(uint16_t conn_handle);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,225 @@
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "controller.h"
+#include "persist.h"
+#include "calibration.h"
+
+static const char *tag = "Calibration";
+
+#define CALIBRATION_NAMESPACE "calibration"
+#define CALIBRATION_KEY "model"
+#define CALIBRATION_RECORD_MAX 128  // room for the records of newer firmware
+#define CALIBRATION_RATE_MIN 5      // 0.01 °C/s, keeps predictions finite
+
+#define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+#define MAX(a, b)  (((a) > (b)) ? (a) : (b))
+
+/*
+ * The record is kept in RAM and written through the persistence task.
+ * Writers take write_lock, so that the last value handed to the task is
+ * the last one set; readers only take cache_lock for the copy.
+ */
+static SemaphoreHandle_t write_lock;
+static portMUX_TYPE cache_lock = portMUX_INITIALIZER_UNLOCKED;
+static calibration_t cache;
+
+static const calibration_t defaults = {
+    .version = CALIBRATION_VERSION,
+    .heating_rate = CALIBRATION_HEATING_RATE,
+};
+
+static void calibration_persisted(void *arg, esp_err_t err) {
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Calibration lost at the next reboot: %s", esp_err_to_name(err));
+    }
+}
+
+/* Under write_lock */
+static void calibration_write(const calibration_t *cal) {
+    portENTER_CRITICAL(&cache_lock);
+    cache = *cal;
+    portEXIT_CRITICAL(&cache_lock);
+    persist_write(CALIBRATION_NAMESPACE, CALIBRATION_KEY, cal, sizeof *cal, calibration_persisted, NULL);
+}
+
+void calibration_get(calibration_t *cal) {
+    portENTER_CRITICAL(&cache_lock);
+    *cal = cache;
+    portEXIT_CRITICAL(&cache_lock);
+}
+
+/* Seconds a run of the profile takes from the temperature, by the model */
+int calibration_predict(const calibration_t *cal, const reflow_profile_t *profile, int temperature) {
+    int heating_rate = MAX(cal->heating_rate, CALIBRATION_RATE_MIN);
+    int cooling_rate = (profile->cooling_rate ? profile->cooling_rate : CONFIG_REFLOW_COOLING_RATE) * 10;
+    int unload = profile->unload_temperature ? profile->unload_temperature : CONFIG_REFLOW_UNLOAD_TEMPERATURE;
+    int duration = 0;
+
+    for (int step = 0; step < profile->steps; step++) {
+        const reflow_step_t *s = &profile->data[step];
+        if (s->temperature > temperature) {
+            duration += cal->lag / 10 + (s->temperature - temperature) * 100 / heating_rate;
+        }
+        duration += s->duration;
+        temperature = s->temperature;
+    }
+    if (cal->cooling_rate && cal->cooling_rate < cooling_rate) {
+        cooling_rate = cal->cooling_rate;
+    }
+    return duration + MAX(temperature - unload, 0) * 100 / MAX(cooling_rate, CALIBRATION_RATE_MIN);
+}
+
+static uint16_t calibration_fit(const calibration_t *cal, const reflow_profile_t *profile,
+                                const calibration_run_t *run) {
+    int error = abs(calibration_predict(cal, profile, run->start_temperature) - (int)run->duration);
+    return MIN((int64_t)error * 1000 / run->duration, UINT16_MAX);
+}
+
+static uint16_t calibration_blend(uint16_t model, uint16_t measured, bool first) {
+    if (measured == 0) {
+        return model;
+    }
+    if (first || model == 0) {
+        return measured;
+    }
+    return model + ((int)measured - model) / CALIBRATION_WEIGHT;
+}
+
+/*
+ * Moves the model towards what a completed run measured, if the result
+ * predicts the duration of that run better than the current model did.
+ * The model in use is returned either way.
+ */
+bool calibration_learn(const reflow_profile_t *profile, const calibration_run_t *run, calibration_t *cal) {
+    calibration_t candidate;
+    uint16_t fit_current, fit_candidate;
+    bool first;
+
+    if (run->duration == 0) {
+        calibration_get(cal);
+        return false;
+    }
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    calibration_get(cal);
+    candidate = *cal;
+    first = cal->runs == 0;
+    candidate.heating_rate = calibration_blend(cal->heating_rate, run->heating_rate, first);
+    candidate.cooling_rate = calibration_blend(cal->cooling_rate, run->cooling_rate, first);
+    candidate.lag = calibration_blend(cal->lag, run->lag, first);
+    candidate.hold_loss = calibration_blend(cal->hold_loss, run->hold_loss, first);
+
+    fit_current = calibration_fit(cal, profile, run);
+    fit_candidate = calibration_fit(&candidate, profile, run);
+    if (!first && fit_candidate >= fit_current) {
+        xSemaphoreGive(write_lock);
+        ESP_LOGI(tag, "Run not learned, fit %u‰ against %u‰", fit_candidate, fit_current);
+        return false;
+    }
+    if (candidate.runs < UINT16_MAX) {
+        candidate.runs++;
+    }
+    candidate.fit_error = fit_candidate;
+    calibration_write(&candidate);
+    xSemaphoreGive(write_lock);
+
+    ESP_LOGI(tag, "Learned run %u: heating %u, cooling %u (0.01 °C/s), lag %u.%u s, hold %u mW/°C, fit %u‰",
+             candidate.runs, candidate.heating_rate, candidate.cooling_rate, candidate.lag / 10,
+             candidate.lag % 10, candidate.hold_loss, fit_candidate);
+    *cal = candidate;
+    return true;
+}
+
+void calibration_set_zone_offset(int channel, int offset) {
+    calibration_t cal;
+
+    if (channel < 0 || channel >= CALIBRATION_ZONES) {
+        return;
+    }
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    calibration_get(&cal);
+    if (cal.zone_offset[channel] != offset) {
+        cal.zone_offset[channel] = offset;
+        calibration_write(&cal);
+    }
+    xSemaphoreGive(write_lock);
+}
+
+/* Back to the defaults, the zone offsets included */
+void calibration_reset(calibration_t *cal) {
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&cache_lock);
+    cache = defaults;
+    portEXIT_CRITICAL(&cache_lock);
+    persist_erase(CALIBRATION_NAMESPACE, CALIBRATION_KEY, calibration_persisted, NULL);
+    xSemaphoreGive(write_lock);
+
+    ESP_LOGI(tag, "Calibration reset");
+    *cal = defaults;
+}
+
+/*
+ * Reads a record of any version over the defaults. Returns false for a
+ * record that cannot be one.
+ */
+static bool calibration_migrate(const uint8_t *record, size_t len, calibration_t *cal) {
+    uint16_t version;
+
+    if (len < sizeof version) {
+        return false;
+    }
+    memcpy(&version, record, sizeof version);
+    if (version == 0) {
+        return false;
+    }
+    /*
+     * Fields are appended only, so far. A change that moves or rescales
+     * one converts the records of the previous versions here.
+     */
+    *cal = defaults;
+    memcpy(cal, record, MIN(len, sizeof *cal));
+    cal->version = CALIBRATION_VERSION;
+    if (cal->heating_rate == 0) {
+        cal->heating_rate = CALIBRATION_HEATING_RATE;
+    }
+    if (version != CALIBRATION_VERSION) {
+        ESP_LOGI(tag, "Record of version %u read", version);
+    }
+    return true;
+}
+
+void calibration_init(void) {
+    uint8_t record[CALIBRATION_RECORD_MAX];
+    size_t len = sizeof record;
+    calibration_t cal = defaults;
+    uint16_t version = CALIBRATION_VERSION;
+    esp_err_t err;
+
+    write_lock = xSemaphoreCreateMutex();
+
+    err = persist_read(CALIBRATION_NAMESPACE, CALIBRATION_KEY, record, &len);
+    if (err == ESP_OK && !calibration_migrate(record, len, &cal)) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    if (err == ESP_OK) {
+        memcpy(&version, record, sizeof version);
+    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(tag, "Record rejected (%s), oven uncalibrated", esp_err_to_name(err));
+    }
+
+    portENTER_CRITICAL(&cache_lock);
+    cache = cal;
+    portEXIT_CRITICAL(&cache_lock);
+    /* Upgrades are written back, a record of newer firmware is left as it is */
+    if (version < CALIBRATION_VERSION) {
+        xSemaphoreTake(write_lock, portMAX_DELAY);
+        calibration_write(&cal);
+        xSemaphoreGive(write_lock);
+    }
+    ESP_LOGI(tag, "%u runs learned, heating %u (0.01 °C/s), fit %u‰", cal.runs, cal.heating_rate, cal.fit_error);
+}
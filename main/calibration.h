@@ -0,0 +1,48 @@
+#ifndef H_CALIBRATION_
+#define H_CALIBRATION_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "controller.h"
+
+#define CALIBRATION_VERSION 1
+#define CALIBRATION_ZONES 3     // largest CONFIG_HEATER_CHANNELS
+#define CALIBRATION_WEIGHT 4    // a run moves the model by a quarter of the difference
+
+#define CALIBRATION_HEATING_RATE 100  // 0.01 °C/s, until a ramp has been measured
+
+/*
+ * Identified model of the oven and the controller parameters, kept in NVS
+ * (packed, little-endian). Fields are only ever appended, along with a new
+ * CALIBRATION_VERSION: an older record is read over the defaults and its
+ * missing fields keep them, a newer one keeps the fields known here.
+ */
+typedef struct __attribute__((packed)) calibration_t {
+    uint16_t version;
+    uint16_t runs;           // completed runs learned from, 0 for the defaults
+    uint16_t heating_rate;   // 0.01 °C/s, ramping at full power
+    uint16_t cooling_rate;   // 0.01 °C/s, 0 until measured
+    uint16_t lag;            // 0.1 s, dead time from full power to the first rise
+    uint16_t hold_loss;      // mW/°C above ambient, to hold a temperature
+    uint16_t fit_error;      // per-mille, of the duration predicted for the last run learned
+    int16_t zone_offset[CALIBRATION_ZONES]; // °C
+} calibration_t;
+
+/* Measured over a completed run, 0 for what could not be */
+typedef struct calibration_run_t {
+    uint16_t heating_rate;
+    uint16_t cooling_rate;
+    uint16_t lag;
+    uint16_t hold_loss;
+    int16_t start_temperature; // °C
+    uint32_t duration;         // s
+} calibration_run_t;
+
+void calibration_init(void);
+void calibration_get(calibration_t *cal);
+bool calibration_learn(const reflow_profile_t *profile, const calibration_run_t *run, calibration_t *cal);
+void calibration_set_zone_offset(int channel, int offset);
+void calibration_reset(calibration_t *cal);
+int calibration_predict(const calibration_t *cal, const reflow_profile_t *profile, int temperature);
+
+#endif
@@ -0,0 +1,173 @@
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_rom_crc.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/time.h>
+#include "controller.h"
+#include "profile.h"
+#include "checkpoint.h"
+
+static const char *tag = "Checkpoint";
+
+#define CHECKPOINT_MAGIC 0x4b435043  // "CPCK"
+#define CHECKPOINT_VERSION 1
+
+typedef struct checkpoint_record_t {
+    uint32_t seq;
+    int64_t time_us;            // gettimeofday()
+    checkpoint_state_t state;
+    uint32_t crc;               // of the above
+} checkpoint_record_t;
+
+typedef struct checkpoint_t {
+    uint32_t magic;             // written last by checkpoint_begin()
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t profile_crc;       // identifies the profile of the run
+    reflow_profile_t profile;
+    checkpoint_record_t records[2];
+} checkpoint_t;
+
+/*
+ * RTC slow memory keeps its content through every reset but power-on, and
+ * writing it costs nothing. The profile is copied once per run; the state
+ * records alternate, so that a reset in the middle of a write leaves the
+ * previous one intact. The system time also runs on through those resets,
+ * it tells the downtime.
+ */
+static RTC_NOINIT_ATTR checkpoint_t checkpoint;
+static uint32_t next_seq;  // reflow_task only
+
+static int64_t checkpoint_now_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint32_t checkpoint_record_crc(const checkpoint_record_t *record) {
+    return esp_rom_crc32_le(0, (const uint8_t *)record, offsetof(checkpoint_record_t, crc));
+}
+
+void checkpoint_begin(const reflow_profile_t *profile) {
+    checkpoint.magic = 0;
+    memset(checkpoint.records, 0, sizeof checkpoint.records);
+    checkpoint.version = CHECKPOINT_VERSION;
+    checkpoint.profile.steps = profile->steps;
+    checkpoint.profile.cooling_rate = profile->cooling_rate;
+    checkpoint.profile.unload_temperature = profile->unload_temperature;
+    memcpy(checkpoint.profile.data, profile->data, profile->steps * sizeof(reflow_step_t));
+    checkpoint.profile_crc = profile_crc(profile);
+    checkpoint.magic = CHECKPOINT_MAGIC;
+    next_seq = 1;
+}
+
+void checkpoint_update(const checkpoint_state_t *state) {
+    checkpoint_record_t *record = &checkpoint.records[next_seq & 1];
+
+    record->seq = next_seq++;
+    record->time_us = checkpoint_now_us();
+    record->state = *state;
+    record->crc = checkpoint_record_crc(record);
+}
+
+void checkpoint_clear(void) {
+    checkpoint.magic = 0;
+}
+
+/* Latest intact record, NULL when there is no run to recover */
+static const checkpoint_record_t *checkpoint_latest(void) {
+    const checkpoint_record_t *latest = NULL;
+
+    if (checkpoint.magic != CHECKPOINT_MAGIC || checkpoint.version != CHECKPOINT_VERSION ||
+        checkpoint.profile.steps > MAX_REFLOW_STEPS || checkpoint.profile_crc != profile_crc(&checkpoint.profile)) {
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        const checkpoint_record_t *record = &checkpoint.records[i];
+        if (record->seq != 0 && record->crc == checkpoint_record_crc(record) &&
+            (latest == NULL || (int32_t)(record->seq - latest->seq) > 0)) {
+            latest = record;
+        }
+    }
+    if (latest != NULL && latest->state.step != REFLOW_STEP_COOLDOWN &&
+        (latest->state.step < 0 || latest->state.step >= checkpoint.profile.steps)) {
+        return NULL;
+    }
+    return latest;
+}
+
+/* Crashes and brownouts, as opposed to the resets someone asked for */
+static bool checkpoint_unexpected(esp_reset_reason_t reason) {
+    switch (reason) {
+    case ESP_RST_PANIC:
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+    case ESP_RST_BROWNOUT:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Decides, once at boot, what becomes of the run a reset interrupted. The
+ * profile and state of the run are returned for both the resume and the
+ * cool-down. The checkpoint is consumed: the run writes a new one.
+ */
+checkpoint_action_t checkpoint_recover(int temperature, reflow_profile_t *profile, checkpoint_state_t *state) {
+    const checkpoint_record_t *record = checkpoint_latest();
+    esp_reset_reason_t reason = esp_reset_reason();
+    const char *why = NULL;
+
+    if (record == NULL) {
+        checkpoint_clear();
+        return CHECKPOINT_NONE;
+    }
+    int64_t downtime_s = (checkpoint_now_us() - record->time_us) / 1000000;
+    int unload = checkpoint.profile.unload_temperature ? checkpoint.profile.unload_temperature
+                                                       : CONFIG_REFLOW_UNLOAD_TEMPERATURE;
+    *state = record->state;
+    profile->steps = checkpoint.profile.steps;
+    profile->cooling_rate = checkpoint.profile.cooling_rate;
+    profile->unload_temperature = checkpoint.profile.unload_temperature;
+    memcpy(profile->data, checkpoint.profile.data, checkpoint.profile.steps * sizeof(reflow_step_t));
+    checkpoint_clear();
+
+    ESP_LOGW(tag, "Run interrupted at step %i phase %i after %" PRIu32 " s, reset %i, down %" PRIi64 " s, %i °C",
+             state->step, state->phase, state->elapsed, reason, downtime_s, temperature);
+    if (temperature <= unload) {
+        ESP_LOGW(tag, "Oven already cold, run dropped");
+        return CHECKPOINT_NONE;
+    }
+
+#if CONFIG_REFLOW_RESUME
+    if (!checkpoint_unexpected(reason)) {
+        why = "requested reset";
+    } else if (state->phase == REFLOW_COOLDOWN) {
+        why = "was cooling down";
+    } else if (downtime_s < 0 || downtime_s > CONFIG_REFLOW_RESUME_MAX_DOWNTIME_S) {
+        why = "down too long";
+    } else if (temperature < state->temperature - CONFIG_REFLOW_RESUME_MAX_DROP) {
+        why = "temperature dropped";
+    } else if (state->resumes >= CONFIG_REFLOW_RESUME_MAX_RESETS) {
+        why = "too many resets";
+    }
+#else
+    why = "resume disabled";
+#endif
+    if (why == NULL) {
+        state->resumes++;
+        state->reset_reason = reason;
+        ESP_LOGW(tag, "Resuming the run, %i resets so far", state->resumes);
+        return CHECKPOINT_RESUME;
+    }
+    ESP_LOGW(tag, "Cooling down (%s)", why);
+    return CHECKPOINT_COOLDOWN;
+}
@@ -0,0 +1,31 @@
+#ifndef H_CHECKPOINT_
+#define H_CHECKPOINT_
+
+#include <stdint.h>
+#include "controller.h"
+
+typedef enum {
+    CHECKPOINT_NONE,      // no run was interrupted, or the oven is cold
+    CHECKPOINT_RESUME,    // pick the run up at the checkpoint
+    CHECKPOINT_COOLDOWN,  // only cool the oven down
+} checkpoint_action_t;
+
+/* Run state, written by reflow_task every second */
+typedef struct checkpoint_state_t {
+    int16_t step;           // REFLOW_STEP_COOLDOWN during the cool-down
+    uint8_t phase;          // reflow_phase_t
+    uint8_t resumes;        // resets the run went through
+    uint8_t reset_reason;   // esp_reset_reason_t of the last one
+    uint8_t reserved;
+    int16_t target;         // °C, the setpoint of the controller
+    int16_t temperature;    // °C
+    uint16_t hold_elapsed;  // s into the hold of the step
+    uint32_t elapsed;       // s since the start of the run
+} checkpoint_state_t;
+
+void checkpoint_begin(const reflow_profile_t *profile);
+void checkpoint_update(const checkpoint_state_t *state);
+void checkpoint_clear(void);
+checkpoint_action_t checkpoint_recover(int temperature, reflow_profile_t *profile, checkpoint_state_t *state);
+
+#endif
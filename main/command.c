@@ -0,0 +1,174 @@
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "actuator.h"
+#include "controller.h"
+#include "profile.h"
+#include "command.h"
+
+static const char *tag = "Command";
+
+typedef struct command_t {
+    uint8_t type;
+    uint8_t len;
+    const uint8_t *value;
+} command_t;
+
+/* Only used by the caller of command_run(), the BLE host task */
+static reflow_profile_t command_profile;
+
+static uint8_t command_validate(const command_t *cmd) {
+    uint8_t channel;
+    uint16_t power;
+    int16_t value;
+
+    switch (cmd->type) {
+    case COMMAND_SET_TARGET:
+        if (cmd->len != sizeof value) {
+            return COMMAND_ERR_LENGTH;
+        }
+        memcpy(&value, cmd->value, sizeof value);
+        return profile_target_valid(value) ? COMMAND_OK : COMMAND_ERR_VALUE;
+
+    case COMMAND_SET_POWER:
+        if (cmd->len != sizeof channel + sizeof power) {
+            return COMMAND_ERR_LENGTH;
+        }
+        channel = cmd->value[0];
+        memcpy(&power, &cmd->value[1], sizeof power);
+        if (channel >= ACTUATOR_CHANNELS && channel != COMMAND_ALL_CHANNELS) {
+            return COMMAND_ERR_VALUE;
+        }
+        return power <= ACTUATOR_POWER_MAX ? COMMAND_OK : COMMAND_ERR_VALUE;
+
+    case COMMAND_SET_ZONE_OFFSET:
+        if (cmd->len != sizeof channel + sizeof value) {
+            return COMMAND_ERR_LENGTH;
+        }
+        return cmd->value[0] < ACTUATOR_CHANNELS ? COMMAND_OK : COMMAND_ERR_VALUE;
+
+    case COMMAND_START:
+    case COMMAND_STOP:
+    case COMMAND_STORE_PROFILE:
+    case COMMAND_LOAD_PROFILE:
+    case COMMAND_RESET_CALIBRATION:
+        return cmd->len == 0 ? COMMAND_OK : COMMAND_ERR_LENGTH;
+
+    case COMMAND_SET_PROFILE:
+        switch (profile_decode(cmd->value, cmd->len, &command_profile)) {
+        case ESP_OK:
+            return COMMAND_OK;
+        case ESP_ERR_INVALID_SIZE:
+            return COMMAND_ERR_LENGTH;
+        default:
+            return COMMAND_ERR_VALUE;
+        }
+
+    default:
+        return COMMAND_ERR_UNKNOWN;
+    }
+}
+
+static uint8_t command_execute(const command_t *cmd) {
+    uint8_t channel;
+    uint16_t power;
+    int16_t value;
+
+    switch (cmd->type) {
+    case COMMAND_SET_TARGET:
+        memcpy(&value, cmd->value, sizeof value);
+        reflow_stop();
+        atomic_store(&ato_target, value / 10);
+        return COMMAND_OK;
+
+    case COMMAND_SET_POWER:
+        channel = cmd->value[0];
+        memcpy(&power, &cmd->value[1], sizeof power);
+        reflow_stop();
+        for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+            if (channel == ch || channel == COMMAND_ALL_CHANNELS) {
+                set_manual_power(ch, power);
+            }
+        }
+        return COMMAND_OK;
+
+    case COMMAND_SET_ZONE_OFFSET:
+        memcpy(&value, &cmd->value[1], sizeof value);
+        set_zone_offset(cmd->value[0], value / 10);
+        return COMMAND_OK;
+
+    case COMMAND_START:
+        return reflow_start() == ESP_OK ? COMMAND_OK : COMMAND_ERR_FAILED;
+
+    case COMMAND_STOP:
+        reflow_stop();
+        return COMMAND_OK;
+
+    case COMMAND_SET_PROFILE:
+        /* Validated already, decoded again as the batch may hold several */
+        profile_decode(cmd->value, cmd->len, &command_profile);
+        set_profile(&command_profile);
+        return COMMAND_OK;
+
+    case COMMAND_STORE_PROFILE:
+        get_profile(&command_profile);
+        return store_profile(&command_profile) == ESP_OK ? COMMAND_OK : COMMAND_ERR_FAILED;
+
+    case COMMAND_LOAD_PROFILE:
+        if (load_profile(&command_profile) != ESP_OK) {
+            return COMMAND_ERR_FAILED;
+        }
+        set_profile(&command_profile);
+        return COMMAND_OK;
+
+    case COMMAND_RESET_CALIBRATION:
+        reset_calibration();
+        return COMMAND_OK;
+
+    default:
+        return COMMAND_ERR_UNKNOWN;
+    }
+}
+
+/*
+ * Runs a batch in order, fills one status per command and returns their
+ * count, or -1 when the batch itself is malformed. Every command is
+ * validated before the first one runs, so a rejected command leaves the
+ * oven untouched and the others are reported as skipped.
+ */
+int command_run(const uint8_t *batch, size_t len, uint8_t *status) {
+    command_t cmds[COMMAND_BATCH_MAX];
+    int count = 0;
+    bool valid = true;
+
+    for (size_t pos = 0; pos < len; count++) {
+        if (count == COMMAND_BATCH_MAX || len - pos < 2 || len - pos - 2 < batch[pos + 1]) {
+            return -1;
+        }
+        cmds[count].type = batch[pos];
+        cmds[count].len = batch[pos + 1];
+        cmds[count].value = &batch[pos + 2];
+        pos += 2 + cmds[count].len;
+    }
+
+    for (int i = 0; i < count; i++) {
+        status[i] = command_validate(&cmds[i]);
+        if (status[i] != COMMAND_OK) {
+            ESP_LOGW(tag, "Command %i (0x%02x) rejected: %i", i, cmds[i].type, status[i]);
+            valid = false;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!valid) {
+            if (status[i] == COMMAND_OK) {
+                status[i] = COMMAND_ERR_SKIPPED;
+            }
+        } else {
+            status[i] = command_execute(&cmds[i]);
+        }
+    }
+    return count;
+}
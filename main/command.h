@@ -0,0 +1,38 @@
+#ifndef H_COMMAND_
+#define H_COMMAND_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define COMMAND_BATCH_MAX 16 // one status byte each in the result indication
+
+/*
+ * A batch is a sequence of TLV commands: uint8 type, uint8 length, then
+ * length bytes of value (packed, little-endian).
+ */
+typedef enum {
+    COMMAND_SET_TARGET = 0x01,      // int16 target in 0.1 °C, stops the reflow
+    COMMAND_SET_POWER = 0x02,       // uint8 channel (0xff for all), uint16 per-mille, stops the reflow
+    COMMAND_SET_ZONE_OFFSET = 0x03, // uint8 channel, int16 offset in 0.1 °C
+    COMMAND_START = 0x04,
+    COMMAND_STOP = 0x05,
+    COMMAND_SET_PROFILE = 0x06,     // profile image, see profile.h
+    COMMAND_STORE_PROFILE = 0x07,   // active profile to NVS
+    COMMAND_LOAD_PROFILE = 0x08,    // NVS profile to active
+    COMMAND_RESET_CALIBRATION = 0x09, // learned oven model and zone offsets back to defaults
+} command_type_t;
+
+#define COMMAND_ALL_CHANNELS 0xff
+
+typedef enum {
+    COMMAND_OK,
+    COMMAND_ERR_UNKNOWN,   // unknown type
+    COMMAND_ERR_LENGTH,    // wrong value length
+    COMMAND_ERR_VALUE,     // value out of range or invalid profile
+    COMMAND_ERR_SKIPPED,   // not run, another command of the batch was rejected
+    COMMAND_ERR_FAILED,    // ran but failed, e.g. NVS error
+} command_status_t;
+
+int command_run(const uint8_t *batch, size_t len, uint8_t *status);
+
+#endif
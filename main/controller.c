@@ -1,137 +1,447 @@
 #include "esp_log.h"
 #include "esp_timer.h"
-#include "nvs_flash.h"
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <limits.h>
+#include <inttypes.h>
 #include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "driver/gpio.h"
-#include "driver/pcnt.h"
-#ifndef CONFIG_ZERO_CROSSING_DRIVER
-#include "driver/rmt.h"
-#endif
+#include "freertos/semphr.h"
 #include "bler946.h"
+#include "actuator.h"
+#include "energy.h"
+#include "telemetry.h"
+#include "history.h"
 #include "controller.h"
+#include "profile.h"
+#include "library.h"
+#include "ota.h"
+#include "protocol.h"
+#include "runlog.h"
+#include "checkpoint.h"
+#include "calibration.h"
+#include "quality.h"
 #include "max31855.h"
 #include "ui.h"
 #include "segments.h"
 
 static const char *tag = "Controller";
 
-#define STORAGE_NAMESPACE "storage"
-
 #define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 #define LERP(a, b, f)  ((a + f * (b - a)))
+#define MAX(a, b)  (((a) > (b)) ? (a) : (b))
+#define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+
+#define CONTROLLER_PERIOD_MS 50 // fast enough for the highest telemetry rate, not for the thermocouple
+#define FAN_GAIN 200 // fan per-mille per °C above the cool-down ramp
 
-#define GPIO_INPUT_ZEROCROSS  4
-#define GPIO_OUTPUT_OPTOCOUPLER 33
-#define ESP_INTR_FLAG_DEFAULT 0
+_Static_assert(ACTUATOR_CHANNELS <= CALIBRATION_ZONES, "zone offsets are stored with the calibration");
 
 static atomic_int ato_temperature;
+static atomic_int ato_faults; // TELEMETRY_FAULT_* of the last reading
 atomic_int ato_target;
-atomic_uint ato_half_ac_freq;
-
+static atomic_int ato_manual_power[ACTUATOR_CHANNELS]; // -1 when the loop is closed
+static atomic_int ato_zone_offset[ACTUATOR_CHANNELS];
+
+/*
+ * A run is stopped by asking reflow_task, which checks at every tick and
+ * winds the run down itself: deleting it from outside could leave the
+ * locks it holds, the calibration one among them, taken for good. The
+ * handle, the stop request and the waiters are under run_lock; the task
+ * gives run_exited once per waiter as it exits.
+ */
+#define REFLOW_STOP_WAITERS 4 // tasks that may stop a run at once
+
+static SemaphoreHandle_t run_lock;
+static SemaphoreHandle_t run_exited;
+static int stop_waiters;
+static atomic_bool ato_stop;
 static TaskHandle_t reflow_handle = NULL;
+static atomic_int ato_step; // -1 when no reflow is running
+static atomic_int ato_phase;
+static atomic_bool ato_cooling;
 static reflow_profile_t reflow_profile = {0};
+static portMUX_TYPE profile_lock = portMUX_INITIALIZER_UNLOCKED;
+static atomic_int ato_profile_steps;
+static atomic_uint ato_profile_crc;
+static reflow_profile_t run_profile; // snapshot taken by reflow_task
+static checkpoint_state_t run_state; // reflow_task only
+
+/* Run a reset interrupted, handed to reflow_task by reflow_recover() */
+static reflow_profile_t resume_profile;
+static checkpoint_state_t resume_state;
+
+/*
+ * Progress, published by reflow_task once per second. The heating and
+ * cooling rates are measured during the runs and kept across them; the
+ * prediction walks the rest of the profile with them.
+ */
+#define RATE_MIN_SAMPLE_S 10     // shorter ramps do not tell the oven rate
+#define RATE_MIN 5               // 0.01 °C/s, keeps predictions finite
+#define LAG_RISE 2               // °C above the start of a ramp that ends its dead time
+#define AMBIENT 25               // °C, hold losses are counted above it
+#define HOLD_MIN_RISE 20         // °C above ambient, lower holds do not tell the losses
+
+static atomic_llong ato_run_start_us;
+static atomic_llong ato_step_start_us;
+static atomic_int ato_remaining_s;
+static atomic_int ato_heating_rate; // 0.01 °C/s
+static atomic_int ato_cooling_rate; // 0.01 °C/s, 0 until measured
+static atomic_int ato_lag;          // 0.1 s, dead time of the ramps
+static atomic_int ato_hold_loss;    // mW/°C above ambient, 0 until measured
+
+/*
+ * The heaters are switched on below the setpoint and off above it, with
+ * the learned model in between: heating stops short of the setpoint by
+ * the rise the dead time still carries, and the last degrees are closed
+ * on a slope down to the power that holds the setpoint. Until both the
+ * dead time and the holding power have been learned, the oven is plain
+ * on-off.
+ */
+#define ANTICIPATION_MAX 20      // °C, the heating is never cut further below the setpoint
 
-#ifndef CONFIG_ZERO_CROSSING_DRIVER
-static TaskHandle_t firing_handle;
+int get_temperature() {
+    return atomic_load(&ato_temperature);
+}
 
-static rmt_config_t firing_conf;
-static rmt_item32_t firing_pulse;
+int get_faults(void) {
+    return atomic_load(&ato_faults);
+}
 
-static atomic_uint ato_pulse_delay;
+void set_target_temperature(int value) {
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        atomic_store(&ato_manual_power[ch], -1);
+    }
+    atomic_store(&ato_target, value);
+}
 
-static void IRAM_ATTR zerocross_isr_handler() {
-    static unsigned long last_time = 0;
-    unsigned long cross_time = esp_timer_get_time();
-    unsigned long elapsed = cross_time - last_time;
-    if (elapsed < 2500) {
-        return;
+void set_manual_power(int channel, uint16_t power) {
+    atomic_store(&ato_manual_power[channel], CLAMP(power, 0, ACTUATOR_POWER_MAX));
+}
+
+int get_manual_power(int channel) {
+    return atomic_load(&ato_manual_power[channel]);
+}
+
+void set_zone_offset(int channel, int offset) {
+    if (atomic_exchange(&ato_zone_offset[channel], offset) != offset) {
+        calibration_set_zone_offset(channel, offset);
     }
-    last_time = cross_time;
-    xTaskNotifyFromISR(firing_handle, cross_time, eSetValueWithOverwrite, NULL);
-    portYIELD_FROM_ISR();
-    return;
 }
 
-void firing_task(void *param) {
-    firing_handle = xTaskGetCurrentTaskHandle();
-    gpio_install_isr_service(ESP_INTR_FLAG_DEFAULT);
-    gpio_isr_handler_add(GPIO_INPUT_ZEROCROSS, zerocross_isr_handler, (void*) GPIO_INPUT_ZEROCROSS);
+int get_zone_offset(int channel) {
+    return atomic_load(&ato_zone_offset[channel]);
+}
 
-    TickType_t xLastWakeTime = xTaskGetTickCount ();
-    for( ;; ) {
-        uint32_t isr_time;
-        xTaskNotifyWait(0, ULONG_MAX, &isr_time, portMAX_DELAY);
-        uint32_t elapsed_time = esp_timer_get_time() - isr_time;
+static int cooldown_rate(void) {
+    /* Slowest of the profile slope and what the oven managed so far */
+    int rate = (run_profile.cooling_rate ? run_profile.cooling_rate : CONFIG_REFLOW_COOLING_RATE) * 10;
+    int measured = atomic_load(&ato_cooling_rate);
+    if (measured && measured < rate) {
+        rate = measured;
+    }
+    return MAX(rate, RATE_MIN);
+}
 
-        firing_pulse.duration0 = atomic_load(&ato_pulse_delay);
-        ESP_ERROR_CHECK(rmt_write_items(firing_conf.channel, &firing_pulse, 1, 0));
+static int cooldown_unload(void) {
+    return run_profile.unload_temperature ? run_profile.unload_temperature : CONFIG_REFLOW_UNLOAD_TEMPERATURE;
+}
+
+/* Seconds left in the run, from the current step and phase on */
+static int reflow_predict(int step, reflow_phase_t phase, int hold_elapsed_s) {
+    int heating_rate = MAX(atomic_load(&ato_heating_rate), RATE_MIN);
+    int temperature = get_temperature();
+    int remaining = 0;
+
+    for ( ; step < run_profile.steps; step++) {
+        const reflow_step_t *s = &run_profile.data[step];
+        if (phase == REFLOW_HOLD) {
+            remaining += MAX(s->duration - hold_elapsed_s, 0);
+            phase = REFLOW_RAMP;
+        } else {
+            /* Lower steps are held while the oven drifts down */
+            if (s->temperature > temperature) {
+                remaining += atomic_load(&ato_lag) / 10 + (s->temperature - temperature) * 100 / heating_rate;
+            }
+            remaining += s->duration;
+        }
+        temperature = s->temperature;
     }
+    return remaining + MAX(temperature - cooldown_unload(), 0) * 100 / cooldown_rate();
 }
-#endif // !CONFIG_ZERO_CROSSING_DRIVER
 
-int get_temperature() {
-    return atomic_load(&ato_temperature);
+/* Ramp rate in 0.01 °C/s, 0 when too short to tell */
+static int measure_rate(int from, int to, int64_t since_us) {
+    int64_t elapsed_s = (esp_timer_get_time() - since_us) / 1000000;
+    if (elapsed_s < RATE_MIN_SAMPLE_S) {
+        return 0;
+    }
+    return abs(to - from) * 100 / elapsed_s;
 }
 
-void set_target_temperature(int value) {
-    atomic_store(&ato_target, value);
+/* The learned model, the zone offsets are applied on their own */
+static void apply_model(const calibration_t *cal) {
+    atomic_store(&ato_heating_rate, cal->heating_rate);
+    atomic_store(&ato_cooling_rate, cal->cooling_rate);
+    atomic_store(&ato_lag, cal->lag);
+    atomic_store(&ato_hold_loss, cal->hold_loss);
+}
+
+/* Power of a channel in closed loop, per-mille */
+static int closed_loop_power(int temperature, int setpoint) {
+    /* 0.01 °C/s by 0.1 s */
+    int anticipation = MIN(atomic_load(&ato_heating_rate) * atomic_load(&ato_lag) / 1000, ANTICIPATION_MAX);
+    int hold = (int64_t)atomic_load(&ato_hold_loss) * MAX(setpoint - AMBIENT, 0) * ACTUATOR_POWER_MAX /
+               (1000LL * ACTUATOR_CHANNELS * CONFIG_HEATER_ELEMENT_WATTS);
+
+    hold = MIN(hold, ACTUATOR_POWER_MAX);
+    if (temperature >= setpoint) {
+        return 0;
+    }
+    if (hold > 0 && temperature > setpoint - anticipation) {
+        return hold + (ACTUATOR_POWER_MAX - hold) * (setpoint - temperature) / anticipation;
+    }
+    return ACTUATOR_POWER_MAX;
 }
 
+/* Returns true when the run is to stop */
+static bool reflow_tick(int step, reflow_phase_t phase, int hold_elapsed_s, int *dp_lvl) {
+    atomic_store(&ato_remaining_s, reflow_predict(step, phase, hold_elapsed_s));
+    run_state.step = step;
+    run_state.phase = phase;
+    run_state.hold_elapsed = hold_elapsed_s;
+    run_state.elapsed = (esp_timer_get_time() - atomic_load(&ato_run_start_us)) / 1000000;
+    run_state.target = atomic_load(&ato_target);
+    run_state.temperature = get_temperature();
+    checkpoint_update(&run_state);
+    /* Woken early by reflow_stop() */
+    ulTaskNotifyTake(pdTRUE, 1000 / portTICK_PERIOD_MS);
+    if (atomic_load(&ato_stop)) {
+        return true;
+    }
+    *dp_lvl = !*dp_lvl;
+    set_dp(*dp_lvl);
+    return false;
+}
+
+/* Last thing reflow_task does, releases whoever waits in reflow_stop() */
+static void reflow_exit(void) {
+    xSemaphoreTake(run_lock, portMAX_DELAY);
+    reflow_handle = NULL;
+    for ( ; stop_waiters > 0; stop_waiters--) {
+        xSemaphoreGive(run_exited);
+    }
+    xSemaphoreGive(run_lock);
+    vTaskDelete(NULL);
+}
+
+/* param is the state to resume from, NULL for a new run */
 void reflow_task(void *param) {
-    const TickType_t xDelay = 1000 / portTICK_PERIOD_MS;
+    const checkpoint_state_t *resume = param;
+    int first_step = 0;
+    int64_t run_start = esp_timer_get_time();
+    /* What the run tells about the oven: sums and counts of the samples */
+    calibration_run_t learned = { .start_temperature = get_temperature() };
+    int heating_sum = 0, heating_count = 0;
+    int lag_sum = 0, lag_count = 0;
+    int hold_sum = 0, hold_count = 0;
+    bool stopped = false;
 
     /* Switch UI mode to reflow */
     int dp_lvl = 1;
     set_dp(1);
 
-    for (int step = 0; step < MAX_REFLOW_STEPS; step++) {        
-        ESP_LOGI(tag, "Ramping temperature to %i", reflow_profile.data[step].temperature);
-        set_target_temperature(reflow_profile.data[step].temperature);
+    /* Profile uploads during the run apply to the next one */
+    get_profile(&run_profile);
 
-        while (get_temperature() < reflow_profile.data[step].temperature) {
-            vTaskDelay(xDelay);
-            dp_lvl = !dp_lvl;
-            set_dp(dp_lvl);
+    run_state = (checkpoint_state_t){0};
+    if (resume != NULL) {
+        run_state = *resume;
+        first_step = resume->step < run_profile.steps ? resume->step : run_profile.steps;
+        run_start -= (int64_t)resume->elapsed * 1000000;
+    }
+    atomic_store(&ato_run_start_us, run_start);
+    energy_start_run();
+    runlog_begin_run(&run_profile, FAN_GAIN);
+    quality_begin_run(&run_profile, resume != NULL);
+    checkpoint_begin(&run_profile);
+    for (int step = first_step; step < run_profile.steps; step++) {
+        /* A run resumed during a hold skips the ramp and holds for the rest */
+        bool holding = resume != NULL && step == first_step && resume->phase == REFLOW_HOLD;
+        int held_s = holding ? resume->hold_elapsed : 0;
+        int64_t ramp_start = esp_timer_get_time();
+        int ramp_from = get_temperature();
+        atomic_store(&ato_step_start_us, ramp_start - (int64_t)held_s * 1000000);
+        atomic_store(&ato_step, step);
+        energy_start_step();
+        set_target_temperature(run_profile.data[step].temperature);
+
+        if (!holding) {
+            atomic_store(&ato_phase, REFLOW_RAMP);
+            ESP_LOGI(tag, "Ramping temperature to %i", run_profile.data[step].temperature);
+            int lag = 0; // 0.1 s
+            while (!stopped && get_temperature() < run_profile.data[step].temperature) {
+                if (!lag && get_temperature() >= ramp_from + LAG_RISE) {
+                    lag = (esp_timer_get_time() - ramp_start) / 100000;
+                }
+                stopped = reflow_tick(step, REFLOW_RAMP, 0, &dp_lvl);
+            }
+            if (stopped) {
+                break;
+            }
+            int rate = measure_rate(ramp_from, get_temperature(), ramp_start);
+            if (rate) {
+                /* Averaged with the previous ramps */
+                atomic_store(&ato_heating_rate, (atomic_load(&ato_heating_rate) + rate) / 2);
+                heating_sum += rate;
+                heating_count++;
+                if (lag) {
+                    lag_sum += lag;
+                    lag_count++;
+                }
+            }
         }
 
-        ESP_LOGI(tag, "Keeping temperature to %i for %i s", reflow_profile.data[step].temperature, reflow_profile.data[step].duration);
-        TickType_t duration = reflow_profile.data[step].duration * 1000 / portTICK_PERIOD_MS;
-        TickType_t step_start_time = xTaskGetTickCount();
+        atomic_store(&ato_phase, REFLOW_HOLD);
+        ESP_LOGI(tag, "Keeping temperature to %i for %i s", run_profile.data[step].temperature, run_profile.data[step].duration - held_s);
+        TickType_t duration = run_profile.data[step].duration * 1000 / portTICK_PERIOD_MS;
+        TickType_t step_start_time = xTaskGetTickCount() - held_s * 1000 / portTICK_PERIOD_MS;
+        uint32_t hold_energy = energy_get_step();
         for ( ;; ) {
             TickType_t elapsed = xTaskGetTickCount() - step_start_time;
             if (elapsed > duration)
                 break;
 
-            vTaskDelay(xDelay);
-            dp_lvl = !dp_lvl;
-            set_dp(dp_lvl);
+            stopped = reflow_tick(step, REFLOW_HOLD, elapsed * portTICK_PERIOD_MS / 1000, &dp_lvl);
+            if (stopped) {
+                break;
+            }
+        }
+        if (stopped) {
+            break;
+        }
+        /* Power to hold the step, over how far it is above the room */
+        int above = run_profile.data[step].temperature - AMBIENT;
+        if (!holding && run_profile.data[step].duration >= RATE_MIN_SAMPLE_S && above >= HOLD_MIN_RISE) {
+            hold_sum += (int64_t)(energy_get_step() - hold_energy) * 1000 / run_profile.data[step].duration / above;
+            hold_count++;
+        }
+    }
+
+    /*
+     * Cool-down: the target follows a ramp at the maximum cooling rate. The
+     * fan pulls the temperature down to the ramp and the heaters keep it
+     * from falling faster. A stopped run leaves the oven to whoever
+     * stopped it.
+     */
+    int64_t cool_start = esp_timer_get_time();
+    int cool_from = get_temperature();
+    atomic_store(&ato_step_start_us, cool_start);
+    atomic_store(&ato_step, REFLOW_STEP_COOLDOWN);
+    atomic_store(&ato_phase, REFLOW_COOLDOWN);
+    energy_start_step();
+    int rate = run_profile.cooling_rate ? run_profile.cooling_rate : CONFIG_REFLOW_COOLING_RATE;
+    int unload = cooldown_unload();
+    int ramp = get_temperature() * 10; // 0.1 °C
+    if (!stopped) {
+        ESP_LOGI(tag, "Cooling down to %i at %i.%i °C/s", unload, rate / 10, rate % 10);
+        atomic_store(&ato_cooling, true);
+    }
+    while (!stopped && get_temperature() > unload) {
+        ramp = MAX(ramp - rate, unload * 10);
+        set_target_temperature(ramp / 10);
+        int measured = measure_rate(cool_from, get_temperature(), cool_start);
+        if (measured) {
+            atomic_store(&ato_cooling_rate, measured);
+            learned.cooling_rate = measured;
+        }
+        stopped = reflow_tick(REFLOW_STEP_COOLDOWN, REFLOW_COOLDOWN, 0, &dp_lvl);
+    }
+    atomic_store(&ato_cooling, false);
+
+    if (!stopped) {
+        set_target_temperature(25);
+    }
+    atomic_store(&ato_remaining_s, 0);
+    atomic_store(&ato_step, -1);
+    atomic_store(&ato_phase, REFLOW_IDLE);
+    ESP_LOGI(tag, "Reflow %s, %" PRIu32 " J delivered", stopped ? "stopped" : "done", energy_get_run());
+    checkpoint_clear();
+    quality_end_run(stopped ? RUNLOG_ABORTED : RUNLOG_COMPLETE);
+    runlog_end_run(stopped ? RUNLOG_ABORTED : RUNLOG_COMPLETE);
+
+    /* A resumed run misses its start, the model only learns from whole ones */
+    if (!stopped && resume == NULL) {
+        learned.heating_rate = heating_count ? heating_sum / heating_count : 0;
+        learned.lag = lag_count ? lag_sum / lag_count : 0;
+        learned.hold_loss = hold_count ? hold_sum / hold_count : 0;
+        learned.duration = (esp_timer_get_time() - run_start) / 1000000;
+        calibration_t cal;
+        if (calibration_learn(&run_profile, &learned, &cal)) {
+            apply_model(&cal);
         }
     }
-    set_target_temperature(25);
 
     /* Switch UI mode back to normal */
     set_dp(0);
 
-    reflow_handle = NULL;
-    vTaskDelete(NULL);
+    reflow_exit();
 }
 
-void reflow_start() {
+/* ESP_ERR_INVALID_STATE while a run or a firmware update is in progress */
+static esp_err_t reflow_launch(checkpoint_state_t *resume) {
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+
+    if (ota_is_active()) {
+        /* Flash writes stall the cache, and with it the firing ISRs */
+        ESP_LOGW(tag, "Firmware update in progress, not starting");
+        return err;
+    }
+    xSemaphoreTake(run_lock, portMAX_DELAY);
     if(reflow_handle == NULL){
-        xTaskCreate(reflow_task, "reflow_task", 8192, NULL, 1, &reflow_handle);
+        atomic_store(&ato_stop, false);
+        err = xTaskCreate(reflow_task, "reflow_task", 8192, resume, 1, &reflow_handle) == pdPASS ? ESP_OK : ESP_ERR_NO_MEM;
     }
+    xSemaphoreGive(run_lock);
+    return err;
+}
+
+esp_err_t reflow_start() {
+    return reflow_launch(NULL);
 }
 
+/* Once the first good reading is in, picks up the run a reset interrupted */
+static void reflow_recover(int temperature) {
+    checkpoint_action_t action = checkpoint_recover(temperature, &resume_profile, &resume_state);
+
+    if (action == CHECKPOINT_NONE) {
+        return;
+    }
+    if (action == CHECKPOINT_COOLDOWN) {
+        resume_state.step = REFLOW_STEP_COOLDOWN;
+        resume_state.phase = REFLOW_COOLDOWN;
+    }
+    /* The run goes on with its own profile, whatever the library loaded */
+    set_profile(&resume_profile);
+    reflow_launch(&resume_state);
+}
+
+/* Returns once the run has wound down, within a tick */
 void reflow_stop() {
-    if(reflow_handle != NULL){
-        vTaskDelete(reflow_handle);
-        reflow_handle = NULL;
-        set_dp(0);
+    bool running;
+
+    xSemaphoreTake(run_lock, portMAX_DELAY);
+    running = reflow_handle != NULL;
+    if (running) {
+        atomic_store(&ato_stop, true);
+        stop_waiters++;
+        xTaskNotifyGive(reflow_handle);
+    }
+    xSemaphoreGive(run_lock);
+    if (running) {
+        xSemaphoreTake(run_exited, portMAX_DELAY);
     }
 }
 
@@ -139,48 +449,96 @@ bool reflow_is_running() {
     return reflow_handle != NULL;
 }
 
-void store_profile(reflow_profile_t *profile) {
-    nvs_handle_t my_handle;
-    esp_err_t err;
+int reflow_get_step(void) {
+    return atomic_load(&ato_step);
+}
+
+reflow_phase_t reflow_get_phase(void) {
+    return atomic_load(&ato_phase);
+}
+
+void reflow_get_progress(reflow_progress_t *progress) {
+    int64_t now = esp_timer_get_time();
+
+    *progress = (reflow_progress_t){
+        .phase = atomic_load(&ato_phase),
+        .step = atomic_load(&ato_step),
+        .steps = get_profile_steps(),
+        .heating_rate = atomic_load(&ato_heating_rate),
+        .cooling_rate = atomic_load(&ato_cooling_rate),
+    };
+    if (progress->phase != REFLOW_IDLE) {
+        progress->step_elapsed = (now - atomic_load(&ato_step_start_us)) / 1000000;
+        progress->elapsed = (now - atomic_load(&ato_run_start_us)) / 1000000;
+        progress->remaining = atomic_load(&ato_remaining_s);
+    }
+}
+
+void reset_calibration(void) {
+    calibration_t cal;
 
-    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &my_handle);
-    ESP_ERROR_CHECK(err);
-    err = nvs_set_blob(my_handle, "reflow_profile", profile, sizeof(reflow_profile_t));
-    ESP_ERROR_CHECK(err);
-    err = nvs_commit(my_handle);
-    ESP_ERROR_CHECK(err);
+    calibration_reset(&cal);
+    apply_model(&cal);
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        atomic_store(&ato_zone_offset[ch], 0);
+    }
+}
 
-    nvs_close(my_handle);
+/* Both go through the library, loads are served from its RAM copy */
+esp_err_t store_profile(const reflow_profile_t *profile) {
+    return library_store_active(profile);
 }
 
 esp_err_t load_profile(reflow_profile_t *profile) {
-    nvs_handle_t my_handle;
-    esp_err_t err;
+    return library_load_active(profile);
+}
 
-    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &my_handle);
-    ESP_ERROR_CHECK(err);
-    size_t required_size = sizeof(reflow_profile_t); // value will default to 0, if not set yet in NVS
-    err = nvs_get_blob(my_handle, "reflow_profile", profile, &required_size);
+void set_profile(const reflow_profile_t *profile) {
+    uint32_t crc = profile_crc(profile);
 
-    nvs_close(my_handle);
-    return err;
+    portENTER_CRITICAL(&profile_lock);
+    reflow_profile.steps = profile->steps;
+    reflow_profile.cooling_rate = profile->cooling_rate;
+    reflow_profile.unload_temperature = profile->unload_temperature;
+    memcpy(reflow_profile.data, profile->data, profile->steps * sizeof(reflow_step_t));
+    portEXIT_CRITICAL(&profile_lock);
+
+    atomic_store(&ato_profile_steps, profile->steps);
+    atomic_store(&ato_profile_crc, crc);
 }
 
-void set_profile(reflow_profile_t *profile) {
-    memcpy(&reflow_profile, profile, sizeof(reflow_profile));
+void get_profile(reflow_profile_t *profile) {
+    portENTER_CRITICAL(&profile_lock);
+    profile->steps = reflow_profile.steps;
+    profile->cooling_rate = reflow_profile.cooling_rate;
+    profile->unload_temperature = reflow_profile.unload_temperature;
+    memcpy(profile->data, reflow_profile.data, reflow_profile.steps * sizeof(reflow_step_t));
+    portEXIT_CRITICAL(&profile_lock);
 }
 
-reflow_profile_t * get_profile(void) {
-    return &reflow_profile;
+int get_profile_steps(void) {
+    return atomic_load(&ato_profile_steps);
+}
+
+uint32_t get_profile_crc(void) {
+    return atomic_load(&ato_profile_crc);
 }
 
 void controller_task(void *param) {
     spi_device_handle_t *spi = (spi_device_handle_t*)param;
     max31855_data_t data;
-    const TickType_t xDelay = 1000 / portTICK_PERIOD_MS;
+    const TickType_t xDelay = CONTROLLER_PERIOD_MS / portTICK_PERIOD_MS;
+    unsigned int tick = 0;
+    int64_t read_us = 0;
+    bool recovered = false;
     for( ;; )
     {
-        max31855_read(*spi, &data);
+        /* Between conversions, the ticks work on the last reading */
+        int64_t now_us = esp_timer_get_time();
+        if (tick == 0 || now_us - read_us >= MAX31855_CONVERSION_MS * 1000) {
+            max31855_read(*spi, &data);
+            read_us = now_us;
+        }
         // LSB = 0.25 degrees C
         int centigrade = data.thermocouple_temp >> 2;
         atomic_store(&ato_temperature, centigrade);
@@ -188,120 +546,96 @@ void controller_task(void *param) {
         int target = atomic_load(&ato_target);
         ESP_LOGD(tag, "Temperature: %i (target: %i)", centigrade, target);
 
-#ifdef CONFIG_ZERO_CROSSING_DRIVER
-        if (centigrade < target) {
-            gpio_set_level(GPIO_OUTPUT_OPTOCOUPLER, 1);
-        } else {
-            gpio_set_level(GPIO_OUTPUT_OPTOCOUPLER, 0);
+        uint32_t total_power = 0;
+        for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+            int manual_power = atomic_load(&ato_manual_power[ch]);
+            if (manual_power >= 0) {
+                actuator_set_power(ch, manual_power);
+            } else {
+                actuator_set_power(ch, closed_loop_power(centigrade, target + atomic_load(&ato_zone_offset[ch])));
+            }
+            total_power += actuator_get_power(ch);
         }
-#else
-        if (centigrade < target) {
-            // pulse_delay should be clamped between 1400 and 9600 @ 100Hz
-            atomic_store(&ato_pulse_delay, 1400);
+        if (atomic_load(&ato_cooling)) {
+            actuator_set_fan(CLAMP((centigrade - target) * FAN_GAIN, 0, ACTUATOR_POWER_MAX));
         } else {
-            atomic_store(&ato_pulse_delay, 0);
+            actuator_set_fan(0);
+        }
+        energy_update();
+
+        telemetry_sample_t sample = {
+            .timestamp = now_us / 1000,
+            .temperature = data.thermocouple_temp,
+            .target = target,
+            .power = total_power / ACTUATOR_CHANNELS,
+            .cold_junction = (int16_t)(data.junction_temp << 4) >> 4,
+            .step = atomic_load(&ato_step),
+            .faults = (data.oc ? TELEMETRY_FAULT_OPEN : 0) |
+                      (data.scg ? TELEMETRY_FAULT_SHORT_GND : 0) |
+                      (data.scb ? TELEMETRY_FAULT_SHORT_VCC : 0),
+        };
+        telemetry_push(&sample);
+        history_push(&sample);
+        runlog_push(&sample);
+        quality_push(&sample, atomic_load(&ato_phase));
+        atomic_store(&ato_faults, sample.faults);
+        proto_poll_changes();
+
+        if (!recovered && !sample.faults) {
+            recovered = true;
+            reflow_recover(centigrade);
+        }
+
+        if (tick++ % (1000 / CONTROLLER_PERIOD_MS) == 0) {
+            bler_tx_temperature(centigrade);
         }
-#endif
-        bler_tx_temperature(centigrade);
         vTaskDelay(xDelay);
     }
 }
 
-static void IRAM_ATTR pcnt_ac_intr_handler(void *arg)
-{
-    static unsigned long last_time = 0;
-    unsigned long pcnt_time = esp_timer_get_time();
-    unsigned long elapsed = pcnt_time - last_time;
-    uint32_t half_ac_freq = 100*100*1000000ULL/elapsed;
-    atomic_store(&ato_half_ac_freq, half_ac_freq);
-    last_time = pcnt_time;
-    pcnt_counter_clear(PCNT_UNIT_0);
-}
-
 void controller_start (spi_device_handle_t *spi) {
     static TaskHandle_t controller_handle;
     xTaskCreate(controller_task, "controller_task", 8192, spi, 1, &controller_handle);
-#ifndef CONFIG_ZERO_CROSSING_DRIVER
-    static TaskHandle_t firing_handle;
-    xTaskCreate(firing_task, "firing_task", 8192, NULL, configMAX_PRIORITIES-1, &firing_handle);
-#endif
-}
-
-static void pcnt_ac_init()
-{
-    pcnt_unit_t unit = PCNT_UNIT_0;
-    /* Prepare configuration for the PCNT unit */
-    pcnt_config_t pcnt_config = {
-        // Set PCNT input signal and control GPIOs
-        .pulse_gpio_num = GPIO_INPUT_ZEROCROSS,
-        .ctrl_gpio_num = -1,
-        .channel = PCNT_CHANNEL_0,
-        .unit = unit,
-        // What to do on the positive / negative edge of pulse input?
-        .pos_mode = PCNT_COUNT_DIS,   // Keep the counter value on the positive edge
-        .neg_mode = PCNT_COUNT_INC,   // Count up on the negative edge
-        // Set the maximum and minimum limit values to watch
-        .counter_h_lim = 100,
-        .counter_l_lim = 0,
-    };
-    /* Initialize PCNT unit */
-    pcnt_unit_config(&pcnt_config);
-
-    /* Configure and enable the input filter */
-    pcnt_set_filter_value(unit, 1023);
-    pcnt_filter_enable(unit);
-
-    pcnt_event_enable(unit, PCNT_EVT_H_LIM);
-
-    /* Initialize PCNT's counter */
-    pcnt_counter_pause(unit);
-    pcnt_counter_clear(unit);
-
-    /* Install interrupt service and add isr callback handler */
-    pcnt_isr_service_install(0);
-    pcnt_isr_handler_add(unit, pcnt_ac_intr_handler, (void *)unit);
-
-    /* Everything is set up, now go to counting */
-    pcnt_counter_resume(unit);
+    actuator_start();
+    runlog_start();
 }
 
 void controller_init (void) {
     atomic_init(&ato_temperature, 0);
+    atomic_init(&ato_faults, 0);
     atomic_init(&ato_target, 25);
-    atomic_init(&ato_half_ac_freq, 0);
-
-    pcnt_ac_init();
-#ifdef CONFIG_ZERO_CROSSING_DRIVER
-    gpio_config_t opto_io = {0};
-    opto_io.pin_bit_mask = 1ULL<<GPIO_OUTPUT_OPTOCOUPLER;
-    opto_io.mode = GPIO_MODE_OUTPUT;
-    gpio_config(&opto_io);
-#else
-    atomic_init(&ato_pulse_delay, 0);
-
-    gpio_config_t io_conf = {0};
-    io_conf.intr_type = GPIO_INTR_NEGEDGE;
-    io_conf.pin_bit_mask = 1ULL<<GPIO_INPUT_ZEROCROSS;
-    io_conf.mode = GPIO_MODE_INPUT;
-    //io_conf.pull_up_en = 1;
-    gpio_config(&io_conf);
-
-    firing_conf.rmt_mode = RMT_MODE_TX;
-    firing_conf.channel = RMT_CHANNEL_0;
-    firing_conf.gpio_num = GPIO_OUTPUT_OPTOCOUPLER;
-    firing_conf.mem_block_num = 1;
-    firing_conf.tx_config.loop_en = 0;
-    firing_conf.tx_config.carrier_en = 0;
-    firing_conf.tx_config.idle_output_en = 1;
-    firing_conf.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
-    firing_conf.clk_div = 80; // 80MHz / 80 = 1MHz or 1uS per count
-    esp_err_t ret;
-    ret = rmt_config(&firing_conf);
-    ret = rmt_driver_install(firing_conf.channel, 0, 0);
-
-    firing_pulse.duration0 = 0;
-    firing_pulse.level0 = 0;
-    firing_pulse.duration1 = 100; // pulse duration
-    firing_pulse.level1 = 1;
-#endif
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        atomic_init(&ato_manual_power[ch], -1);
+        atomic_init(&ato_zone_offset[ch], 0);
+    }
+
+    atomic_init(&ato_step, -1);
+    atomic_init(&ato_phase, REFLOW_IDLE);
+    atomic_init(&ato_run_start_us, 0);
+    atomic_init(&ato_step_start_us, 0);
+    atomic_init(&ato_remaining_s, 0);
+    atomic_init(&ato_heating_rate, CALIBRATION_HEATING_RATE);
+    atomic_init(&ato_cooling_rate, 0);
+    atomic_init(&ato_lag, 0);
+    atomic_init(&ato_hold_loss, 0);
+    atomic_init(&ato_cooling, false);
+    atomic_init(&ato_stop, false);
+    run_lock = xSemaphoreCreateMutex();
+    run_exited = xSemaphoreCreateCounting(REFLOW_STOP_WAITERS, 0);
+
+    /* Starts from what the previous runs taught about the oven */
+    calibration_t cal;
+    calibration_init();
+    calibration_get(&cal);
+    apply_model(&cal);
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        atomic_store(&ato_zone_offset[ch], cal.zone_offset[ch]);
+    }
+
+    actuator_init();
+    energy_init();
+    telemetry_init();
+    history_init();
+    runlog_init();
+    quality_init();
 }
@@ -5,33 +5,66 @@
 #include "driver/spi_master.h"
 
 extern atomic_int ato_target;
-extern atomic_uint ato_half_ac_freq;
-#ifndef CONFIG_ZERO_CROSSING_DRIVER
-extern atomic_uint ato_pulse_delay;
-#endif
 
-#define MAX_REFLOW_STEPS 5 // can fit in any BLE packet
+#define MAX_REFLOW_STEPS 256
+#define REFLOW_STEP_COOLDOWN MAX_REFLOW_STEPS // reported by reflow_get_step()
+
+typedef enum {
+    REFLOW_IDLE,
+    REFLOW_RAMP,
+    REFLOW_HOLD,
+    REFLOW_COOLDOWN,
+} reflow_phase_t;
+
+typedef struct reflow_step_t {
+    uint16_t duration;    // s
+    uint16_t temperature; // °C
+} reflow_step_t;
 
 typedef struct reflow_profile_t {
-    struct {
-        uint32_t duration: 16;
-        uint32_t temperature: 16;
-    } data[MAX_REFLOW_STEPS];
+    uint16_t steps;
+    /* Cool-down stage, zero for the Kconfig defaults */
+    uint16_t cooling_rate; // maximum slope in 0.1 °C/s
+    uint16_t unload_temperature;
+    reflow_step_t data[MAX_REFLOW_STEPS];
 } reflow_profile_t;
 
+/* Packed for the progress characteristic */
+typedef struct __attribute__((packed)) reflow_progress_t {
+    uint8_t phase;          // reflow_phase_t
+    int16_t step;           // -1 when idle
+    uint16_t steps;         // of the active profile
+    uint16_t step_elapsed;  // s
+    uint16_t elapsed;       // s since the start of the run
+    uint16_t remaining;     // s, predicted
+    uint16_t heating_rate;  // 0.01 °C/s, measured
+    uint16_t cooling_rate;  // 0.01 °C/s, measured, 0 until known
+} reflow_progress_t;
+
 void controller_init(void);
 void controller_start(spi_device_handle_t *spi);
 
-void reflow_start(void);
+esp_err_t reflow_start(void);
 void reflow_stop(void);
 bool reflow_is_running(void);
+int reflow_get_step(void);
+reflow_phase_t reflow_get_phase(void);
+void reflow_get_progress(reflow_progress_t *progress);
 
-void store_profile(reflow_profile_t *profile);
+esp_err_t store_profile(const reflow_profile_t *profile);
 esp_err_t load_profile(reflow_profile_t *profile);
-reflow_profile_t * get_profile(void);
-void set_profile(reflow_profile_t *profile);
+void get_profile(reflow_profile_t *profile);
+void set_profile(const reflow_profile_t *profile);
+int get_profile_steps(void);
+uint32_t get_profile_crc(void);
 
 int get_temperature();
+int get_faults(void);
 void set_target_temperature(int value);
+void set_manual_power(int channel, uint16_t power);
+int get_manual_power(int channel);
+void set_zone_offset(int channel, int offset);
+int get_zone_offset(int channel);
+void reset_calibration(void);
 
 #endif
@@ -0,0 +1,81 @@
+#include "esp_log.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "actuator.h"
+#include "energy.h"
+
+static const char *tag = "Energy";
+
+/*
+ * The actuator counts the time each channel spent in full conduction with
+ * a single add per half-cycle. The meter samples these free-running
+ * counters from the controller task and integrates the deltas, which keeps
+ * the per half-cycle cost minimal and makes the 32-bit wrap harmless.
+ */
+static uint32_t last_conduction_us[ACTUATOR_CHANNELS];
+static uint64_t run_conduction_us;
+static uint64_t step_conduction_us;
+
+static atomic_bool ato_run_reset;
+static atomic_bool ato_step_reset;
+
+/* Energy in joules, published for readers outside the controller task */
+static atomic_uint ato_run_joules;
+static atomic_uint ato_step_joules;
+
+static uint32_t to_joules(uint64_t conduction_us) {
+    return conduction_us * CONFIG_HEATER_ELEMENT_WATTS / 1000000;
+}
+
+void energy_update(void) {
+    uint32_t delta = 0;
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        uint32_t conduction_us = actuator_get_conduction_us(ch);
+        delta += conduction_us - last_conduction_us[ch];
+        last_conduction_us[ch] = conduction_us;
+    }
+
+    if (atomic_exchange(&ato_run_reset, false)) {
+        atomic_store(&ato_step_reset, false);
+        run_conduction_us = 0;
+        step_conduction_us = 0;
+        delta = 0;
+    }
+    if (atomic_exchange(&ato_step_reset, false)) {
+        ESP_LOGI(tag, "Step energy: %" PRIu32 " J", to_joules(step_conduction_us));
+        step_conduction_us = 0;
+    }
+
+    run_conduction_us += delta;
+    step_conduction_us += delta;
+    atomic_store(&ato_run_joules, to_joules(run_conduction_us));
+    atomic_store(&ato_step_joules, to_joules(step_conduction_us));
+}
+
+void energy_start_run(void) {
+    atomic_store(&ato_run_reset, true);
+}
+
+void energy_start_step(void) {
+    atomic_store(&ato_step_reset, true);
+}
+
+uint32_t energy_get_run(void) {
+    return atomic_load(&ato_run_joules);
+}
+
+uint32_t energy_get_step(void) {
+    return atomic_load(&ato_step_joules);
+}
+
+void energy_init(void) {
+    atomic_init(&ato_run_reset, false);
+    atomic_init(&ato_step_reset, false);
+    atomic_init(&ato_run_joules, 0);
+    atomic_init(&ato_step_joules, 0);
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        last_conduction_us[ch] = actuator_get_conduction_us(ch);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef H_ENERGY_
+#define H_ENERGY_
+
+#include <stdint.h>
+
+void energy_init(void);
+void energy_update(void);
+
+void energy_start_run(void);
+void energy_start_step(void);
+
+uint32_t energy_get_run(void);
+uint32_t energy_get_step(void);
+
+#endif
@@ -0,0 +1,177 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "firing.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+
+#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+
+/*
+ * Firing scheduler: every channel accumulates its commanded power each
+ * half-cycle and owes a full half-cycle once its accumulator reaches
+ * FIRING_POWER_MAX. At most max_concurrent channels are granted a
+ * half-cycle, the most indebted first, so the on half-cycles of the
+ * channels interleave instead of piling up. Demand that cannot be served
+ * within two half-cycles is dropped rather than accumulated.
+ */
+uint32_t IRAM_ATTR firing_schedule(firing_scheduler_t *sched, const uint16_t *power,
+                                   int channels, int max_concurrent) {
+    uint32_t *accumulator = sched->accumulator;
+    uint32_t fire = 0;
+
+    for (int ch = 0; ch < channels; ch++) {
+        accumulator[ch] += power[ch];
+        if (accumulator[ch] > 2*FIRING_POWER_MAX) {
+            accumulator[ch] = 2*FIRING_POWER_MAX;
+        }
+    }
+    for (int slot = 0; slot < max_concurrent; slot++) {
+        int best = -1;
+        for (int ch = 0; ch < channels; ch++) {
+            if ((fire & (1 << ch)) || accumulator[ch] < FIRING_POWER_MAX) {
+                continue;
+            }
+            if (best < 0 || accumulator[ch] > accumulator[best]) {
+                best = ch;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        fire |= 1 << best;
+        accumulator[best] -= FIRING_POWER_MAX;
+    }
+    return fire;
+}
+
+/*
+ * Phase angle: the gate is pulsed once per half-cycle after a delay. The
+ * power delivered to a resistive load is not linear with the delay, so the
+ * commanded power goes through an inverse of
+ *   P(x) = 1 - x + sin(2*pi*x) / (2*pi)
+ * where x is the delay as a fraction of the half-period.
+ */
+#define PHASE_TABLE_STEPS 32
+#define PHASE_DELAY_SCALE 10000
+// pulse delay should be clamped between 1400 and 9600 @ 100Hz
+#define PHASE_DELAY_MIN 1400
+#define PHASE_DELAY_MAX 9600
+
+static const uint16_t phase_delay_table[PHASE_TABLE_STEPS + 1] = {
+    10000, 8286, 7814, 7471, 7189, 6943, 6721, 6516,
+     6324, 6141, 5967, 5798, 5633, 5472, 5314, 5156,
+     5000, 4844, 4686, 4528, 4367, 4202, 4033, 3859,
+     3676, 3484, 3279, 3057, 2811, 2529, 2186, 1714,
+        0,
+};
+
+uint32_t firing_phase_delay_us(uint16_t power, uint32_t half_period) {
+    if (power > FIRING_POWER_MAX) {
+        power = FIRING_POWER_MAX;
+    }
+    uint32_t pos = (uint32_t)power * PHASE_TABLE_STEPS;
+    uint32_t idx = pos / FIRING_POWER_MAX;
+    uint32_t frac = pos % FIRING_POWER_MAX;
+    int32_t delay = phase_delay_table[idx];
+    if (idx < PHASE_TABLE_STEPS) {
+        delay += ((int32_t)phase_delay_table[idx + 1] - delay) * (int32_t)frac / FIRING_POWER_MAX;
+    }
+    delay = CLAMP(delay, PHASE_DELAY_MIN, PHASE_DELAY_MAX);
+    return (uint32_t)delay * half_period / PHASE_DELAY_SCALE;
+}
+
+/*
+ * Phase-angle conduction windows of all channels overlap at the end of the
+ * half-cycle, so when more channels are active than may conduct at once the
+ * firing falls back to whole half-cycles handed out by the scheduler.
+ * Returns the channels to pulse; delay_us and conducted (the power the
+ * pulse is expected to deliver) are filled for each of them.
+ */
+uint32_t firing_phase_half_cycle(firing_scheduler_t *sched, const uint16_t *power,
+                                 int channels, int max_concurrent, uint32_t half_period,
+                                 uint32_t *delay_us, uint16_t *conducted) {
+    uint32_t fire = 0;
+    int active = 0;
+
+    for (int ch = 0; ch < channels; ch++) {
+        conducted[ch] = power[ch];
+        if (power[ch] > 0) {
+            fire |= 1 << ch;
+            active++;
+        }
+    }
+    if (active > max_concurrent) {
+        fire = firing_schedule(sched, power, channels, max_concurrent);
+        for (int ch = 0; ch < channels; ch++) {
+            conducted[ch] = (fire >> ch) & 1 ? FIRING_POWER_MAX : 0;
+        }
+    }
+    for (int ch = 0; ch < channels; ch++) {
+        delay_us[ch] = (fire >> ch) & 1 ? firing_phase_delay_us(conducted[ch], half_period) : 0;
+    }
+    return fire;
+}
+
+/*
+ * Slow PWM windows for SSRs. The on-windows of the channels are laid end to
+ * end along the period and wrap around (McNaughton's rule), so no more than
+ * max_concurrent channels are on at the same time. A window that wraps past
+ * the end of the period is produced by inverting its complement. When the
+ * total demand exceeds the capacity every channel is scaled down alike;
+ * applied is the resulting power.
+ */
+void firing_ssr_windows(const uint16_t *power, int channels, int max_concurrent,
+                        uint32_t period, uint32_t *hpoint, uint32_t *duty,
+                        bool *invert, uint16_t *applied) {
+    uint32_t on[FIRING_MAX_CHANNELS];
+    uint32_t total = 0;
+    const uint32_t capacity = max_concurrent * period;
+
+    for (int ch = 0; ch < channels; ch++) {
+        on[ch] = (uint64_t)power[ch] * period / FIRING_POWER_MAX;
+        total += on[ch];
+    }
+
+    uint32_t start = 0;
+    for (int ch = 0; ch < channels; ch++) {
+        if (total > capacity) {
+            on[ch] = (uint64_t)on[ch] * capacity / total;
+        }
+        applied[ch] = (uint64_t)on[ch] * FIRING_POWER_MAX / period;
+        hpoint[ch] = start % period;
+        duty[ch] = on[ch];
+        invert[ch] = hpoint[ch] + on[ch] > period;
+        if (invert[ch]) {
+            hpoint[ch] = hpoint[ch] + on[ch] - period;
+            duty[ch] = period - on[ch];
+        }
+        start += on[ch];
+    }
+}
+
+bool IRAM_ATTR firing_debounce(uint32_t *last_time, uint32_t now) {
+    if (now - *last_time < FIRING_DEBOUNCE_US) {
+        return false;
+    }
+    *last_time = now;
+    return true;
+}
+
+/* Half-cycle frequency in 0.01 Hz from the time taken by FIRING_PCNT_EDGES edges */
+uint32_t IRAM_ATTR firing_half_ac_freq(uint32_t elapsed_us) {
+    if (elapsed_us == 0) {
+        return 0;
+    }
+    return FIRING_PCNT_EDGES*100*1000000ULL/elapsed_us;
+}
+
+uint32_t IRAM_ATTR firing_half_period_us(uint32_t half_ac_freq) {
+    if (half_ac_freq == 0) {
+        return FIRING_DEFAULT_HALF_PERIOD_US;
+    }
+    return 100*1000000UL/half_ac_freq;
+}
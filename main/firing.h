@@ -0,0 +1,41 @@
+#ifndef H_FIRING_
+#define H_FIRING_
+
+/*
+ * Hardware independent part of the heater firing path: half-cycle
+ * scheduling, phase-angle linearisation, SSR window packing, zero-cross
+ * debouncing and mains frequency computation. It only depends on the C
+ * library so it can be driven by the host-side mains simulation.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define FIRING_POWER_MAX 1000 // power is expressed in per-mille
+#define FIRING_MAX_CHANNELS 8
+
+#define FIRING_DEBOUNCE_US 2500
+#define FIRING_PCNT_EDGES 100 // zero-cross edges per frequency measurement
+#define FIRING_DEFAULT_HALF_PERIOD_US 10000 // 50 Hz mains until the first measurement
+
+typedef struct firing_scheduler_t {
+    uint32_t accumulator[FIRING_MAX_CHANNELS];
+} firing_scheduler_t;
+
+uint32_t firing_schedule(firing_scheduler_t *sched, const uint16_t *power,
+                         int channels, int max_concurrent);
+
+uint32_t firing_phase_delay_us(uint16_t power, uint32_t half_period);
+uint32_t firing_phase_half_cycle(firing_scheduler_t *sched, const uint16_t *power,
+                                 int channels, int max_concurrent, uint32_t half_period,
+                                 uint32_t *delay_us, uint16_t *conducted);
+
+void firing_ssr_windows(const uint16_t *power, int channels, int max_concurrent,
+                        uint32_t period, uint32_t *hpoint, uint32_t *duty,
+                        bool *invert, uint16_t *applied);
+
+bool firing_debounce(uint32_t *last_time, uint32_t now);
+uint32_t firing_half_ac_freq(uint32_t elapsed_us);
+uint32_t firing_half_period_us(uint32_t half_ac_freq);
+
+#endif
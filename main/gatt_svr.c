@@ -18,43 +18,57 @@
  */
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
-#include <stdatomic.h>
 #include "host/ble_hs.h"
 #include "host/ble_uuid.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
 #include "bler946.h"
 #include "ble_descriptor.h"
-#include "controller.h"
+#include "notify.h"
+#include "ota.h"
+#include "persist.h"
+#include "protocol.h"
 
 static const char* tag = "GATT server";
 
 static const char *manuf_name = "Reflow946";
 static const char *model_num = "Reflow946 ESP32 controller";
 uint16_t rs_temperature_handle;
+uint16_t rs_telemetry_handle;
+uint16_t rs_command_handle;
+uint16_t ota_control_handle;
+static uint16_t rs_target_handle;
+static uint16_t rs_profile_handle;
+static uint16_t rs_ac_freq_handle;
+static uint16_t rs_duty_handle;
+static uint16_t rs_run_state_handle;
+static uint16_t rs_progress_handle;
+static uint16_t rs_storage_handle;
+static uint16_t rs_quality_handle;
 extern uint8_t temprature_sens_read();
 
 static int
-gatt_svr_chr_access_rs_temperature(uint16_t conn_handle, uint16_t attr_handle,
+gatt_svr_chr_access_rs(uint16_t conn_handle, uint16_t attr_handle,
                                struct ble_gatt_access_ctxt *ctxt, void *arg);
 
 static int
-gatt_svr_chr_access_rs_target(uint16_t conn_handle, uint16_t attr_handle,
+gatt_svr_chr_access_notify_only(uint16_t conn_handle, uint16_t attr_handle,
                                struct ble_gatt_access_ctxt *ctxt, void *arg);
 
 static int
-gatt_svr_chr_access_rs_profile(uint16_t conn_handle, uint16_t attr_handle,
+gatt_svr_chr_access_rs_diagnostics(uint16_t conn_handle, uint16_t attr_handle,
                                struct ble_gatt_access_ctxt *ctxt, void *arg);
 
 static int
-gatt_svr_chr_access_rs_ac_freq(uint16_t conn_handle, uint16_t attr_handle,
-                               struct ble_gatt_access_ctxt *ctxt, void *arg);
-
-static int
-gatt_svr_chr_access_rs_duty(uint16_t conn_handle, uint16_t attr_handle,
+gatt_svr_chr_access_ota(uint16_t conn_handle, uint16_t attr_handle,
                                struct ble_gatt_access_ctxt *ctxt, void *arg);
 
 static int
@@ -73,6 +87,10 @@ static int
 gatt_svr_att_access_format_target(uint16_t conn_handle, uint16_t attr_handle,
                                 struct ble_gatt_access_ctxt *ctxt, void *arg);
 
+static int
+gatt_svr_att_access_format_duty(uint16_t conn_handle, uint16_t attr_handle,
+                                struct ble_gatt_access_ctxt *ctxt, void *arg);
+
 static int
 gatt_svr_chr_write(struct os_mbuf *om, uint16_t min_len, uint16_t max_len,
                    void *dst, uint16_t *len);
@@ -86,7 +104,7 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
         { {
                 /* Characteristic: Tempeature measurement */
                 .uuid = BLE_UUID128_DECLARE(GATT_RS_TEMPERATURE_UUID),
-                .access_cb = gatt_svr_chr_access_rs_temperature,
+                .access_cb = gatt_svr_chr_access_notify_only,
                 .val_handle = &rs_temperature_handle,
                 .flags = BLE_GATT_CHR_F_NOTIFY,
                 .descriptors = (struct ble_gatt_dsc_def[])
@@ -101,8 +119,11 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
             }, {
                 /* Characteristic: Temperature control */
                 .uuid = BLE_UUID128_DECLARE(GATT_RS_TARGET_UUID),
-                .access_cb = gatt_svr_chr_access_rs_target,
-                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_TARGET,
+                .val_handle = &rs_target_handle,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE |
+                         BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
                 .descriptors = (struct ble_gatt_dsc_def[])
                 { {
                         .uuid = BLE_UUID16_DECLARE(0x2904),
@@ -115,18 +136,25 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
             }, {
                 /* Characteristic: Reflow profile */
                 .uuid = BLE_UUID128_DECLARE(GATT_RS_PROFILE_UUID),
-                .access_cb = gatt_svr_chr_access_rs_profile,
-                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_PROFILE,
+                .val_handle = &rs_profile_handle,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE |
+                         BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
             }, {
                 /* Characteristic: NVS Reflow profile */
                 .uuid = BLE_UUID128_DECLARE(GATT_RS_NVS_PROFILE_UUID),
-                .access_cb = gatt_svr_chr_access_rs_profile,
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_NVS_PROFILE,
                 .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
             }, {
                 /* Characteristic: AC half period */
                 .uuid = BLE_UUID128_DECLARE(GATT_RS_AC_HALF_FREQ_UUID),
-                .access_cb = gatt_svr_chr_access_rs_ac_freq,
-                .flags = BLE_GATT_CHR_F_READ,
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_AC_FREQ,
+                .val_handle = &rs_ac_freq_handle,
+                .flags = BLE_GATT_CHR_F_READ |
+                         BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
                 .descriptors = (struct ble_gatt_dsc_def[])
                 { {
                         .uuid = BLE_UUID16_DECLARE(0x2904),
@@ -137,10 +165,143 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
                     }
                 },
             }, {
-                /* Characteristic: TRIAC duty cycle */
+                /* Characteristic: Heater power */
                 .uuid = BLE_UUID128_DECLARE(GATT_RS_DUTY_UUID),
-                .access_cb = gatt_svr_chr_access_rs_duty,
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_DUTY,
+                .val_handle = &rs_duty_handle,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE |
+                         BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
+                .descriptors = (struct ble_gatt_dsc_def[])
+                { {
+                        .uuid = BLE_UUID16_DECLARE(0x2904),
+                        .att_flags = BLE_ATT_F_READ,
+                        .access_cb = gatt_svr_att_access_format_duty,
+                    }, {
+                        0,
+                    }
+                },
+            }, {
+                /* Characteristic: Heater zone setpoint offsets */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_ZONE_OFFSET_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_ZONE_OFFSET,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+                .descriptors = (struct ble_gatt_dsc_def[])
+                { {
+                        .uuid = BLE_UUID16_DECLARE(0x2904),
+                        .att_flags = BLE_ATT_F_READ,
+                        .access_cb = gatt_svr_att_access_format_target,
+                    }, {
+                        0,
+                    }
+                },
+            }, {
+                /* Characteristic: Run and step energy */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_ENERGY_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_ENERGY,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                /* Characteristic: Batched telemetry samples */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_TELEMETRY_UUID),
+                .access_cb = gatt_svr_chr_access_notify_only,
+                .val_handle = &rs_telemetry_handle,
+                .flags = BLE_GATT_CHR_F_NOTIFY,
+            }, {
+                /* Characteristic: Telemetry rate */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_TELEMETRY_RATE_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_TELEMETRY_RATE,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+            }, {
+                /* Characteristic: Run state */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_RUN_STATE_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_RUN_STATE,
+                .val_handle = &rs_run_state_handle,
+                .flags = BLE_GATT_CHR_F_READ |
+                         BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE,
+            }, {
+                /* Characteristic: Link and notification diagnostics */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_DIAGNOSTICS_UUID),
+                .access_cb = gatt_svr_chr_access_rs_diagnostics,
+                .flags = BLE_GATT_CHR_F_READ,
+            }, {
+                /* Characteristic: Batched commands */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_COMMAND_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_COMMAND,
+                .val_handle = &rs_command_handle,
+                .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_INDICATE,
+            }, {
+                /* Characteristic: Sample history */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_HISTORY_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_HISTORY,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+            }, {
+                /* Characteristic: Reflow progress */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_PROGRESS_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_PROGRESS,
+                .val_handle = &rs_progress_handle,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+            }, {
+                /* Characteristic: Run log download */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_RUNLOG_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_RUNLOG,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+            }, {
+                /* Characteristic: Profile library */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_LIBRARY_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_LIBRARY,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+            }, {
+                /* Characteristic: NVS writes, wear and latency */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_STORAGE_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_STORAGE,
+                .val_handle = &rs_storage_handle,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+            }, {
+                /* Characteristic: Built-in profiles */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_PRESETS_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_PRESETS,
                 .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+            }, {
+                /* Characteristic: Run quality summaries */
+                .uuid = BLE_UUID128_DECLARE(GATT_RS_QUALITY_UUID),
+                .access_cb = gatt_svr_chr_access_rs,
+                .arg = (void *)PROTO_QUALITY,
+                .val_handle = &rs_quality_handle,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_NOTIFY,
+            }, {
+                0, /* No more characteristics in this service */
+            },
+        }
+    },
+
+    {
+        /* Service: Over-the-air update */
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID128_DECLARE(GATT_OTA_UUID),
+        .characteristics = (struct ble_gatt_chr_def[])
+        { {
+                /* Characteristic: Begin, abort and acknowledgements */
+                .uuid = BLE_UUID128_DECLARE(GATT_OTA_CONTROL_UUID),
+                .access_cb = gatt_svr_chr_access_ota,
+                .val_handle = &ota_control_handle,
+                .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC |
+                         BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC | BLE_GATT_CHR_F_NOTIFY,
+            }, {
+                /* Characteristic: Image chunks */
+                .uuid = BLE_UUID128_DECLARE(GATT_OTA_DATA_UUID),
+                .access_cb = gatt_svr_chr_access_ota,
+                .flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_F_WRITE_ENC,
             }, {
                 0, /* No more characteristics in this service */
             },
@@ -178,92 +339,76 @@ static const struct ble_gatt_svc_def gatt_svr_svcs[] = {
     },
 };
 
-static int
-gatt_svr_chr_access_rs_temperature(uint16_t conn_handle, uint16_t attr_handle,
-                                struct ble_gatt_access_ctxt *ctxt, void *arg)
-{
-    const ble_uuid_t *uuid = ctxt->chr->uuid;
-
-    if (ble_uuid_cmp(uuid, BLE_UUID128_DECLARE(GATT_RS_TEMPERATURE_UUID)) == 0) {
-        switch (ctxt->op) {
-        default:
-            assert(0);
-            return BLE_ATT_ERR_UNLIKELY;
-        }
-    }
+/*
+ * The Reflow service values are encoded, decoded and checked by the
+ * protocol layer (see protocol.h), the access callbacks only move them in
+ * and out of mbufs. Reads and writes of a connection run in the host task,
+ * which has the shared buffer to itself. Notified values are read without
+ * a connection from whichever task calls ble_gatts_chr_updated(), the
+ * notify task mostly, and go through a buffer of their own on its stack.
+ */
+static uint8_t gatt_svr_buf[PROTO_READ_MAX];
 
-    assert(0);
-    return BLE_ATT_ERR_UNLIKELY;
-}
+_Static_assert(PROTO_WRITE_MAX <= sizeof gatt_svr_buf, "writes must fit");
+/* The host reads notified values back without a connection, see proto_read() */
+_Static_assert(BLE_HS_CONN_HANDLE_NONE == PROTO_CONN_NONE, "notified values are read without a connection");
 
 static int
-gatt_svr_chr_access_rs_target(uint16_t conn_handle, uint16_t attr_handle,
-                                    struct ble_gatt_access_ctxt *ctxt, void *arg)
+gatt_svr_proto_error(proto_status_t status)
 {
-    int16_t target;
-    int rc;
-
-    switch (ctxt->op) {
-    case BLE_GATT_ACCESS_OP_READ_CHR:
-        target = atomic_load(&ato_target) * 10;
-        rc = os_mbuf_append(ctxt->om, &target,
-                            sizeof target);
-        return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
-
-    case BLE_GATT_ACCESS_OP_WRITE_CHR:
-        rc = gatt_svr_chr_write(ctxt->om,
-                                sizeof target,
-                                sizeof target,
-                                &target, NULL);
-        reflow_stop();
-        atomic_store(&ato_target, target / 10);
-        return rc;
-
+    switch (status) {
+    case PROTO_OK:
+        return 0;
+    case PROTO_ERR_LENGTH:
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    case PROTO_ERR_VALUE:
+        return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+    case PROTO_ERR_OFFSET:
+        return BLE_ATT_ERR_INVALID_OFFSET;
+    case PROTO_ERR_BUSY:
+    case PROTO_ERR_FAILED:
+        return BLE_ATT_ERR_INSUFFICIENT_RES;
+    case PROTO_ERR_NOT_PERMITTED:
+        return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
     default:
-        assert(0);
         return BLE_ATT_ERR_UNLIKELY;
     }
 }
 
 static int
-gatt_svr_chr_access_rs_profile(uint16_t conn_handle, uint16_t attr_handle,
-                                    struct ble_gatt_access_ctxt *ctxt, void *arg)
+gatt_svr_chr_access_rs(uint16_t conn_handle, uint16_t attr_handle,
+                       struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
-    ble_uuid_t *uuid = ctxt->chr->uuid;
-    reflow_profile_t profile = {0};
-    reflow_profile_t *p_profile = &profile;
-    uint16_t profile_len;
+    proto_chr_t chr = (proto_chr_t)(intptr_t)arg;
+    uint8_t value[PROTO_VALUE_MAX];
+    proto_status_t status;
+    uint16_t len;
     int rc;
 
     switch (ctxt->op) {
     case BLE_GATT_ACCESS_OP_READ_CHR:
-        if (ble_uuid_cmp(uuid, BLE_UUID128_DECLARE(GATT_RS_NVS_PROFILE_UUID)) == 0) {
-            load_profile(&profile);
-        } else {
-            p_profile = get_profile;
+        if (conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            status = proto_read(conn_handle, chr, value, sizeof value, &len);
+            if (status != PROTO_OK) {
+                return gatt_svr_proto_error(status);
+            }
+            return os_mbuf_append(ctxt->om, value, len) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
         }
-        rc = os_mbuf_append(ctxt->om, p_profile,
-                            sizeof(reflow_profile_t));
+        status = proto_read(conn_handle, chr, gatt_svr_buf, sizeof gatt_svr_buf, &len);
+        if (status != PROTO_OK) {
+            return gatt_svr_proto_error(status);
+        }
+        rc = os_mbuf_append(ctxt->om, gatt_svr_buf, len);
+        bler_count_traffic(conn_handle, len, 0);
         return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 
     case BLE_GATT_ACCESS_OP_WRITE_CHR:
-        rc = gatt_svr_chr_write(ctxt->om,
-                                2,
-                                sizeof profile,
-                                &profile.data, &profile_len);
-
-        ESP_LOG_BUFFER_HEX_LEVEL(tag, profile.data, profile_len, ESP_LOG_INFO);
-        for (int step = 0; step < MAX_REFLOW_STEPS; step++) {
-            ESP_LOGI(tag, "%i °C for %i s", profile.data[step].temperature, profile.data[step].duration);
+        bler_count_traffic(conn_handle, 0, OS_MBUF_PKTLEN(ctxt->om));
+        rc = gatt_svr_chr_write(ctxt->om, 0, PROTO_WRITE_MAX, gatt_svr_buf, &len);
+        if (rc != 0) {
+            return rc;
         }
-
-        set_profile(&profile);
-        if (ble_uuid_cmp(uuid, BLE_UUID128_DECLARE(GATT_RS_NVS_PROFILE_UUID)) == 0) {
-            store_profile(&profile);
-        } else {
-            reflow_start();
-        }
-        return rc;
+        return gatt_svr_proto_error(proto_write(conn_handle, chr, gatt_svr_buf, len));
 
     default:
         assert(0);
@@ -271,40 +416,124 @@ gatt_svr_chr_access_rs_profile(uint16_t conn_handle, uint16_t attr_handle,
     }
 }
 
+/* Temperature and telemetry are only ever notified */
 static int
-gatt_svr_chr_access_rs_ac_freq(uint16_t conn_handle, uint16_t attr_handle,
+gatt_svr_chr_access_notify_only(uint16_t conn_handle, uint16_t attr_handle,
+                                struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    assert(0);
+    return BLE_ATT_ERR_UNLIKELY;
+}
+
+static int
+gatt_svr_chr_access_rs_diagnostics(uint16_t conn_handle, uint16_t attr_handle,
                                     struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
+    struct __attribute__((packed)) {
+        uint16_t mtu;
+        uint16_t conn_itvl;         /* 1.25 ms */
+        uint16_t conn_latency;
+        uint16_t supervision_timeout; /* 10 ms */
+        uint8_t bulk;
+        uint32_t tx_rate;           /* B/s over the last second */
+        uint32_t rx_rate;
+        uint32_t tx_peak;
+        uint32_t rx_peak;
+        uint32_t notify_sent;
+        uint32_t notify_dropped;
+        uint32_t notify_coalesced;
+        uint32_t notify_failed;
+        uint32_t reconnect_last_ms;
+        uint32_t reconnect_max_ms;
+    } diag;
+    bler_link_stats_t link;
+    notify_stats_t notify;
+    bler_reconnect_stats_t reconnect;
     int rc;
 
-    uint16_t half_ac_freq = atomic_load(&ato_half_ac_freq);
-    rc = os_mbuf_append(ctxt->om, &half_ac_freq, sizeof half_ac_freq);
+    if (bler_get_link_stats(conn_handle, &link) != 0) {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    notify_get_stats(&notify);
+    bler_get_reconnect_stats(&reconnect);
+
+    diag.mtu = link.mtu;
+    diag.conn_itvl = link.conn_itvl;
+    diag.conn_latency = link.conn_latency;
+    diag.supervision_timeout = link.supervision_timeout;
+    diag.bulk = link.bulk;
+    diag.tx_rate = link.tx_rate;
+    diag.rx_rate = link.rx_rate;
+    diag.tx_peak = link.tx_peak;
+    diag.rx_peak = link.rx_peak;
+    diag.notify_sent = notify.sent;
+    diag.notify_dropped = notify.dropped;
+    diag.notify_coalesced = notify.coalesced;
+    diag.notify_failed = notify.failed;
+    diag.reconnect_last_ms = reconnect.last_ms;
+    diag.reconnect_max_ms = reconnect.max_ms;
+
+    rc = os_mbuf_append(ctxt->om, &diag, sizeof diag);
     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
 
+/*
+ * OTA, see ota.h. Chunks are written without response and acknowledged a
+ * window at a time by control notifications, so the client can fill every
+ * connection event. The control read returns the confirmed offset and the
+ * image size, zero when no update is in progress. Both characteristics
+ * need an encrypted link, and ota_begin() a bonded one.
+ */
 static int
-gatt_svr_chr_access_rs_duty(uint16_t conn_handle, uint16_t attr_handle,
+gatt_svr_chr_access_ota(uint16_t conn_handle, uint16_t attr_handle,
                                     struct ble_gatt_access_ctxt *ctxt, void *arg)
 {
+    const ble_uuid_t *uuid = ctxt->chr->uuid;
+    static uint8_t chunk[BLE_ATT_ATTR_MAX_LEN];
+    uint32_t progress[2];
+    ota_notification_t notification = {0};
+    uint32_t offset = 0;
+    uint16_t len;
     int rc;
 
-    uint32_t pulse_delay;
     switch (ctxt->op) {
-#ifndef CONFIG_ZERO_CROSSING_DRIVER
     case BLE_GATT_ACCESS_OP_READ_CHR:
-        atomic_load(&ato_pulse_delay);
-        rc = os_mbuf_append(ctxt->om, &pulse_delay,
-                            sizeof pulse_delay);
+        ota_get_progress(&progress[0], &progress[1]);
+        rc = os_mbuf_append(ctxt->om, progress, sizeof progress);
         return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 
     case BLE_GATT_ACCESS_OP_WRITE_CHR:
-        rc = gatt_svr_chr_write(ctxt->om,
-                                sizeof pulse_delay,
-                                sizeof pulse_delay,
-                                &pulse_delay, NULL);
-        atomic_store(&ato_pulse_delay, pulse_delay);
-        return rc;
-#endif
+        bler_count_traffic(conn_handle, 0, OS_MBUF_PKTLEN(ctxt->om));
+        rc = gatt_svr_chr_write(ctxt->om, 1, sizeof chunk, chunk, &len);
+        if (rc != 0) {
+            return rc;
+        }
+        if (ble_uuid_cmp(uuid, BLE_UUID128_DECLARE(GATT_OTA_DATA_UUID)) == 0) {
+            ota_write(conn_handle, chunk, len);
+            return 0;
+        }
+
+        notification.op = chunk[0];
+        switch (chunk[0]) {
+        case OTA_OP_BEGIN:
+            if (len != 1 + sizeof(uint32_t) + OTA_HASH_LEN) {
+                return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+            }
+            uint32_t size;
+            memcpy(&size, &chunk[1], sizeof size);
+            notification.status = ota_begin(conn_handle, size, &chunk[1 + sizeof size], &offset);
+            notification.offset = offset;
+            break;
+
+        case OTA_OP_ABORT:
+            notification.status = ota_abort(conn_handle);
+            break;
+
+        default:
+            return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+        }
+        bler_tx_ota(conn_handle, &notification, sizeof notification);
+        return 0;
 
     default:
         assert(0);
@@ -371,6 +600,21 @@ gatt_svr_att_access_format_ac_freq(uint16_t conn_handle, uint16_t attr_handle,
     return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
 }
 
+static int
+gatt_svr_att_access_format_duty(uint16_t conn_handle, uint16_t attr_handle,
+                                struct ble_gatt_access_ctxt *ctxt, void *arg)
+{
+    int rc;
+    ble2904_data_t ble2904 = {
+        .format = 0x06,
+        .exponent = -1,
+        .unit = 0x27AD, // percentage
+        .namespace = 1, // 1 = Bluetooth SIG Assigned Numbers
+    };
+    rc = os_mbuf_append(ctxt->om, &ble2904, sizeof(ble2904));
+    return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
 static int
 gatt_svr_chr_write(struct os_mbuf *om, uint16_t min_len, uint16_t max_len,
                    void *dst, uint16_t *len)
@@ -391,6 +635,129 @@ gatt_svr_chr_write(struct os_mbuf *om, uint16_t min_len, uint16_t max_len,
     return 0;
 }
 
+/*
+ * NimBLE transport of the protocol layer. Updated values go through the
+ * notification queue, command results are indicated by main.c.
+ */
+static const uint16_t *gatt_svr_val_handles[PROTO_CHRS] = {
+    [PROTO_TARGET] = &rs_target_handle,
+    [PROTO_PROFILE] = &rs_profile_handle,
+    [PROTO_AC_FREQ] = &rs_ac_freq_handle,
+    [PROTO_DUTY] = &rs_duty_handle,
+    [PROTO_RUN_STATE] = &rs_run_state_handle,
+    [PROTO_PROGRESS] = &rs_progress_handle,
+    [PROTO_STORAGE] = &rs_storage_handle,
+    [PROTO_QUALITY] = &rs_quality_handle,
+};
+
+static bool
+gatt_svr_proto_connected(uint16_t conn_handle)
+{
+    return ble_gap_conn_find(conn_handle, NULL) == 0;
+}
+
+static uint16_t
+gatt_svr_proto_mtu(uint16_t conn_handle)
+{
+    return ble_att_mtu(conn_handle);
+}
+
+static void
+gatt_svr_proto_updated(proto_chr_t chr)
+{
+    if (gatt_svr_val_handles[chr] != NULL) {
+        notify_post_updated(*gatt_svr_val_handles[chr]);
+    }
+}
+
+static void
+gatt_svr_proto_indicate(uint16_t conn_handle, proto_chr_t chr, const void *data, uint16_t len)
+{
+    if (chr == PROTO_COMMAND) {
+        bler_tx_command_result(conn_handle, data, len);
+    }
+}
+
+static int64_t
+gatt_svr_proto_time_us(void)
+{
+    return esp_timer_get_time();
+}
+
+static const proto_transport_t gatt_svr_transport = {
+    .slot = bler_conn_slot,
+    .connected = gatt_svr_proto_connected,
+    .mtu = gatt_svr_proto_mtu,
+    .updated = gatt_svr_proto_updated,
+    .indicate = gatt_svr_proto_indicate,
+    .time_us = gatt_svr_proto_time_us,
+};
+
+/*
+ * The attribute table is static, so bonded clients may cache its handles.
+ * A hash of the table is kept in NVS and the Service Changed indication is
+ * only sent, once, when a firmware update actually changes it. The check
+ * runs in the host task, the hash is written by the persistence task.
+ */
+#define STORAGE_NAMESPACE "storage"
+#define DB_HASH_KEY "gatt_db_hash"
+#define LEGACY_DB_HASH_KEY "gatt_hash"  // kept as an u32 by older firmware
+
+static uint32_t
+gatt_svr_db_hash(void)
+{
+    uint8_t uuid[16];
+    uint32_t crc = 0;
+
+    for (const struct ble_gatt_svc_def *svc = gatt_svr_svcs; svc->type; svc++) {
+        ble_uuid_flat(svc->uuid, uuid);
+        crc = esp_rom_crc32_le(crc, uuid, ble_uuid_length(svc->uuid));
+        for (const struct ble_gatt_chr_def *chr = svc->characteristics; chr->uuid; chr++) {
+            ble_uuid_flat(chr->uuid, uuid);
+            crc = esp_rom_crc32_le(crc, uuid, ble_uuid_length(chr->uuid));
+            crc = esp_rom_crc32_le(crc, (const uint8_t *)&chr->flags, sizeof chr->flags);
+            for (const struct ble_gatt_dsc_def *dsc = chr->descriptors; dsc && dsc->uuid; dsc++) {
+                ble_uuid_flat(dsc->uuid, uuid);
+                crc = esp_rom_crc32_le(crc, uuid, ble_uuid_length(dsc->uuid));
+                crc = esp_rom_crc32_le(crc, &dsc->att_flags, sizeof dsc->att_flags);
+            }
+        }
+    }
+    return crc;
+}
+
+static void
+gatt_svr_db_hash_persisted(void *arg, esp_err_t err)
+{
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Attribute table hash lost, caches invalidated again at the next boot: %s",
+                 esp_err_to_name(err));
+    }
+}
+
+void
+gatt_svr_check_db_hash(void)
+{
+    uint32_t hash = gatt_svr_db_hash();
+    uint32_t stored = 0;
+    size_t len = sizeof stored;
+    esp_err_t err;
+
+    err = persist_read(STORAGE_NAMESPACE, DB_HASH_KEY, &stored, &len);
+    if (err == ESP_OK && len == sizeof stored && stored == hash) {
+        return;
+    }
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(tag, "Attribute table hash unreadable: %s", esp_err_to_name(err));
+    }
+    ESP_LOGI(tag, "Attribute table changed (%08" PRIx32 "), invalidating client caches", hash);
+    ble_svc_gatt_changed(0x0001, 0xffff);
+    if (persist_write(STORAGE_NAMESPACE, DB_HASH_KEY, &hash, sizeof hash, gatt_svr_db_hash_persisted, NULL) == ESP_OK &&
+        err == ESP_ERR_NVS_NOT_FOUND) {
+        persist_erase(STORAGE_NAMESPACE, LEGACY_DB_HASH_KEY, NULL, NULL);
+    }
+}
+
 void
 gatt_svr_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg)
 {
@@ -430,6 +797,7 @@ gatt_svr_init(void)
 
     ble_svc_gap_init();
     ble_svc_gatt_init();
+    proto_init(&gatt_svr_transport);
 
     rc = ble_gatts_count_cfg(gatt_svr_svcs);
     if (rc != 0) {
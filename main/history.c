@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "history.h"
+
+/*
+ * Recent samples, averaged to HISTORY_PERIOD_MS, and older ones decimated
+ * into a coarse ring. Every full resolution sample gets a sequence number;
+ * coarse sample k covers the sequence numbers [k * HISTORY_DECIMATION,
+ * (k + 1) * HISTORY_DECIMATION).
+ *
+ * The controller task is the only writer: it fills a slot, then publishes
+ * it by bumping the head. Readers copy without any lock and check the head
+ * again afterwards, dropping whatever the writer may have overwritten in
+ * the meantime, so reading never delays the control loop.
+ */
+#define HISTORY_MARGIN 4 // slots a reader leaves to the writer
+
+typedef struct history_acc_t {
+    uint32_t count;
+    int32_t temperature;
+    int32_t cold_junction;
+    uint32_t power;
+    uint8_t faults;
+    telemetry_sample_t first;
+    telemetry_sample_t last;
+} history_acc_t;
+
+static telemetry_sample_t fine[HISTORY_LEN];
+static telemetry_sample_t coarse[HISTORY_COARSE_LEN];
+static atomic_uint ato_head;        // sequence number of the next sample
+static atomic_uint ato_coarse_head; // index of the next coarse sample
+
+/* Controller task only */
+static history_acc_t fine_acc;
+static history_acc_t coarse_acc;
+
+static void history_accumulate(history_acc_t *acc, const telemetry_sample_t *sample) {
+    if (acc->count == 0) {
+        acc->first = *sample;
+        acc->temperature = 0;
+        acc->cold_junction = 0;
+        acc->power = 0;
+        acc->faults = 0;
+    }
+    acc->count++;
+    acc->temperature += sample->temperature;
+    acc->cold_junction += sample->cold_junction;
+    acc->power += sample->power;
+    acc->faults |= sample->faults;
+    acc->last = *sample;
+}
+
+/* Mean temperatures and power, the latest target and step, any fault seen */
+static void history_average(history_acc_t *acc, telemetry_sample_t *sample) {
+    *sample = acc->last;
+    sample->timestamp = acc->first.timestamp;
+    sample->temperature = acc->temperature / (int32_t)acc->count;
+    sample->cold_junction = acc->cold_junction / (int32_t)acc->count;
+    sample->power = acc->power / acc->count;
+    sample->faults = acc->faults;
+    acc->count = 0;
+}
+
+void history_push(const telemetry_sample_t *sample) {
+    /* A full resolution sample closes once a new period begins */
+    if (fine_acc.count == 0 ||
+        sample->timestamp / HISTORY_PERIOD_MS == fine_acc.first.timestamp / HISTORY_PERIOD_MS) {
+        history_accumulate(&fine_acc, sample);
+        return;
+    }
+
+    unsigned int head = atomic_load_explicit(&ato_head, memory_order_relaxed);
+    telemetry_sample_t *slot = &fine[head % HISTORY_LEN];
+    history_average(&fine_acc, slot);
+    atomic_store_explicit(&ato_head, head + 1, memory_order_release);
+    history_accumulate(&fine_acc, sample);
+
+    history_accumulate(&coarse_acc, slot);
+    if ((head + 1) % HISTORY_DECIMATION == 0) {
+        unsigned int coarse_head = atomic_load_explicit(&ato_coarse_head, memory_order_relaxed);
+        history_average(&coarse_acc, &coarse[coarse_head % HISTORY_COARSE_LEN]);
+        atomic_store_explicit(&ato_coarse_head, coarse_head + 1, memory_order_release);
+    }
+}
+
+static uint32_t oldest(uint32_t head, uint32_t len) {
+    return head > len - HISTORY_MARGIN ? head - (len - HISTORY_MARGIN) : 0;
+}
+
+/* Copies ring[from, from + count), returns how many leading samples are still valid */
+static int history_copy(const telemetry_sample_t *ring, uint32_t len, atomic_uint *head,
+                        uint32_t from, int count, telemetry_sample_t *samples, int *skipped) {
+    for (int i = 0; i < count; i++) {
+        samples[i] = ring[(from + i) % len];
+    }
+    uint32_t valid_from = oldest(atomic_load_explicit(head, memory_order_acquire), len);
+    *skipped = valid_from > from ? valid_from - from : 0;
+    if (*skipped > count) {
+        *skipped = count;
+    }
+    return count - *skipped;
+}
+
+/*
+ * Fills samples with up to max samples from sequence number *seq on. When
+ * that part of the history is only left at the coarse resolution, the
+ * samples are coarse ones and *stride is HISTORY_DECIMATION, otherwise 1.
+ * *seq is moved forward to the first sample returned when older ones are
+ * gone. Returns the number of samples, 0 once caught up.
+ */
+int history_read(uint32_t *seq, uint8_t *stride, telemetry_sample_t *samples, int max) {
+    for ( ;; ) {
+        uint32_t head = atomic_load_explicit(&ato_head, memory_order_acquire);
+        uint32_t fine_oldest = oldest(head, HISTORY_LEN);
+        int count, skipped;
+
+        if (*seq > head) {
+            *seq = head;
+        }
+        if (*seq < fine_oldest) {
+            uint32_t coarse_head = atomic_load_explicit(&ato_coarse_head, memory_order_acquire);
+            uint32_t k = *seq / HISTORY_DECIMATION;
+            uint32_t end = (fine_oldest + HISTORY_DECIMATION - 1) / HISTORY_DECIMATION;
+
+            if (end > coarse_head) {
+                end = coarse_head;
+            }
+            if (k < oldest(coarse_head, HISTORY_COARSE_LEN)) {
+                k = oldest(coarse_head, HISTORY_COARSE_LEN);
+            }
+            if (k < end) {
+                count = end - k < max ? end - k : max;
+                count = history_copy(coarse, HISTORY_COARSE_LEN, &ato_coarse_head,
+                                     k, count, samples, &skipped);
+                if (count == 0) {
+                    continue;
+                }
+                if (skipped) {
+                    memmove(samples, &samples[skipped], count * sizeof *samples);
+                }
+                *seq = (k + skipped) * HISTORY_DECIMATION;
+                *stride = HISTORY_DECIMATION;
+                return count;
+            }
+            *seq = fine_oldest;
+        }
+
+        count = head - *seq < max ? head - *seq : max;
+        count = history_copy(fine, HISTORY_LEN, &ato_head, *seq, count, samples, &skipped);
+        if (skipped) {
+            /* Overwritten while copying, start over from the coarse ring */
+            continue;
+        }
+        *stride = 1;
+        return count;
+    }
+}
+
+uint32_t history_head(void) {
+    return atomic_load(&ato_head);
+}
+
+void history_init(void) {
+    atomic_init(&ato_head, 0);
+    atomic_init(&ato_coarse_head, 0);
+}
@@ -0,0 +1,17 @@
+#ifndef H_HISTORY_
+#define H_HISTORY_
+
+#include <stdint.h>
+#include "telemetry.h"
+
+#define HISTORY_PERIOD_MS 1000 // full resolution
+#define HISTORY_LEN 1024       // 17 min at full resolution, longer than a run
+#define HISTORY_DECIMATION 10  // older samples are kept at 10 s
+#define HISTORY_COARSE_LEN 256 // 42 min more
+
+void history_init(void);
+void history_push(const telemetry_sample_t *sample);
+int history_read(uint32_t *seq, uint8_t *stride, telemetry_sample_t *samples, int max);
+uint32_t history_head(void);
+
+#endif
@@ -0,0 +1,354 @@
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "controller.h"
+#include "profile.h"
+#include "persist.h"
+#include "library.h"
+
+static const char *tag = "Library";
+
+#define LIBRARY_NAMESPACE "library"
+#define LIBRARY_INDEX_KEY "index"
+#define LEGACY_NAMESPACE "storage"       // single profile of older firmware
+#define LEGACY_PROFILE_KEY "reflow_profile"
+#define LEGACY_STEPS 5                   // fixed in the first firmware
+#define LIBRARY_KEY_MAX 8                // "slot15"
+
+/*
+ * The index and the active profile are kept in RAM, so that listing the
+ * library and reading the stored profile never touch the flash. Changes
+ * update them as soon as they are queued and are written to NVS by the
+ * persistence task, in an order where the index never lists a slot that
+ * is not stored. Should a write fail, the caches are reloaded from what
+ * NVS and the pending requests hold, so they never show what a reboot
+ * would not. Writers take write_lock, which also covers the scratch
+ * buffers; readers only take cache_lock for the copy.
+ */
+static SemaphoreHandle_t write_lock;
+static portMUX_TYPE cache_lock = portMUX_INITIALIZER_UNLOCKED;
+static library_index_t index_cache;
+static reflow_profile_t active_cache; // valid unless index_cache.active is LIBRARY_NONE
+
+static library_index_t index_scratch;
+static reflow_profile_t profile_scratch;
+static uint8_t image[PROFILE_IMAGE_MAX];
+
+static void library_key(int slot, char *key) {
+    snprintf(key, LIBRARY_KEY_MAX, "slot%i", slot);
+}
+
+static void library_set_cache(const library_index_t *index, const reflow_profile_t *active) {
+    portENTER_CRITICAL(&cache_lock);
+    index_cache = *index;
+    if (active != NULL) {
+        active_cache.steps = active->steps;
+        active_cache.cooling_rate = active->cooling_rate;
+        active_cache.unload_temperature = active->unload_temperature;
+        memcpy(active_cache.data, active->data, active->steps * sizeof(reflow_step_t));
+    }
+    portEXIT_CRITICAL(&cache_lock);
+}
+
+_Static_assert(PROFILE_IMAGE_MAX <= PERSIST_VALUE_MAX, "slots are written through the persistence task");
+
+static esp_err_t library_load(void);
+
+/* Persistence task */
+static void library_persisted(void *arg, esp_err_t err) {
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Library change not stored, reloading: %s", esp_err_to_name(err));
+        xSemaphoreTake(write_lock, portMAX_DELAY);
+        library_load();
+        xSemaphoreGive(write_lock);
+    }
+}
+
+static esp_err_t library_write_index(const library_index_t *index) {
+    return persist_write(LIBRARY_NAMESPACE, LIBRARY_INDEX_KEY, index, sizeof *index, library_persisted, NULL);
+}
+
+/* Reads and checks the image of a slot into profile_scratch, under write_lock */
+static esp_err_t library_read_slot(int slot) {
+    char key[LIBRARY_KEY_MAX];
+    size_t len = sizeof image;
+    esp_err_t err;
+
+    library_key(slot, key);
+    err = persist_read(LIBRARY_NAMESPACE, key, image, &len);
+    if (err == ESP_OK) {
+        err = profile_decode(image, len, &profile_scratch);
+    }
+    return err;
+}
+
+/* Under write_lock, activate also makes it the slot loaded at boot */
+static esp_err_t library_write(int slot, const char *name, size_t name_len,
+                               const reflow_profile_t *profile, bool activate) {
+    library_entry_t *entry = &index_scratch.slots[slot];
+    char key[LIBRARY_KEY_MAX];
+    size_t len;
+    esp_err_t err;
+
+    len = profile_encode(profile, image, sizeof image);
+    library_get_index(&index_scratch);
+    if (name != NULL) {
+        memset(entry->name, 0, sizeof entry->name);
+        memcpy(entry->name, name, name_len);
+    } else if (!entry->used) {
+        snprintf(entry->name, sizeof entry->name, "Profile %i", slot + 1);
+    }
+    entry->used = 1;
+    entry->steps = profile->steps;
+    entry->crc = profile_crc(profile);
+    if (activate) {
+        index_scratch.active = slot;
+    }
+
+    library_key(slot, key);
+    err = persist_write(LIBRARY_NAMESPACE, key, image, len, library_persisted, NULL);
+    if (err == ESP_OK) {
+        err = library_write_index(&index_scratch);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Cannot store slot %i: %s", slot, esp_err_to_name(err));
+        return err;
+    }
+    library_set_cache(&index_scratch, index_scratch.active == slot ? profile : NULL);
+    return ESP_OK;
+}
+
+void library_get_index(library_index_t *index) {
+    portENTER_CRITICAL(&cache_lock);
+    *index = index_cache;
+    portEXIT_CRITICAL(&cache_lock);
+}
+
+int library_get_active(void) {
+    int active;
+
+    portENTER_CRITICAL(&cache_lock);
+    active = index_cache.active;
+    portEXIT_CRITICAL(&cache_lock);
+    return active == LIBRARY_NONE ? -1 : active;
+}
+
+/* Next used slot after the given one, wrapping around, -1 when empty */
+int library_next(int slot) {
+    int next = -1;
+
+    portENTER_CRITICAL(&cache_lock);
+    for (int i = 1; i <= LIBRARY_SLOTS; i++) {
+        int candidate = (slot + i + LIBRARY_SLOTS) % LIBRARY_SLOTS;
+        if (index_cache.slots[candidate].used) {
+            next = candidate;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&cache_lock);
+    return next;
+}
+
+/* From RAM, ESP_ERR_NVS_NOT_FOUND when no slot is active */
+esp_err_t library_load_active(reflow_profile_t *profile) {
+    esp_err_t err = ESP_ERR_NVS_NOT_FOUND;
+
+    portENTER_CRITICAL(&cache_lock);
+    if (index_cache.active != LIBRARY_NONE) {
+        profile->steps = active_cache.steps;
+        profile->cooling_rate = active_cache.cooling_rate;
+        profile->unload_temperature = active_cache.unload_temperature;
+        memcpy(profile->data, active_cache.data, active_cache.steps * sizeof(reflow_step_t));
+        err = ESP_OK;
+    }
+    portEXIT_CRITICAL(&cache_lock);
+    return err;
+}
+
+/* A NULL name keeps the name of the slot */
+esp_err_t library_store(int slot, const char *name, size_t name_len, const reflow_profile_t *profile) {
+    esp_err_t err;
+
+    if (slot < 0 || slot >= LIBRARY_SLOTS || name_len > LIBRARY_NAME_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    err = library_write(slot, name, name_len, profile, false);
+    xSemaphoreGive(write_lock);
+    return err;
+}
+
+/* To the active slot, or the first free one, which becomes active */
+esp_err_t library_store_active(const reflow_profile_t *profile) {
+    int slot;
+    esp_err_t err;
+
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    slot = library_get_active();
+    if (slot < 0) {
+        library_get_index(&index_scratch);
+        for (int i = 0; i < LIBRARY_SLOTS && slot < 0; i++) {
+            if (!index_scratch.slots[i].used) {
+                slot = i;
+            }
+        }
+    }
+    err = slot >= 0 ? library_write(slot, NULL, 0, profile, true) : ESP_ERR_NO_MEM;
+    xSemaphoreGive(write_lock);
+    return err;
+}
+
+/* Loads a slot, and makes it both the oven profile and the one loaded at boot */
+esp_err_t library_select(int slot) {
+    esp_err_t err;
+
+    if (slot < 0 || slot >= LIBRARY_SLOTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    library_get_index(&index_scratch);
+    if (!index_scratch.slots[slot].used) {
+        xSemaphoreGive(write_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    err = library_read_slot(slot);
+    if (err == ESP_OK && index_scratch.active != slot) {
+        index_scratch.active = slot;
+        err = library_write_index(&index_scratch);
+    }
+    if (err == ESP_OK) {
+        library_set_cache(&index_scratch, &profile_scratch);
+        set_profile(&profile_scratch);
+        ESP_LOGI(tag, "Slot %i selected, %.*s", slot, LIBRARY_NAME_MAX, index_scratch.slots[slot].name);
+    } else {
+        ESP_LOGE(tag, "Cannot select slot %i: %s", slot, esp_err_to_name(err));
+    }
+    xSemaphoreGive(write_lock);
+    return err;
+}
+
+/* The oven keeps its profile when the active slot is deleted */
+esp_err_t library_delete(int slot) {
+    char key[LIBRARY_KEY_MAX];
+    esp_err_t err;
+
+    if (slot < 0 || slot >= LIBRARY_SLOTS) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(write_lock, portMAX_DELAY);
+    library_get_index(&index_scratch);
+    if (!index_scratch.slots[slot].used) {
+        xSemaphoreGive(write_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    memset(&index_scratch.slots[slot], 0, sizeof index_scratch.slots[slot]);
+    if (index_scratch.active == slot) {
+        index_scratch.active = LIBRARY_NONE;
+    }
+
+    /* The index first: a slot it does not list is never read */
+    library_key(slot, key);
+    err = library_write_index(&index_scratch);
+    if (err == ESP_OK) {
+        err = persist_erase(LIBRARY_NAMESPACE, key, library_persisted, NULL);
+    }
+    if (err == ESP_OK) {
+        library_set_cache(&index_scratch, NULL);
+    }
+    xSemaphoreGive(write_lock);
+    return err;
+}
+
+/*
+ * Fixed five step blob of the first firmware: {uint16 duration, uint16
+ * temperature} per step, unused steps left at zero, the Kconfig cool-down.
+ */
+static esp_err_t library_decode_legacy(const uint8_t *buf, size_t len, reflow_profile_t *profile) {
+    if (len != LEGACY_STEPS * sizeof(reflow_step_t)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    *profile = (reflow_profile_t){ .steps = LEGACY_STEPS };
+    memcpy(profile->data, buf, len);
+    while (profile->steps > 0 && profile->data[profile->steps - 1].duration == 0 &&
+           profile->data[profile->steps - 1].temperature == 0) {
+        profile->steps--;
+    }
+    for (int step = 0; step < profile->steps; step++) {
+        if (profile->data[step].temperature > PROFILE_TEMPERATURE_MAX) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    return profile->steps > 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+/* Imports the profile of older firmware into the first slot */
+static void library_migrate(void) {
+    size_t len = sizeof image;
+    esp_err_t err;
+
+    if (persist_read(LEGACY_NAMESPACE, LEGACY_PROFILE_KEY, image, &len) != ESP_OK) {
+        return;
+    }
+    /* A two step image is as long as a blob, its header and CRC tell it apart */
+    err = profile_decode(image, len, &profile_scratch);
+    if (err != ESP_OK && len == LEGACY_STEPS * sizeof(reflow_step_t)) {
+        err = library_decode_legacy(image, len, &profile_scratch);
+    }
+    if (err == ESP_OK) {
+        err = library_write(0, "Default", strlen("Default"), &profile_scratch, true);
+        if (err != ESP_OK) {
+            /* Kept for the next boot to try again */
+            return;
+        }
+        ESP_LOGI(tag, "Stored profile of %u steps moved to slot 1", profile_scratch.steps);
+    } else {
+        ESP_LOGW(tag, "Stored profile rejected (%s)", esp_err_to_name(err));
+    }
+    /* Requests are written in order, the slot first */
+    persist_erase(LEGACY_NAMESPACE, LEGACY_PROFILE_KEY, NULL, NULL);
+}
+
+/* The caches from the stored, or pending, index and active slot; under write_lock */
+static esp_err_t library_load(void) {
+    library_index_t index = {
+        .version = LIBRARY_VERSION,
+        .active = LIBRARY_NONE,
+    };
+    size_t len = sizeof index_scratch;
+    esp_err_t err;
+
+    err = persist_read(LIBRARY_NAMESPACE, LIBRARY_INDEX_KEY, &index_scratch, &len);
+    if (err == ESP_OK && (len != sizeof index_scratch || index_scratch.version != LIBRARY_VERSION)) {
+        err = ESP_ERR_INVALID_STATE;
+    }
+    if (err != ESP_OK) {
+        if (err != ESP_ERR_NVS_NOT_FOUND) {
+            ESP_LOGW(tag, "Index rejected (%s), the library is empty", esp_err_to_name(err));
+        }
+        library_set_cache(&index, NULL);
+        return err;
+    }
+
+    if (index_scratch.active != LIBRARY_NONE) {
+        err = index_scratch.active < LIBRARY_SLOTS ? library_read_slot(index_scratch.active)
+                                                   : ESP_ERR_INVALID_STATE;
+        if (err != ESP_OK) {
+            ESP_LOGW(tag, "Active slot rejected (%s)", esp_err_to_name(err));
+            index_scratch.active = LIBRARY_NONE;
+        }
+    }
+    library_set_cache(&index_scratch, index_scratch.active != LIBRARY_NONE ? &profile_scratch : NULL);
+    return ESP_OK;
+}
+
+void library_init(void) {
+    write_lock = xSemaphoreCreateMutex();
+    if (library_load() == ESP_ERR_NVS_NOT_FOUND) {
+        library_migrate();
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef H_LIBRARY_
+#define H_LIBRARY_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "controller.h"
+
+#define LIBRARY_VERSION 1
+#define LIBRARY_SLOTS 16
+#define LIBRARY_NAME_MAX 16 // bytes, NUL padded, not terminated when full
+#define LIBRARY_NONE 0xff   // no active slot
+
+/*
+ * Index of the stored profiles, as read over BLE (packed, little-endian).
+ * Each slot holds a profile image (profile.h) in its own NVS key.
+ */
+typedef struct __attribute__((packed)) library_entry_t {
+    uint8_t used;
+    uint8_t reserved;
+    uint16_t steps;
+    uint32_t crc;                 // of the profile, as in its image header
+    char name[LIBRARY_NAME_MAX];
+} library_entry_t;
+
+typedef struct __attribute__((packed)) library_index_t {
+    uint8_t version;              // LIBRARY_VERSION
+    uint8_t active;               // slot loaded at boot, LIBRARY_NONE when empty
+    uint16_t reserved;
+    library_entry_t slots[LIBRARY_SLOTS];
+} library_index_t;
+
+/* Writes to the library characteristic: uint8 op, uint8 slot, then the op value */
+typedef enum {
+    LIBRARY_OP_SELECT = 0x01, // load the slot into the oven, and at boot
+    LIBRARY_OP_DELETE = 0x02,
+    LIBRARY_OP_STORE = 0x03,  // the oven profile into the slot, name of 1 to LIBRARY_NAME_MAX bytes
+} library_op_t;
+
+void library_init(void);
+
+void library_get_index(library_index_t *index);
+int library_get_active(void);
+int library_next(int slot);
+esp_err_t library_load_active(reflow_profile_t *profile);
+
+esp_err_t library_store(int slot, const char *name, size_t name_len, const reflow_profile_t *profile);
+esp_err_t library_store_active(const reflow_profile_t *profile);
+esp_err_t library_select(int slot);
+esp_err_t library_delete(int slot);
+
+#endif
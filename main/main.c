@@ -18,7 +18,10 @@
  */
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
+#include <inttypes.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOSConfig.h"
 #include "driver/spi_master.h"
 /* BLE */
@@ -29,17 +32,98 @@
 #include "host/util/util.h"
 #include "console/console.h"
 #include "services/gap/ble_svc_gap.h"
+#include "host/ble_store.h"
 #include "bler946.h"
 #include "ui.h"
 #include "segments.h"
 #include "controller.h"
 #include "max31855.h"
+#include "telemetry.h"
+#include "notify.h"
+#include "command.h"
+#include "ota.h"
+#include "library.h"
+#include "persist.h"
+#include "presets.h"
+#include "serial.h"
 
 static const char *tag = "NimBLE_BLE_Reflow946";
 
-static bool notify_state;
+#define BLER_MAX_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
 
-static uint16_t conn_handle;
+/*
+ * Connection table, written by the host task and read by the controller
+ * task to fan notifications out. A slot is free while its handle is
+ * BLE_HS_CONN_HANDLE_NONE; the slot index is also the telemetry stream.
+ */
+typedef struct bler_conn_t {
+    atomic_uint handle;
+    atomic_bool temperature_notify;
+    atomic_bool telemetry_notify;
+    /* Bytes exchanged since the last link tick, counted from any task */
+    atomic_uint tx_bytes;
+    atomic_uint rx_bytes;
+    /* Host task only */
+    int64_t connect_time;
+    bool first_notify_pending;
+    bool bulk;
+    int quiet_ticks;
+    bler_link_stats_t stats;
+    bool command_indicate;
+    uint8_t command_result[1 + COMMAND_BATCH_MAX];
+    uint16_t command_result_len; // 0 when no result is pending
+} bler_conn_t;
+
+static bler_conn_t bler_conns[BLER_MAX_CONNECTIONS];
+
+/*
+ * Advertise fast for a while after boot or a disconnect so that clients
+ * come back quickly, then back off to save power. Units of 0.625 ms.
+ */
+#define BLER_ADV_FAST_ITVL_MIN 48   // 30 ms
+#define BLER_ADV_FAST_ITVL_MAX 96   // 60 ms
+#define BLER_ADV_SLOW_ITVL_MIN 1600 // 1 s
+#define BLER_ADV_SLOW_ITVL_MAX 2048 // 1.28 s
+
+static bool bler_adv_fast;
+static struct ble_npl_callout bler_adv_fast_timer;
+
+/* Time from connection to the first notification delivered to the peer */
+static atomic_uint ato_ttfn_last_ms;
+static atomic_uint ato_ttfn_max_ms;
+static atomic_uint ato_ttfn_count;
+
+/*
+ * Link parameters: a connection starts on the low duty set and moves to
+ * the short interval set while its throughput shows a bulk transfer
+ * (profile upload, log download, telemetry burst), and back once it has
+ * been quiet for a few seconds. Units of 1.25 ms and 10 ms.
+ */
+#define BLER_PREFERRED_MTU 247
+#define BLER_DATA_LEN_OCTETS 251
+#define BLER_DATA_LEN_TIME 2120 // us, 251 octets at 1M PHY
+
+#define BLER_LINK_TICK_MS 1000
+#define BLER_BULK_ENTER_RATE 1000 // B/s
+#define BLER_BULK_EXIT_TICKS 3
+
+static const struct ble_gap_upd_params bler_idle_params = {
+    .itvl_min = 40,  // 50 ms
+    .itvl_max = 80,  // 100 ms
+    .latency = 4,
+    .supervision_timeout = 400, // 4 s
+};
+
+static const struct ble_gap_upd_params bler_bulk_params = {
+    .itvl_min = 6,   // 7.5 ms
+    .itvl_max = 12,  // 15 ms
+    .latency = 0,
+    .supervision_timeout = 400,
+};
+
+static struct ble_npl_callout bler_link_timer;
+
+void ble_store_config_init(void);
 
 static const char *device_name = "reflow946_1.0";
 
@@ -47,6 +131,15 @@ static int bler_gap_event(struct ble_gap_event *event, void *arg);
 
 static uint8_t bler_addr_type;
 
+int bler_conn_slot(uint16_t conn_handle) {
+    for (int slot = 0; slot < BLER_MAX_CONNECTIONS; slot++) {
+        if (atomic_load(&bler_conns[slot].handle) == conn_handle) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
 /**
  * Utility function to log an array of bytes.
  */
@@ -71,22 +164,44 @@ print_addr(const void *addr)
 
 
 /*
- * Enables advertising with parameters:
- *     o General discoverable mode
- *     o Undirected connectable mode
+ * The live oven state is broadcast in the manufacturer specific data, so
+ * any number of passive scanners can monitor the oven without taking a
+ * connection slot.
  */
-static void
-bler_advertise(void)
+#define BLER_ADV_COMPANY_ID 0xFFFF // reserved for testing and internal use
+#define BLER_ADV_VERSION 2 // 2: 16-bit step
+
+typedef struct __attribute__((packed)) bler_adv_state_t {
+    uint16_t company_id;
+    uint8_t version;
+    int16_t temperature;  // 0.1 °C
+    int16_t target;       // 0.1 °C
+    uint8_t phase;        // reflow_phase_t
+    int16_t step;         // -1 when idle
+    uint8_t faults;       // TELEMETRY_FAULT_*
+} bler_adv_state_t;
+
+static struct ble_npl_callout bler_adv_refresh_timer;
+
+static int
+bler_set_adv_fields(void)
 {
-    struct ble_gap_adv_params adv_params;
     struct ble_hs_adv_fields fields;
-    int rc;
+    bler_adv_state_t state = {
+        .company_id = BLER_ADV_COMPANY_ID,
+        .version = BLER_ADV_VERSION,
+        .temperature = get_temperature() * 10,
+        .target = atomic_load(&ato_target) * 10,
+        .phase = reflow_get_phase(),
+        .step = reflow_get_step(),
+        .faults = get_faults(),
+    };
 
     /*
      *  Set the advertisement data included in our advertisements:
      *     o Flags (indicates advertisement type and other general info)
      *     o Advertising tx power
-     *     o Device name
+     *     o Oven state
      */
     memset(&fields, 0, sizeof(fields));
 
@@ -106,19 +221,75 @@ bler_advertise(void)
     fields.tx_pwr_lvl_is_present = 1;
     fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
 
+    fields.mfg_data = (uint8_t *)&state;
+    fields.mfg_data_len = sizeof(state);
+
+    return ble_gap_adv_set_fields(&fields);
+}
+
+/* Runs in the host task, the advertising data can change while advertising */
+static void
+bler_adv_refresh(struct ble_npl_event *ev)
+{
+    int rc;
+
+    rc = bler_set_adv_fields();
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "error refreshing advertisement data; rc=%d\n", rc);
+    }
+    ble_npl_callout_reset(&bler_adv_refresh_timer,
+                          ble_npl_time_ms_to_ticks32(CONFIG_BLE_ADV_REFRESH_MS));
+}
+
+/*
+ * Enables advertising with parameters:
+ *     o General discoverable mode
+ *     o Undirected connectable mode while a connection slot is free,
+ *       non-connectable otherwise so the state keeps being broadcast
+ */
+static void
+bler_advertise(void)
+{
+    struct ble_gap_adv_params adv_params;
+    struct ble_hs_adv_fields fields;
+    int rc;
+
+    rc = bler_set_adv_fields();
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "error setting advertisement data; rc=%d\n", rc);
+        return;
+    }
+
+    /* The device name goes in the scan response to leave room for the state */
+    memset(&fields, 0, sizeof(fields));
     fields.name = (uint8_t *)device_name;
     fields.name_len = strlen(device_name);
     fields.name_is_complete = 1;
 
-    rc = ble_gap_adv_set_fields(&fields);
+    rc = ble_gap_adv_rsp_set_fields(&fields);
     if (rc != 0) {
-        MODLOG_DFLT(ERROR, "error setting advertisement data; rc=%d\n", rc);
+        MODLOG_DFLT(ERROR, "error setting scan response data; rc=%d\n", rc);
         return;
     }
 
+    if (ble_gap_adv_active()) {
+        ble_gap_adv_stop();
+    }
+
     /* Begin advertising */
     memset(&adv_params, 0, sizeof(adv_params));
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+    if (bler_adv_fast) {
+        adv_params.itvl_min = BLER_ADV_FAST_ITVL_MIN;
+        adv_params.itvl_max = BLER_ADV_FAST_ITVL_MAX;
+    } else {
+        adv_params.itvl_min = BLER_ADV_SLOW_ITVL_MIN;
+        adv_params.itvl_max = BLER_ADV_SLOW_ITVL_MAX;
+    }
+    if (bler_conn_slot(BLE_HS_CONN_HANDLE_NONE) >= 0) {
+        adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+    } else {
+        adv_params.conn_mode = BLE_GAP_CONN_MODE_NON;
+    }
     adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
     rc = ble_gap_adv_start(bler_addr_type, NULL, BLE_HS_FOREVER,
                            &adv_params, bler_gap_event, NULL);
@@ -128,26 +299,192 @@ bler_advertise(void)
     }
 }
 
-void bler_tx_temperature(float celcius) {
-    static int16_t temperature;
+/* Restarts advertising at the fast interval for CONFIG_BLE_ADV_FAST_WINDOW_S */
+static void
+bler_advertise_fast(void)
+{
+    bler_adv_fast = true;
+    bler_advertise();
+    ble_npl_callout_reset(&bler_adv_fast_timer,
+                          ble_npl_time_ms_to_ticks32(CONFIG_BLE_ADV_FAST_WINDOW_S * 1000));
+}
+
+static void
+bler_adv_fast_expired(struct ble_npl_event *ev)
+{
+    bler_adv_fast = false;
+    if (ble_gap_adv_active()) {
+        bler_advertise();
+    }
+}
+
+void bler_get_reconnect_stats(bler_reconnect_stats_t *stats) {
+    stats->last_ms = atomic_load(&ato_ttfn_last_ms);
+    stats->max_ms = atomic_load(&ato_ttfn_max_ms);
+    stats->count = atomic_load(&ato_ttfn_count);
+}
+
+/* Bonded peers get their link encrypted right away, which restores their subscriptions */
+static bool
+bler_is_bonded(const struct ble_gap_conn_desc *desc)
+{
+    struct ble_store_key_sec key;
+    struct ble_store_value_sec value;
+
+    memset(&key, 0, sizeof(key));
+    key.peer_addr = desc->peer_id_addr;
+    return ble_store_read_peer_sec(&key, &value) == 0;
+}
+
+void bler_count_traffic(uint16_t conn_handle, uint32_t tx, uint32_t rx) {
+    int slot = bler_conn_slot(conn_handle);
+    if (slot >= 0) {
+        atomic_fetch_add(&bler_conns[slot].tx_bytes, tx);
+        atomic_fetch_add(&bler_conns[slot].rx_bytes, rx);
+    }
+}
+
+int bler_get_link_stats(uint16_t conn_handle, bler_link_stats_t *stats) {
+    int slot = bler_conn_slot(conn_handle);
+    if (slot < 0) {
+        return -1;
+    }
+    /* Written by the host task, which also serves the reads */
+    *stats = bler_conns[slot].stats;
+    stats->mtu = ble_att_mtu(conn_handle);
+    return 0;
+}
+
+static void
+bler_link_params(uint16_t conn_handle, bool bulk)
+{
     int rc;
-    struct os_mbuf *om;
 
-    if (!notify_state) {
+    rc = ble_gap_update_params(conn_handle, bulk ? &bler_bulk_params : &bler_idle_params);
+    if (rc != 0) {
+        MODLOG_DFLT(ERROR, "error updating connection parameters; rc=%d\n", rc);
+    }
+}
+
+/* Measures the throughput of every connection and picks its parameter set */
+static void
+bler_link_tick(struct ble_npl_event *ev)
+{
+    for (int slot = 0; slot < BLER_MAX_CONNECTIONS; slot++) {
+        bler_conn_t *conn = &bler_conns[slot];
+        uint16_t conn_handle = atomic_load(&conn->handle);
+        if (conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            continue;
+        }
+
+        uint32_t tx_rate = atomic_exchange(&conn->tx_bytes, 0) * 1000 / BLER_LINK_TICK_MS;
+        uint32_t rx_rate = atomic_exchange(&conn->rx_bytes, 0) * 1000 / BLER_LINK_TICK_MS;
+        conn->stats.tx_rate = tx_rate;
+        conn->stats.rx_rate = rx_rate;
+        if (tx_rate > conn->stats.tx_peak) {
+            conn->stats.tx_peak = tx_rate;
+        }
+        if (rx_rate > conn->stats.rx_peak) {
+            conn->stats.rx_peak = rx_rate;
+        }
+
+        if (tx_rate + rx_rate >= BLER_BULK_ENTER_RATE) {
+            conn->quiet_ticks = 0;
+            if (!conn->bulk) {
+                conn->bulk = true;
+                bler_link_params(conn_handle, true);
+            }
+        } else if (conn->bulk && ++conn->quiet_ticks >= BLER_BULK_EXIT_TICKS) {
+            conn->bulk = false;
+            bler_link_params(conn_handle, false);
+        }
+    }
+    ble_npl_callout_reset(&bler_link_timer, ble_npl_time_ms_to_ticks32(BLER_LINK_TICK_MS));
+}
+
+/*
+ * Notifications are handed to the notify queue: the controller task never
+ * waits on the link, a full queue only costs the sample.
+ */
+void bler_tx_temperature(float celcius) {
+    int16_t temperature = celcius*10;
+
+    for (int slot = 0; slot < BLER_MAX_CONNECTIONS; slot++) {
+        if (atomic_load(&bler_conns[slot].temperature_notify)) {
+            notify_post(atomic_load(&bler_conns[slot].handle), rs_temperature_handle,
+                        &temperature, sizeof(temperature));
+        }
+    }
+}
+
+/* Largest telemetry notification for a slot, 0 when it is not subscribed */
+uint16_t bler_tx_telemetry_max_len(int slot) {
+    if (!atomic_load(&bler_conns[slot].telemetry_notify)) {
+        return 0;
+    }
+    return ble_att_mtu(atomic_load(&bler_conns[slot].handle)) - 3;
+}
+
+void bler_tx_telemetry(int slot, const void *data, uint16_t len) {
+    if (atomic_load(&bler_conns[slot].telemetry_notify)) {
+        notify_post(atomic_load(&bler_conns[slot].handle), rs_telemetry_handle, data, len);
+    }
+}
+
+/*
+ * Command results are indicated from a callout rather than from the write
+ * callback, so that the write response goes out first.
+ */
+static struct ble_npl_callout bler_command_timer;
+
+void bler_tx_command_result(uint16_t conn_handle, const void *data, uint16_t len) {
+    int slot = bler_conn_slot(conn_handle);
+
+    if (slot < 0 || !bler_conns[slot].command_indicate || len > sizeof bler_conns[slot].command_result) {
         return;
     }
+    memcpy(bler_conns[slot].command_result, data, len);
+    bler_conns[slot].command_result_len = len;
+    ble_npl_callout_reset(&bler_command_timer, 0);
+}
+
+/* Called from the host and OTA tasks, outside of the notification queue */
+void bler_tx_ota(uint16_t conn_handle, const void *data, uint16_t len) {
+    struct os_mbuf *om;
 
-    temperature = celcius*10;
+    if (conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+        return;
+    }
+    om = ble_hs_mbuf_from_flat(data, len);
+    if (om != NULL && ble_gattc_notify_custom(conn_handle, ota_control_handle, om) == 0) {
+        bler_count_traffic(conn_handle, len, 0);
+    }
+}
 
-    om = ble_hs_mbuf_from_flat(&temperature, sizeof(temperature));
-    rc = ble_gattc_notify_custom(conn_handle, rs_temperature_handle, om);
+static void
+bler_command_indicate(struct ble_npl_event *ev)
+{
+    for (int slot = 0; slot < BLER_MAX_CONNECTIONS; slot++) {
+        bler_conn_t *conn = &bler_conns[slot];
+        uint16_t conn_handle = atomic_load(&conn->handle);
 
-    assert(rc == 0);
+        if (conn->command_result_len == 0 || conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+            continue;
+        }
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(conn->command_result, conn->command_result_len);
+        conn->command_result_len = 0;
+        if (om != NULL) {
+            ble_gattc_indicate_custom(conn_handle, rs_command_handle, om);
+        }
+    }
 }
 
 static int
 bler_gap_event(struct ble_gap_event *event, void *arg)
 {
+    struct ble_gap_conn_desc desc;
+    int slot;
+
     switch (event->type) {
     case BLE_GAP_EVENT_CONNECT:
         /* A new connection was established or a connection attempt failed */
@@ -155,18 +492,58 @@ bler_gap_event(struct ble_gap_event *event, void *arg)
                     event->connect.status == 0 ? "established" : "failed",
                     event->connect.status);
 
-        if (event->connect.status != 0) {
-            /* Connection failed; resume advertising */
-            bler_advertise();
+        if (event->connect.status == 0) {
+            slot = bler_conn_slot(BLE_HS_CONN_HANDLE_NONE);
+            if (slot < 0) {
+                /* Only if the host and the table disagree on the maximum */
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                break;
+            }
+            telemetry_reset(slot);
+            bler_conns[slot].connect_time = esp_timer_get_time();
+            bler_conns[slot].first_notify_pending = true;
+            bler_conns[slot].bulk = false;
+            bler_conns[slot].quiet_ticks = 0;
+            bler_conns[slot].command_indicate = false;
+            bler_conns[slot].command_result_len = 0;
+            memset(&bler_conns[slot].stats, 0, sizeof(bler_conns[slot].stats));
+            atomic_store(&bler_conns[slot].tx_bytes, 0);
+            atomic_store(&bler_conns[slot].rx_bytes, 0);
+            atomic_store(&bler_conns[slot].handle, event->connect.conn_handle);
+
+            bool bonded = false;
+            if (ble_gap_conn_find(event->connect.conn_handle, &desc) == 0) {
+                bler_conns[slot].stats.conn_itvl = desc.conn_itvl;
+                bler_conns[slot].stats.conn_latency = desc.conn_latency;
+                bler_conns[slot].stats.supervision_timeout = desc.supervision_timeout;
+                bonded = bler_is_bonded(&desc);
+            }
+
+            /* Ask for the largest MTU and PDUs, then settle on the idle set */
+            ble_gattc_exchange_mtu(event->connect.conn_handle, NULL, NULL);
+            ble_gap_set_data_len(event->connect.conn_handle,
+                                 BLER_DATA_LEN_OCTETS, BLER_DATA_LEN_TIME);
+            bler_link_params(event->connect.conn_handle, false);
+
+            if (bonded) {
+                ble_gap_security_initiate(event->connect.conn_handle);
+            }
         }
-        conn_handle = event->connect.conn_handle;
+        bler_advertise();
         break;
 
     case BLE_GAP_EVENT_DISCONNECT:
         MODLOG_DFLT(INFO, "disconnect; reason=%d\n", event->disconnect.reason);
+        slot = bler_conn_slot(event->disconnect.conn.conn_handle);
+        if (slot >= 0) {
+            atomic_store(&bler_conns[slot].temperature_notify, false);
+            atomic_store(&bler_conns[slot].telemetry_notify, false);
+            atomic_store(&bler_conns[slot].handle, BLE_HS_CONN_HANDLE_NONE);
+        }
+        ota_disconnected(event->disconnect.conn.conn_handle);
 
         /* Connection terminated; resume advertising */
-        bler_advertise();
+        bler_advertise_fast();
         break;
 
     case BLE_GAP_EVENT_ADV_COMPLETE:
@@ -175,15 +552,71 @@ bler_gap_event(struct ble_gap_event *event, void *arg)
         break;
 
     case BLE_GAP_EVENT_SUBSCRIBE:
-        MODLOG_DFLT(INFO, "subscribe event; cur_notify=%d\n value handle; "
-                    "val_handle=%d\n",
-                    event->subscribe.cur_notify, rs_temperature_handle);
+        MODLOG_DFLT(INFO, "subscribe event; conn_handle=%d attr_handle=%d "
+                    "cur_notify=%d\n",
+                    event->subscribe.conn_handle,
+                    event->subscribe.attr_handle,
+                    event->subscribe.cur_notify);
+        slot = bler_conn_slot(event->subscribe.conn_handle);
+        if (slot < 0) {
+            break;
+        }
         if (event->subscribe.attr_handle == rs_temperature_handle) {
-            notify_state = event->subscribe.cur_notify;
-        } else if (event->subscribe.attr_handle != rs_temperature_handle) {
-            notify_state = event->subscribe.cur_notify;
+            atomic_store(&bler_conns[slot].temperature_notify, event->subscribe.cur_notify);
+        } else if (event->subscribe.attr_handle == rs_telemetry_handle) {
+            atomic_store(&bler_conns[slot].telemetry_notify, event->subscribe.cur_notify);
+        } else if (event->subscribe.attr_handle == rs_command_handle) {
+            bler_conns[slot].command_indicate = event->subscribe.cur_indicate;
+        }
+        break;
+
+    case BLE_GAP_EVENT_NOTIFY_TX:
+        if (event->notify_tx.status != 0 && event->notify_tx.status != BLE_HS_EDONE) {
+            break;
+        }
+        slot = bler_conn_slot(event->notify_tx.conn_handle);
+        if (slot >= 0 && bler_conns[slot].first_notify_pending) {
+            uint32_t elapsed_ms = (esp_timer_get_time() - bler_conns[slot].connect_time) / 1000;
+            bool bonded = ble_gap_conn_find(event->notify_tx.conn_handle, &desc) == 0 &&
+                          desc.sec_state.bonded;
+            bler_conns[slot].first_notify_pending = false;
+            atomic_store(&ato_ttfn_last_ms, elapsed_ms);
+            if (elapsed_ms > atomic_load(&ato_ttfn_max_ms)) {
+                atomic_store(&ato_ttfn_max_ms, elapsed_ms);
+            }
+            atomic_fetch_add(&ato_ttfn_count, 1);
+            ESP_LOGI(tag, "First notification %" PRIu32 " ms after connection (%s)",
+                     elapsed_ms, bonded ? "bonded" : "not bonded");
+        }
+        break;
+
+    case BLE_GAP_EVENT_ENC_CHANGE:
+        MODLOG_DFLT(INFO, "encryption change; conn_handle=%d status=%d\n",
+                    event->enc_change.conn_handle,
+                    event->enc_change.status);
+        break;
+
+    case BLE_GAP_EVENT_REPEAT_PAIRING:
+        /* The peer lost its keys: forget ours and let it pair again */
+        if (ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc) == 0) {
+            ble_store_util_delete_peer(&desc.peer_id_addr);
+        }
+        return BLE_GAP_REPEAT_PAIRING_RETRY;
+
+    case BLE_GAP_EVENT_CONN_UPDATE:
+        if (ble_gap_conn_find(event->conn_update.conn_handle, &desc) == 0) {
+            MODLOG_DFLT(INFO, "connection updated; conn_handle=%d itvl=%d "
+                        "latency=%d timeout=%d\n",
+                        desc.conn_handle, desc.conn_itvl,
+                        desc.conn_latency, desc.supervision_timeout);
+            slot = bler_conn_slot(desc.conn_handle);
+            if (slot >= 0) {
+                bler_conns[slot].stats.conn_itvl = desc.conn_itvl;
+                bler_conns[slot].stats.conn_latency = desc.conn_latency;
+                bler_conns[slot].stats.supervision_timeout = desc.supervision_timeout;
+                bler_conns[slot].stats.bulk = bler_conns[slot].bulk;
+            }
         }
-        ESP_LOGI("BLE_GAP_SUBSCRIBE_EVENT", "conn_handle from subscribe=%d", conn_handle);
         break;
 
     case BLE_GAP_EVENT_MTU:
@@ -212,8 +645,14 @@ bler_on_sync(void)
     print_addr(addr_val);
     MODLOG_DFLT(INFO, "\n");
 
+    gatt_svr_check_db_hash();
+    ota_confirm_image();
+
     /* Begin advertising */
-    bler_advertise();
+    bler_advertise_fast();
+    ble_npl_callout_reset(&bler_adv_refresh_timer,
+                          ble_npl_time_ms_to_ticks32(CONFIG_BLE_ADV_REFRESH_MS));
+    ble_npl_callout_reset(&bler_link_timer, ble_npl_time_ms_to_ticks32(BLER_LINK_TICK_MS));
 }
 
 static void
@@ -243,37 +682,66 @@ void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
-    reflow_profile_t reflow_profile;
+    persist_init();
+    library_init();
+    static reflow_profile_t reflow_profile;
     ret = load_profile(&reflow_profile);
-    if (ret == ESP_ERR_NVS_NOT_FOUND) {
-        reflow_profile = (reflow_profile_t){
-            .data = {
-                {.duration = 90, .temperature = 170},
-                {.duration = 90, .temperature = 217},
-                {.duration = 50, .temperature = 240},
-                {.duration = 20, .temperature = 245},
-                { 0 }
-            }
-        };
-    } else {
-        ESP_ERROR_CHECK(ret);
+    if (ret != ESP_OK) {
+        preset_get_profile(PRESET_DEFAULT, &reflow_profile);
     }
     set_profile(&reflow_profile);
 
+    for (int slot = 0; slot < BLER_MAX_CONNECTIONS; slot++) {
+        atomic_init(&bler_conns[slot].handle, BLE_HS_CONN_HANDLE_NONE);
+        atomic_init(&bler_conns[slot].temperature_notify, false);
+        atomic_init(&bler_conns[slot].telemetry_notify, false);
+        atomic_init(&bler_conns[slot].tx_bytes, 0);
+        atomic_init(&bler_conns[slot].rx_bytes, 0);
+    }
+    atomic_init(&ato_ttfn_last_ms, 0);
+    atomic_init(&ato_ttfn_max_ms, 0);
+    atomic_init(&ato_ttfn_count, 0);
+
+    notify_init();
+    ota_init();
     nimble_port_init();
+    ble_npl_callout_init(&bler_adv_refresh_timer, nimble_port_get_dflt_eventq(),
+                         bler_adv_refresh, NULL);
+    ble_npl_callout_init(&bler_adv_fast_timer, nimble_port_get_dflt_eventq(),
+                         bler_adv_fast_expired, NULL);
+    ble_npl_callout_init(&bler_link_timer, nimble_port_get_dflt_eventq(),
+                         bler_link_tick, NULL);
+    ble_npl_callout_init(&bler_command_timer, nimble_port_get_dflt_eventq(),
+                         bler_command_indicate, NULL);
     /* Initialize the NimBLE host configuration */
     ble_hs_cfg.sync_cb = bler_on_sync;
     ble_hs_cfg.reset_cb = bler_on_reset;
+    ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+
+    /* Just Works bonding, keys are kept in NVS across reboots */
+    ble_hs_cfg.sm_io_cap = BLE_SM_IO_CAP_NO_IO;
+    ble_hs_cfg.sm_bonding = 1;
+    ble_hs_cfg.sm_sc = 1;
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
 
     rc = gatt_svr_init();
     assert(rc == 0);
 
+    rc = ble_att_set_preferred_mtu(BLER_PREFERRED_MTU);
+    assert(rc == 0);
+
+    ble_store_config_init();
+
     /* Set the default device name */
     rc = ble_svc_gap_device_name_set(device_name);
     assert(rc == 0);
 
     /* Start the task */
     nimble_port_freertos_init(bler_host_task);
+    notify_start();
+    persist_start();
+    ota_start();
 
     segments_init();
     ui_init();
@@ -283,4 +751,7 @@ void app_main(void)
 
     controller_init();
     controller_start(&spi);
+
+    serial_init();
+    serial_start();
 }
@@ -4,6 +4,12 @@
 #include <stdint.h>
 #include "driver/spi_master.h"
 
+/*
+ * Worst-case conversion time. Pulling CS low aborts the conversion in
+ * progress, so the chip must not be read more often than this.
+ */
+#define MAX31855_CONVERSION_MS 100
+
 typedef union {
     struct  {
         uint32_t oc : 1;
@@ -0,0 +1,146 @@
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "bler946.h"
+#include "notify.h"
+
+static const char *tag = "Notify";
+
+#define NOTIFY_RETRY_MS 10 // back-off while the host is out of buffers
+
+/*
+ * Notifications are posted by the controller task and sent by a dedicated
+ * task, so a slow link or an exhausted mbuf pool never blocks the control
+ * loop. The queue is a single producer, single consumer ring: posting never
+ * waits and a full queue drops the new entry. When the sender lags, only
+ * the newest entry of each connection and attribute is sent.
+ *
+ * An entry without a connection only flags a characteristic as updated:
+ * the host then reads it back and notifies or indicates every subscriber.
+ */
+typedef struct notify_entry_t {
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+    uint16_t len;
+    uint8_t data[NOTIFY_DATA_MAX];
+} notify_entry_t;
+
+static notify_entry_t queue[NOTIFY_QUEUE_LEN];
+static atomic_uint ato_head; // written by the producer only
+static atomic_uint ato_tail; // written by the sender only
+
+static atomic_uint ato_sent;
+static atomic_uint ato_dropped;
+static atomic_uint ato_coalesced;
+static atomic_uint ato_failed;
+
+static TaskHandle_t notify_handle;
+
+bool notify_post_updated(uint16_t attr_handle) {
+    return notify_post(BLE_HS_CONN_HANDLE_NONE, attr_handle, NULL, 0);
+}
+
+bool notify_post(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t len) {
+    unsigned int head = atomic_load_explicit(&ato_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ato_tail, memory_order_acquire);
+
+    if (head - tail >= NOTIFY_QUEUE_LEN || len > NOTIFY_DATA_MAX) {
+        atomic_fetch_add(&ato_dropped, 1);
+        return false;
+    }
+
+    notify_entry_t *entry = &queue[head % NOTIFY_QUEUE_LEN];
+    entry->conn_handle = conn_handle;
+    entry->attr_handle = attr_handle;
+    entry->len = len;
+    if (len) {
+        memcpy(entry->data, data, len);
+    }
+    atomic_store_explicit(&ato_head, head + 1, memory_order_release);
+
+    if (notify_handle != NULL) {
+        xTaskNotifyGive(notify_handle);
+    }
+    return true;
+}
+
+static bool superseded(unsigned int index, unsigned int head) {
+    const notify_entry_t *entry = &queue[index % NOTIFY_QUEUE_LEN];
+    for (unsigned int next = index + 1; next != head; next++) {
+        const notify_entry_t *newer = &queue[next % NOTIFY_QUEUE_LEN];
+        if (newer->conn_handle == entry->conn_handle && newer->attr_handle == entry->attr_handle) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void notify_task(void *param) {
+    unsigned int last_dropped = 0;
+
+    for ( ;; ) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        unsigned int tail = atomic_load_explicit(&ato_tail, memory_order_relaxed);
+        for ( ;; ) {
+            unsigned int head = atomic_load_explicit(&ato_head, memory_order_acquire);
+            if (tail == head) {
+                break;
+            }
+
+            const notify_entry_t *entry = &queue[tail % NOTIFY_QUEUE_LEN];
+            if (superseded(tail, head)) {
+                atomic_fetch_add(&ato_coalesced, 1);
+            } else if (entry->conn_handle == BLE_HS_CONN_HANDLE_NONE) {
+                ble_gatts_chr_updated(entry->attr_handle);
+                atomic_fetch_add(&ato_sent, 1);
+            } else {
+                struct os_mbuf *om = ble_hs_mbuf_from_flat(entry->data, entry->len);
+                if (om == NULL) {
+                    /* Out of buffers: keep the entry and let the link drain */
+                    vTaskDelay(pdMS_TO_TICKS(NOTIFY_RETRY_MS));
+                    continue;
+                }
+                /* The mbuf is consumed on failure as well */
+                if (ble_gattc_notify_custom(entry->conn_handle, entry->attr_handle, om) == 0) {
+                    atomic_fetch_add(&ato_sent, 1);
+                    bler_count_traffic(entry->conn_handle, entry->len, 0);
+                } else {
+                    atomic_fetch_add(&ato_failed, 1);
+                }
+            }
+            tail++;
+            atomic_store_explicit(&ato_tail, tail, memory_order_release);
+        }
+
+        unsigned int dropped = atomic_load(&ato_dropped);
+        if (dropped != last_dropped) {
+            ESP_LOGW(tag, "%u notifications dropped so far", dropped);
+            last_dropped = dropped;
+        }
+    }
+}
+
+void notify_get_stats(notify_stats_t *stats) {
+    stats->sent = atomic_load(&ato_sent);
+    stats->dropped = atomic_load(&ato_dropped);
+    stats->coalesced = atomic_load(&ato_coalesced);
+    stats->failed = atomic_load(&ato_failed);
+}
+
+void notify_init(void) {
+    atomic_init(&ato_head, 0);
+    atomic_init(&ato_tail, 0);
+    atomic_init(&ato_sent, 0);
+    atomic_init(&ato_dropped, 0);
+    atomic_init(&ato_coalesced, 0);
+    atomic_init(&ato_failed, 0);
+}
+
+void notify_start(void) {
+    xTaskCreate(notify_task, "notify_task", 4096, NULL, 1, &notify_handle);
+}
@@ -0,0 +1,24 @@
+#ifndef H_NOTIFY_
+#define H_NOTIFY_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NOTIFY_QUEUE_LEN 8
+#define NOTIFY_DATA_MAX 244 // payload of the largest ATT MTU
+
+typedef struct notify_stats_t {
+    uint32_t sent;
+    uint32_t dropped;    // queue full
+    uint32_t coalesced;  // superseded by a newer notification before being sent
+    uint32_t failed;     // rejected by the host, e.g. the connection went away
+} notify_stats_t;
+
+void notify_init(void);
+void notify_start(void);
+
+bool notify_post(uint16_t conn_handle, uint16_t attr_handle, const void *data, uint16_t len);
+bool notify_post_updated(uint16_t attr_handle);
+void notify_get_stats(notify_stats_t *stats);
+
+#endif
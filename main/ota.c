@@ -0,0 +1,362 @@
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "mbedtls/sha256.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_hs.h"
+#include "bler946.h"
+#include "controller.h"
+#include "ota.h"
+
+static const char *tag = "OTA";
+
+#define OTA_RESTART_DELAY_MS 1000 // lets the done notification go out
+
+/*
+ * The SHA-256 announced by the client only guards the transfer. What may
+ * run is decided by the signature esp_ota_end() checks against the key
+ * this firmware was built with. Without signed images (CONFIG_REFLOW_OTA
+ * off) every begin is refused; the rollback of an image that was already
+ * flashed still works.
+ */
+
+/*
+ * The image is streamed into the inactive OTA partition one window at a
+ * time. The host task checks the chunks and fills the windows, a
+ * dedicated task writes them to flash and acknowledges them, so the link
+ * keeps streaming the next window during the erase and write of the
+ * previous one.
+ *
+ * After a disconnect the session is kept: the window being filled is
+ * dropped and a begin with the same size and hash resumes at the offset
+ * of the last window handed to the writer. The running hash covers
+ * exactly the written windows, and the partition only becomes bootable
+ * once the whole image matches the announced SHA-256 and its signature
+ * checks out. Only bonded clients on an encrypted link may begin.
+ */
+typedef enum {
+    OTA_IDLE,
+    OTA_RECEIVING,
+    OTA_FAILED,
+    OTA_DONE,
+} ota_state_t;
+
+typedef struct ota_buffer_t {
+    atomic_bool ready; // handed to the writer, cleared once written
+    uint16_t len;
+    uint8_t data[OTA_WINDOW];
+} ota_buffer_t;
+
+static ota_buffer_t buffers[OTA_BUFFERS];
+static atomic_int ato_state;
+static atomic_uint ato_owner; // connection that gets the notifications
+static atomic_uint ato_confirmed;
+
+/* Host task only */
+static const esp_partition_t *partition;
+static uint32_t image_size;
+static uint8_t image_sha256[OTA_HASH_LEN];
+static uint32_t received; // handed to the writer or in the window being filled
+static int fill_index;
+static uint16_t fill_len;
+static bool nak_sent;
+
+/* Set up by the host task while the writer is idle */
+static esp_ota_handle_t handle;
+static mbedtls_sha256_context sha256;
+static int write_index;
+
+static TaskHandle_t ota_handle;
+
+static void ota_notify(uint16_t conn_handle, ota_op_t op, ota_status_t status, uint32_t offset) {
+    ota_notification_t notification = {
+        .op = op,
+        .status = status,
+        .offset = offset,
+    };
+    bler_tx_ota(conn_handle, &notification, sizeof notification);
+}
+
+static bool ota_writer_busy(void) {
+    for (int i = 0; i < OTA_BUFFERS; i++) {
+        if (atomic_load(&buffers[i].ready)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void ota_fail(ota_status_t status) {
+    ESP_LOGE(tag, "Update failed: %i", status);
+    esp_ota_abort(handle);
+    atomic_store(&ato_state, OTA_FAILED);
+    ota_notify(atomic_load(&ato_owner), OTA_OP_ACK, status, atomic_load(&ato_confirmed));
+}
+
+static void ota_finish(void) {
+    uint8_t digest[OTA_HASH_LEN];
+    esp_err_t err;
+
+    mbedtls_sha256_finish(&sha256, digest);
+    mbedtls_sha256_free(&sha256);
+    if (memcmp(digest, image_sha256, sizeof digest) != 0) {
+        ota_fail(OTA_ERR_HASH);
+        return;
+    }
+
+    /* Checks the image, and its signature */
+    err = esp_ota_end(handle);
+    if (err == ESP_OK) {
+        err = esp_ota_set_boot_partition(partition);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Image rejected: %s", esp_err_to_name(err));
+        atomic_store(&ato_state, OTA_FAILED);
+        ota_notify(atomic_load(&ato_owner), OTA_OP_ACK, OTA_ERR_IMAGE, atomic_load(&ato_confirmed));
+        return;
+    }
+
+    ESP_LOGI(tag, "Image of %" PRIu32 " bytes verified, restarting", image_size);
+    atomic_store(&ato_state, OTA_DONE);
+    ota_notify(atomic_load(&ato_owner), OTA_OP_DONE, OTA_OK, image_size);
+    vTaskDelay(pdMS_TO_TICKS(OTA_RESTART_DELAY_MS));
+    esp_restart();
+}
+
+static void ota_task(void *param) {
+    for ( ;; ) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (atomic_load(&buffers[write_index].ready)) {
+            ota_buffer_t *buffer = &buffers[write_index];
+
+            if (atomic_load(&ato_state) == OTA_RECEIVING) {
+                if (esp_ota_write(handle, buffer->data, buffer->len) != ESP_OK) {
+                    ota_fail(OTA_ERR_FLASH);
+                } else {
+                    mbedtls_sha256_update(&sha256, buffer->data, buffer->len);
+                    uint32_t confirmed = atomic_fetch_add(&ato_confirmed, buffer->len) + buffer->len;
+                    ota_notify(atomic_load(&ato_owner), OTA_OP_ACK, OTA_OK, confirmed);
+                }
+            }
+            write_index = (write_index + 1) % OTA_BUFFERS;
+            atomic_store(&buffer->ready, false);
+
+            if (atomic_load(&ato_state) == OTA_RECEIVING &&
+                atomic_load(&ato_confirmed) == image_size) {
+                ota_finish();
+            }
+        }
+    }
+}
+
+ota_status_t ota_begin(uint16_t conn_handle, uint32_t size, const uint8_t *sha256_digest, uint32_t *offset) {
+    uint16_t owner = atomic_load(&ato_owner);
+    struct ble_gap_conn_desc desc;
+    esp_err_t err;
+
+#ifndef CONFIG_REFLOW_OTA
+    ESP_LOGW(tag, "Begin refused, firmware built without signed updates");
+    return OTA_ERR_DISABLED;
+#endif
+    if (ble_gap_conn_find(conn_handle, &desc) != 0 ||
+        !desc.sec_state.encrypted || !desc.sec_state.bonded) {
+        ESP_LOGW(tag, "Begin refused, connection %u not bonded", conn_handle);
+        return OTA_ERR_AUTH;
+    }
+    if (reflow_is_running()) {
+        return OTA_ERR_RUNNING;
+    }
+    if (owner != BLE_HS_CONN_HANDLE_NONE && owner != conn_handle &&
+        ble_gap_conn_find(owner, NULL) == 0) {
+        return OTA_ERR_BUSY;
+    }
+
+    if (atomic_load(&ato_state) == OTA_RECEIVING &&
+        size == image_size && memcmp(sha256_digest, image_sha256, OTA_HASH_LEN) == 0) {
+        /* Resume where the previous connection left off */
+        received -= fill_len;
+        fill_len = 0;
+        nak_sent = false;
+        atomic_store(&ato_owner, conn_handle);
+        *offset = received;
+        ESP_LOGI(tag, "Resuming at %" PRIu32 " of %" PRIu32, received, image_size);
+        return OTA_OK;
+    }
+
+    if (ota_writer_busy()) {
+        return OTA_ERR_BUSY;
+    }
+    if (atomic_load(&ato_state) == OTA_RECEIVING) {
+        esp_ota_abort(handle);
+        mbedtls_sha256_free(&sha256);
+        atomic_store(&ato_state, OTA_IDLE);
+    }
+
+    partition = esp_ota_get_next_update_partition(NULL);
+    if (partition == NULL || size == 0 || size > partition->size) {
+        return OTA_ERR_SIZE;
+    }
+    /* Sectors are erased as they are written, beginning is quick */
+    err = esp_ota_begin(partition, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Begin failed: %s", esp_err_to_name(err));
+        return OTA_ERR_FLASH;
+    }
+
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    image_size = size;
+    memcpy(image_sha256, sha256_digest, OTA_HASH_LEN);
+    received = 0;
+    fill_index = 0;
+    fill_len = 0;
+    write_index = 0;
+    nak_sent = false;
+    atomic_store(&ato_confirmed, 0);
+    atomic_store(&ato_owner, conn_handle);
+    atomic_store(&ato_state, OTA_RECEIVING);
+    *offset = 0;
+    ESP_LOGI(tag, "Receiving %" PRIu32 " bytes into %s", size, partition->label);
+    return OTA_OK;
+}
+
+ota_status_t ota_abort(uint16_t conn_handle) {
+    uint16_t owner = atomic_load(&ato_owner);
+
+    if (atomic_load(&ato_state) != OTA_RECEIVING) {
+        return OTA_ERR_NO_SESSION;
+    }
+    if (owner != conn_handle && ble_gap_conn_find(owner, NULL) == 0) {
+        return OTA_ERR_BUSY;
+    }
+    if (ota_writer_busy()) {
+        return OTA_ERR_BUSY;
+    }
+    esp_ota_abort(handle);
+    mbedtls_sha256_free(&sha256);
+    atomic_store(&ato_state, OTA_IDLE);
+    atomic_store(&ato_owner, BLE_HS_CONN_HANDLE_NONE);
+    ESP_LOGI(tag, "Aborted at %" PRIu32, atomic_load(&ato_confirmed));
+    return OTA_OK;
+}
+
+static void ota_nak(uint16_t conn_handle, ota_status_t status) {
+    /* Once per error, the chunks already in flight are dropped silently */
+    if (!nak_sent) {
+        ota_notify(conn_handle, OTA_OP_ACK, status, received);
+        nak_sent = true;
+    }
+}
+
+void ota_write(uint16_t conn_handle, const uint8_t *chunk, uint16_t len) {
+    ota_chunk_header_t header;
+    const uint8_t *data = chunk + sizeof header;
+
+    if (atomic_load(&ato_state) != OTA_RECEIVING || conn_handle != atomic_load(&ato_owner)) {
+        ota_nak(conn_handle, OTA_ERR_NO_SESSION);
+        return;
+    }
+    if (len <= sizeof header) {
+        ota_nak(conn_handle, OTA_ERR_CHUNK);
+        return;
+    }
+    memcpy(&header, chunk, sizeof header);
+    len -= sizeof header;
+
+    if (header.offset != received) {
+        ota_nak(conn_handle, OTA_ERR_OFFSET);
+        return;
+    }
+    if (esp_rom_crc32_le(0, data, len) != header.crc) {
+        ota_nak(conn_handle, OTA_ERR_CHUNK);
+        return;
+    }
+    if (len > image_size - received) {
+        ota_nak(conn_handle, OTA_ERR_SIZE);
+        return;
+    }
+    /* Room left in the window being filled, and in the next one if free */
+    uint32_t room = OTA_WINDOW - fill_len;
+    if (atomic_load(&buffers[fill_index].ready)) {
+        room = 0;
+    } else if (!atomic_load(&buffers[(fill_index + 1) % OTA_BUFFERS].ready)) {
+        room += OTA_WINDOW;
+    }
+    if (len > room) {
+        /* The client ran ahead of the acknowledgements */
+        ota_nak(conn_handle, OTA_ERR_BUSY);
+        return;
+    }
+    nak_sent = false;
+
+    while (len) {
+        uint16_t n = OTA_WINDOW - fill_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(&buffers[fill_index].data[fill_len], data, n);
+        fill_len += n;
+        received += n;
+        data += n;
+        len -= n;
+
+        if (fill_len == OTA_WINDOW || received == image_size) {
+            buffers[fill_index].len = fill_len;
+            atomic_store(&buffers[fill_index].ready, true);
+            xTaskNotifyGive(ota_handle);
+            fill_index = (fill_index + 1) % OTA_BUFFERS;
+            fill_len = 0;
+        }
+    }
+}
+
+void ota_disconnected(uint16_t conn_handle) {
+    if (atomic_load(&ato_owner) == conn_handle) {
+        atomic_store(&ato_owner, BLE_HS_CONN_HANDLE_NONE);
+        if (atomic_load(&ato_state) == OTA_RECEIVING) {
+            ESP_LOGI(tag, "Suspended at %" PRIu32, received - fill_len);
+        }
+    }
+}
+
+/* A transfer is in progress with a connected client */
+bool ota_is_active(void) {
+    return atomic_load(&ato_state) == OTA_RECEIVING &&
+           atomic_load(&ato_owner) != BLE_HS_CONN_HANDLE_NONE;
+}
+
+void ota_get_progress(uint32_t *confirmed, uint32_t *size) {
+    *confirmed = atomic_load(&ato_confirmed);
+    *size = atomic_load(&ato_state) == OTA_IDLE ? 0 : image_size;
+}
+
+/* Called once BLE is up, so that a faulty image is rolled back instead */
+void ota_confirm_image(void) {
+    esp_ota_img_states_t state;
+
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+        state == ESP_OTA_IMG_PENDING_VERIFY) {
+        ESP_LOGI(tag, "First boot of the new image, marking it valid");
+        esp_ota_mark_app_valid_cancel_rollback();
+    }
+}
+
+void ota_init(void) {
+    for (int i = 0; i < OTA_BUFFERS; i++) {
+        atomic_init(&buffers[i].ready, false);
+    }
+    atomic_init(&ato_state, OTA_IDLE);
+    atomic_init(&ato_owner, BLE_HS_CONN_HANDLE_NONE);
+    atomic_init(&ato_confirmed, 0);
+}
+
+void ota_start(void) {
+    xTaskCreate(ota_task, "ota_task", 4096, NULL, 1, &ota_handle);
+}
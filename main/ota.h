@@ -0,0 +1,62 @@
+#ifndef H_OTA_
+#define H_OTA_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OTA_WINDOW 4096 // one flash sector, acknowledged as a whole
+#define OTA_BUFFERS 2   // the client may have this many windows in flight
+#define OTA_HASH_LEN 32 // SHA-256
+
+typedef enum {
+    OTA_OP_BEGIN = 0x01,  // control write: uint32 size, uint8 sha256[32]
+    OTA_OP_ABORT = 0x02,  // control write
+    OTA_OP_ACK = 0x03,    // control notification, see ota_status_t
+    OTA_OP_DONE = 0x04,   // control notification, the image is verified and will boot
+} ota_op_t;
+
+typedef enum {
+    OTA_OK,
+    OTA_ERR_RUNNING,      // refused while a reflow is running
+    OTA_ERR_SIZE,         // image larger than the inactive partition
+    OTA_ERR_BUSY,         // another central owns the session or a window is being written
+    OTA_ERR_NO_SESSION,
+    OTA_ERR_OFFSET,       // chunk not at the expected offset, carried by the notification
+    OTA_ERR_CHUNK,        // chunk CRC mismatch
+    OTA_ERR_FLASH,
+    OTA_ERR_HASH,         // image SHA-256 mismatch
+    OTA_ERR_IMAGE,        // rejected by the image checks, signature included
+    OTA_ERR_AUTH,         // the connection is not encrypted with a bonded key
+    OTA_ERR_DISABLED,     // firmware built without signed updates, CONFIG_REFLOW_OTA
+} ota_status_t;
+
+/*
+ * Control notification: uint8 op, uint8 status, uint32 offset. The offset
+ * is the next byte the client must send: the confirmed offset after a
+ * begin (0, or where an interrupted transfer stopped) and after each
+ * window, the expected one after an offset error.
+ */
+typedef struct __attribute__((packed)) ota_notification_t {
+    uint8_t op;
+    uint8_t status;
+    uint32_t offset;
+} ota_notification_t;
+
+/* Data write: chunk header followed by the image bytes */
+typedef struct __attribute__((packed)) ota_chunk_header_t {
+    uint32_t offset;
+    uint32_t crc;   // CRC32 of the data of the chunk
+} ota_chunk_header_t;
+
+void ota_init(void);
+void ota_start(void);
+
+ota_status_t ota_begin(uint16_t conn_handle, uint32_t size, const uint8_t *sha256, uint32_t *offset);
+ota_status_t ota_abort(uint16_t conn_handle);
+void ota_write(uint16_t conn_handle, const uint8_t *chunk, uint16_t len);
+void ota_disconnected(uint16_t conn_handle);
+bool ota_is_active(void);
+void ota_get_progress(uint32_t *confirmed, uint32_t *size);
+void ota_confirm_image(void);
+
+#endif
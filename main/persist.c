@@ -0,0 +1,306 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nvs_flash.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "persist.h"
+
+static const char *tag = "Persist";
+
+#define PERSIST_NS_MAX 16  // NVS limits, terminator included
+#define PERSIST_KEY_MAX 16
+
+/*
+ * NVS writes are handed to a dedicated task, so the BLE host and UI tasks
+ * never wait for a flash erase or write. A request copies the value into
+ * an entry of a small pool, and entries are written in the order of their
+ * first request, PERSIST_DEBOUNCE_MS after it, so the keys of a record
+ * land in the order their owner asked for. A newer request for the same
+ * key replaces the value of its entry, and its callback, only while no
+ * other key was requested after it: merging into an older entry would
+ * write the value ahead of keys that were meant to follow it, an index
+ * ahead of the slot it points to. Otherwise the request takes an entry of
+ * its own, behind the others.
+ *
+ * Reads go through the pool first, newest entry of the key, so a value is
+ * seen as soon as it has been requested.
+ */
+typedef struct persist_entry_t {
+    bool used;
+    bool erase;
+    uint32_t version;   // bumped by every request, tells a rewrite apart
+    uint32_t order;     // of the first request
+    int64_t due_us;
+    char ns[PERSIST_NS_MAX];
+    char key[PERSIST_KEY_MAX];
+    persist_done_t done;
+    void *arg;
+    size_t len;
+    uint8_t data[PERSIST_VALUE_MAX];
+} persist_entry_t;
+
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+static persist_entry_t pool[PERSIST_ENTRIES];
+static uint32_t next_order;
+
+/* Persistence task only */
+static persist_entry_t job;
+static int job_entry;  // in the pool
+
+static atomic_uint ato_writes;
+static atomic_uint ato_erases;
+static atomic_uint ato_bytes;
+static atomic_uint ato_coalesced;
+static atomic_uint ato_failed;
+static atomic_bool ato_failed_last;
+static atomic_uint ato_last_us;
+static atomic_uint ato_max_us;
+
+static TaskHandle_t persist_handle;
+
+/* Newest pending entry of the key, under pool_lock */
+static persist_entry_t *persist_find(const char *ns, const char *key) {
+    persist_entry_t *newest = NULL;
+
+    for (int i = 0; i < PERSIST_ENTRIES; i++) {
+        if (pool[i].used && strcmp(pool[i].ns, ns) == 0 && strcmp(pool[i].key, key) == 0 &&
+            (newest == NULL || (int32_t)(pool[i].order - newest->order) > 0)) {
+            newest = &pool[i];
+        }
+    }
+    return newest;
+}
+
+/* Whether any other key was requested after the entry, under pool_lock */
+static bool persist_followed(const persist_entry_t *entry) {
+    for (int i = 0; i < PERSIST_ENTRIES; i++) {
+        if (pool[i].used && (int32_t)(pool[i].order - entry->order) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static esp_err_t persist_request(const char *ns, const char *key, const void *data, size_t len,
+                                 bool erase, persist_done_t done, void *arg) {
+    persist_entry_t *entry;
+
+    if (strlen(ns) >= PERSIST_NS_MAX || strlen(key) >= PERSIST_KEY_MAX || len > PERSIST_VALUE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    portENTER_CRITICAL(&pool_lock);
+    entry = persist_find(ns, key);
+    if (entry != NULL && persist_followed(entry)) {
+        entry = NULL;
+    }
+    if (entry != NULL) {
+        atomic_fetch_add(&ato_coalesced, 1);
+    } else {
+        for (int i = 0; i < PERSIST_ENTRIES && entry == NULL; i++) {
+            if (!pool[i].used) {
+                entry = &pool[i];
+            }
+        }
+        if (entry == NULL) {
+            portEXIT_CRITICAL(&pool_lock);
+            ESP_LOGW(tag, "Pool full, %s/%s not written", ns, key);
+            return ESP_ERR_NO_MEM;
+        }
+        entry->used = true;
+        entry->order = next_order++;
+        entry->due_us = esp_timer_get_time() + PERSIST_DEBOUNCE_MS * 1000;
+        strcpy(entry->ns, ns);
+        strcpy(entry->key, key);
+    }
+    entry->version++;
+    entry->erase = erase;
+    entry->done = done;
+    entry->arg = arg;
+    entry->len = len;
+    if (len) {
+        memcpy(entry->data, data, len);
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    if (persist_handle != NULL) {
+        xTaskNotifyGive(persist_handle);
+    }
+    return ESP_OK;
+}
+
+/* NVS keeps the value of a request; ESP_ERR_NO_MEM when the pool is full */
+esp_err_t persist_write(const char *ns, const char *key, const void *data, size_t len,
+                        persist_done_t done, void *arg) {
+    return persist_request(ns, key, data, len, false, done, arg);
+}
+
+esp_err_t persist_erase(const char *ns, const char *key, persist_done_t done, void *arg) {
+    return persist_request(ns, key, NULL, 0, true, done, arg);
+}
+
+/* Pending value, or the stored one; may read the flash, never writes it */
+esp_err_t persist_read(const char *ns, const char *key, void *data, size_t *len) {
+    persist_entry_t *entry;
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    portENTER_CRITICAL(&pool_lock);
+    entry = persist_find(ns, key);
+    if (entry != NULL) {
+        if (entry->erase) {
+            err = ESP_ERR_NVS_NOT_FOUND;
+        } else if (entry->len > *len) {
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        } else {
+            memcpy(data, entry->data, entry->len);
+            *len = entry->len;
+            err = ESP_OK;
+        }
+        portEXIT_CRITICAL(&pool_lock);
+        return err;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    err = nvs_open(ns, NVS_READONLY, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_get_blob(nvs, key, data, len);
+        nvs_close(nvs);
+    }
+    return err;
+}
+
+void persist_get_stats(persist_stats_t *stats) {
+    uint8_t pending = 0;
+
+    portENTER_CRITICAL(&pool_lock);
+    for (int i = 0; i < PERSIST_ENTRIES; i++) {
+        pending += pool[i].used;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+
+    *stats = (persist_stats_t){
+        .pending = pending,
+        .failed_last = atomic_load(&ato_failed_last),
+        .writes = atomic_load(&ato_writes),
+        .erases = atomic_load(&ato_erases),
+        .bytes = atomic_load(&ato_bytes),
+        .coalesced = atomic_load(&ato_coalesced),
+        .failed = atomic_load(&ato_failed),
+        .last_us = atomic_load(&ato_last_us),
+        .max_us = atomic_load(&ato_max_us),
+    };
+}
+
+/*
+ * Copies the oldest entry into job when it is due. Otherwise returns
+ * false and sets the ticks to wait for the next one.
+ */
+static bool persist_take(TickType_t *wait) {
+    int64_t now = esp_timer_get_time();
+    persist_entry_t *oldest = NULL;
+
+    portENTER_CRITICAL(&pool_lock);
+    for (int i = 0; i < PERSIST_ENTRIES; i++) {
+        if (pool[i].used && (oldest == NULL || (int32_t)(pool[i].order - oldest->order) < 0)) {
+            oldest = &pool[i];
+            job_entry = i;
+        }
+    }
+    if (oldest == NULL || oldest->due_us > now) {
+        *wait = oldest == NULL ? portMAX_DELAY : pdMS_TO_TICKS((oldest->due_us - now) / 1000) + 1;
+        portEXIT_CRITICAL(&pool_lock);
+        return false;
+    }
+    job = *oldest;
+    portEXIT_CRITICAL(&pool_lock);
+    return true;
+}
+
+/* Frees the entry unless it was requested again during the write */
+static void persist_release(void) {
+    persist_entry_t *entry = &pool[job_entry];
+
+    portENTER_CRITICAL(&pool_lock);
+    if (entry->version == job.version) {
+        entry->used = false;
+    } else {
+        entry->due_us = esp_timer_get_time() + PERSIST_DEBOUNCE_MS * 1000;
+    }
+    portEXIT_CRITICAL(&pool_lock);
+}
+
+static void persist_write_job(void) {
+    int64_t start = esp_timer_get_time();
+    nvs_handle_t nvs;
+    esp_err_t err;
+
+    err = nvs_open(job.ns, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        if (job.erase) {
+            err = nvs_erase_key(nvs, job.key);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                err = ESP_OK;
+            }
+        } else {
+            err = nvs_set_blob(nvs, job.key, job.data, job.len);
+        }
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+
+    uint32_t duration = esp_timer_get_time() - start;
+    atomic_store(&ato_last_us, duration);
+    if (duration > atomic_load(&ato_max_us)) {
+        atomic_store(&ato_max_us, duration);
+    }
+    atomic_store(&ato_failed_last, err != ESP_OK);
+    if (err != ESP_OK) {
+        atomic_fetch_add(&ato_failed, 1);
+        ESP_LOGE(tag, "Writing %s/%s failed: %s", job.ns, job.key, esp_err_to_name(err));
+    } else if (job.erase) {
+        atomic_fetch_add(&ato_erases, 1);
+    } else {
+        atomic_fetch_add(&ato_writes, 1);
+        atomic_fetch_add(&ato_bytes, job.len);
+    }
+    ESP_LOGD(tag, "%s/%s in %" PRIu32 " us", job.ns, job.key, duration);
+
+    persist_release();
+    if (job.done != NULL) {
+        job.done(job.arg, err);
+    }
+}
+
+static void persist_task(void *param) {
+    TickType_t wait = 0;
+
+    for ( ;; ) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        while (persist_take(&wait)) {
+            persist_write_job();
+        }
+    }
+}
+
+void persist_init(void) {
+    atomic_init(&ato_writes, 0);
+    atomic_init(&ato_erases, 0);
+    atomic_init(&ato_bytes, 0);
+    atomic_init(&ato_coalesced, 0);
+    atomic_init(&ato_failed, 0);
+    atomic_init(&ato_failed_last, false);
+    atomic_init(&ato_last_us, 0);
+    atomic_init(&ato_max_us, 0);
+}
+
+void persist_start(void) {
+    xTaskCreate(persist_task, "persist_task", 4096, NULL, 1, &persist_handle);
+}
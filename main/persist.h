@@ -0,0 +1,37 @@
+#ifndef H_PERSIST_
+#define H_PERSIST_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+#define PERSIST_ENTRIES 6         // requests waiting to be written at once, a key may have several
+#define PERSIST_VALUE_MAX 1040    // a full profile image
+#define PERSIST_DEBOUNCE_MS 500   // writes to a key within this are merged, order permitting
+
+/* Called from the persistence task once the value is committed, or not */
+typedef void (*persist_done_t)(void *arg, esp_err_t err);
+
+/* Packed for the storage characteristic */
+typedef struct __attribute__((packed)) persist_stats_t {
+    uint8_t pending;      // requests waiting to be written
+    uint8_t failed_last;  // 1 when the last write failed
+    uint32_t writes;      // commits since boot
+    uint32_t erases;      // keys erased since boot
+    uint32_t bytes;       // written since boot
+    uint32_t coalesced;   // values superseded before being written
+    uint32_t failed;
+    uint32_t last_us;     // duration of the last write and commit
+    uint32_t max_us;
+} persist_stats_t;
+
+void persist_init(void);
+void persist_start(void);
+
+esp_err_t persist_write(const char *ns, const char *key, const void *data, size_t len,
+                        persist_done_t done, void *arg);
+esp_err_t persist_erase(const char *ns, const char *key, persist_done_t done, void *arg);
+esp_err_t persist_read(const char *ns, const char *key, void *data, size_t *len);
+void persist_get_stats(persist_stats_t *stats);
+
+#endif
@@ -0,0 +1,138 @@
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "controller.h"
+#include "profile.h"
+#include "presets.h"
+
+static const char *tag = "Presets";
+
+/* Ramp to each temperature, then hold it for the duration (s, °C) */
+static const reflow_step_t sac305_steps[] = {
+    { .duration = 60, .temperature = 150 },
+    { .duration = 90, .temperature = 180 },
+    { .duration = 30, .temperature = 217 },
+    { .duration = 20, .temperature = 245 },
+};
+
+static const reflow_step_t sn63pb37_steps[] = {
+    { .duration = 60, .temperature = 120 },
+    { .duration = 90, .temperature = 160 },
+    { .duration = 30, .temperature = 183 },
+    { .duration = 15, .temperature = 215 },
+};
+
+static const reflow_step_t snbi_steps[] = {
+    { .duration = 60, .temperature = 90 },
+    { .duration = 90, .temperature = 120 },
+    { .duration = 30, .temperature = 138 },
+    { .duration = 15, .temperature = 170 },
+};
+
+/* Moisture bake of boards and components before reflow */
+static const reflow_step_t bake_steps[] = {
+    { .duration = 4 * 3600, .temperature = 125 },
+};
+
+/* For parts and pastes that do not stand 125 °C */
+static const reflow_step_t dry_steps[] = {
+    { .duration = 8 * 3600, .temperature = 90 },
+};
+
+#define PRESET_STEPS(table) .steps = sizeof(table) / sizeof(table[0]), .data = table
+
+static const preset_t presets[PRESET_COUNT] = {
+    {
+        .name = "SAC305",
+        .liquidus = 217, .peak_min = 235, .peak_max = 250,
+        .cooling_rate = 30,
+        PRESET_STEPS(sac305_steps),
+    }, {
+        .name = "Sn63Pb37",
+        .liquidus = 183, .peak_min = 205, .peak_max = 225,
+        .cooling_rate = 30,
+        PRESET_STEPS(sn63pb37_steps),
+    }, {
+        .name = "Sn42Bi58",
+        .liquidus = 138, .peak_min = 160, .peak_max = 180,
+        .cooling_rate = 20,
+        PRESET_STEPS(snbi_steps),
+    }, {
+        .name = "Bake 125C",
+        .peak_min = 120, .peak_max = 130,
+        .cooling_rate = 10, .unload_temperature = 60,
+        PRESET_STEPS(bake_steps),
+    }, {
+        .name = "Dry 90C",
+        .peak_min = 85, .peak_max = 95,
+        .cooling_rate = 10, .unload_temperature = 50,
+        PRESET_STEPS(dry_steps),
+    },
+};
+
+/* Only used by preset_select() and preset_find(), under scratch_lock */
+static portMUX_TYPE scratch_lock = portMUX_INITIALIZER_UNLOCKED;
+static reflow_profile_t scratch;
+
+const preset_t *preset_get(int index) {
+    return index >= 0 && index < PRESET_COUNT ? &presets[index] : NULL;
+}
+
+/* Highest temperature of the profile, shown on the panel */
+uint16_t preset_peak(const preset_t *preset) {
+    uint16_t peak = 0;
+
+    for (int step = 0; step < preset->steps; step++) {
+        if (preset->data[step].temperature > peak) {
+            peak = preset->data[step].temperature;
+        }
+    }
+    return peak;
+}
+
+esp_err_t preset_get_profile(int index, reflow_profile_t *profile) {
+    const preset_t *preset = preset_get(index);
+
+    if (preset == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    profile->steps = preset->steps;
+    profile->cooling_rate = preset->cooling_rate;
+    profile->unload_temperature = preset->unload_temperature;
+    memcpy(profile->data, preset->data, preset->steps * sizeof(reflow_step_t));
+    return ESP_OK;
+}
+
+/* Preset the profile is a copy of, NULL for other profiles */
+const preset_t *preset_find(const reflow_profile_t *profile) {
+    uint32_t crc = profile_crc(profile);
+    const preset_t *found = NULL;
+
+    for (int i = 0; i < PRESET_COUNT && found == NULL; i++) {
+        portENTER_CRITICAL(&scratch_lock);
+        preset_get_profile(i, &scratch);
+        if (profile_crc(&scratch) == crc) {
+            found = &presets[i];
+        }
+        portEXIT_CRITICAL(&scratch_lock);
+    }
+    return found;
+}
+
+/* Into the oven profile only, the library and NVS are left as they are */
+esp_err_t preset_select(int index) {
+    esp_err_t err;
+
+    portENTER_CRITICAL(&scratch_lock);
+    err = preset_get_profile(index, &scratch);
+    if (err == ESP_OK) {
+        set_profile(&scratch);
+    }
+    portEXIT_CRITICAL(&scratch_lock);
+
+    if (err == ESP_OK) {
+        ESP_LOGI(tag, "%s selected", presets[index].name);
+    }
+    return err;
+}
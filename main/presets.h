@@ -0,0 +1,44 @@
+#ifndef H_PRESETS_
+#define H_PRESETS_
+
+#include <stdint.h>
+#include "esp_err.h"
+#include "controller.h"
+
+#define PRESET_COUNT 5
+#define PRESET_DEFAULT 0    // used while the library is empty
+#define PRESET_NAME_MAX 16
+
+/*
+ * Built-in profiles, compiled into flash. The metadata comes from the
+ * paste datasheets: liquidus, and the peak range the profile aims into.
+ * Bake and dry profiles do not melt anything and have no liquidus.
+ */
+typedef struct preset_t {
+    const char *name;
+    uint16_t liquidus;           // °C, 0 for bake and dry profiles
+    uint16_t peak_min;           // °C
+    uint16_t peak_max;           // °C
+    uint16_t cooling_rate;       // 0.1 °C/s, 0 for the Kconfig default
+    uint16_t unload_temperature; // °C, 0 for the Kconfig default
+    uint16_t steps;
+    const reflow_step_t *data;
+} preset_t;
+
+/* Presets characteristic read: uint8 count, then count entries (packed) */
+typedef struct __attribute__((packed)) preset_entry_t {
+    char name[PRESET_NAME_MAX];  // NUL padded
+    uint16_t liquidus;
+    uint16_t peak_min;
+    uint16_t peak_max;
+    uint16_t steps;
+    uint32_t crc;                // of the profile, as in its image header
+} preset_entry_t;
+
+const preset_t *preset_get(int index);
+uint16_t preset_peak(const preset_t *preset);
+const preset_t *preset_find(const reflow_profile_t *profile);
+esp_err_t preset_get_profile(int index, reflow_profile_t *profile);
+esp_err_t preset_select(int index);
+
+#endif
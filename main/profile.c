@@ -0,0 +1,98 @@
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include <stdio.h>
+#include <string.h>
+#include "profile.h"
+
+static const char *tag = "Profile";
+
+_Static_assert(sizeof(reflow_step_t) == 4, "steps are copied as is to and from the image");
+
+uint32_t profile_crc(const reflow_profile_t *profile) {
+    uint16_t cooldown[2] = { profile->cooling_rate, profile->unload_temperature };
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)cooldown, sizeof cooldown);
+    return esp_rom_crc32_le(crc, (const uint8_t *)profile->data,
+                            profile->steps * sizeof(reflow_step_t));
+}
+
+void profile_header(const reflow_profile_t *profile, profile_header_t *header) {
+    *header = (profile_header_t){
+        .version = PROFILE_VERSION,
+        .length = PROFILE_PAYLOAD_LEN(profile->steps),
+        .crc = profile_crc(profile),
+    };
+}
+
+size_t profile_encode(const reflow_profile_t *profile, uint8_t *buf, size_t size) {
+    profile_header_t header;
+    size_t len = sizeof header;
+
+    profile_header(profile, &header);
+    if (size < sizeof header + header.length) {
+        return 0;
+    }
+    memcpy(buf, &header, sizeof header);
+    memcpy(&buf[len], &profile->cooling_rate, sizeof(uint16_t));
+    len += sizeof(uint16_t);
+    memcpy(&buf[len], &profile->unload_temperature, sizeof(uint16_t));
+    len += sizeof(uint16_t);
+    memcpy(&buf[len], profile->data, profile->steps * sizeof(reflow_step_t));
+    return len + profile->steps * sizeof(reflow_step_t);
+}
+
+/*
+ * Checks the whole image before anything is written to the profile, so a
+ * truncated or corrupt image leaves it untouched.
+ */
+esp_err_t profile_decode(const uint8_t *buf, size_t len, reflow_profile_t *profile) {
+    profile_header_t header;
+    uint16_t cooldown[2];
+    const uint8_t *payload = buf + sizeof header;
+
+    if (len < sizeof header) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(&header, buf, sizeof header);
+    if (header.version != PROFILE_VERSION) {
+        ESP_LOGW(tag, "Unsupported version %i", header.version);
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (header.length != len - sizeof header ||
+        header.length < PROFILE_PAYLOAD_LEN(1) ||
+        header.length > PROFILE_PAYLOAD_LEN(MAX_REFLOW_STEPS) ||
+        (header.length - PROFILE_PAYLOAD_LEN(0)) % sizeof(reflow_step_t)) {
+        ESP_LOGW(tag, "Invalid length %i for a %i bytes image", header.length, (int)len);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (esp_rom_crc32_le(0, payload, header.length) != header.crc) {
+        ESP_LOGW(tag, "CRC mismatch");
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    int steps = (header.length - PROFILE_PAYLOAD_LEN(0)) / sizeof(reflow_step_t);
+    const uint8_t *data = payload + sizeof cooldown;
+    memcpy(cooldown, payload, sizeof cooldown);
+    if (cooldown[0] > PROFILE_COOLING_RATE_MAX || cooldown[1] > PROFILE_TEMPERATURE_MAX) {
+        ESP_LOGW(tag, "Invalid cool-down %i (0.1 °C/s) to %i °C", cooldown[0], cooldown[1]);
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int step = 0; step < steps; step++) {
+        reflow_step_t s;
+        memcpy(&s, &data[step * sizeof s], sizeof s);
+        if (s.temperature > PROFILE_TEMPERATURE_MAX) {
+            ESP_LOGW(tag, "Step %i: invalid temperature %i °C", step, s.temperature);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+
+    profile->steps = steps;
+    profile->cooling_rate = cooldown[0];
+    profile->unload_temperature = cooldown[1];
+    memcpy(profile->data, data, steps * sizeof(reflow_step_t));
+    return ESP_OK;
+}
+
+/* Setpoints written by the clients, in 0.1 °C */
+bool profile_target_valid(int target) {
+    return target >= 0 && target <= PROFILE_TEMPERATURE_MAX * 10;
+}
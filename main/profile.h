@@ -0,0 +1,39 @@
+#ifndef H_PROFILE_
+#define H_PROFILE_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "controller.h"
+
+#define PROFILE_VERSION 1
+#define PROFILE_TEMPERATURE_MAX 300  // °C, above any solder alloy
+#define PROFILE_COOLING_RATE_MAX 100 // 0.1 °C/s
+
+/*
+ * Serialized profile, as exchanged over BLE and kept in NVS (packed,
+ * little-endian):
+ *   profile_header_t
+ *   uint16 cooling_rate        0.1 °C/s, 0 for the Kconfig default
+ *   uint16 unload_temperature  °C, 0 for the Kconfig default
+ *   steps * reflow_step_t
+ * The length and CRC32 of the header cover everything that follows it.
+ */
+typedef struct __attribute__((packed)) profile_header_t {
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t length;
+    uint32_t crc;
+} profile_header_t;
+
+#define PROFILE_PAYLOAD_LEN(steps) (2 * sizeof(uint16_t) + (steps) * sizeof(reflow_step_t))
+#define PROFILE_IMAGE_MAX (sizeof(profile_header_t) + PROFILE_PAYLOAD_LEN(MAX_REFLOW_STEPS))
+
+uint32_t profile_crc(const reflow_profile_t *profile);
+void profile_header(const reflow_profile_t *profile, profile_header_t *header);
+size_t profile_encode(const reflow_profile_t *profile, uint8_t *buf, size_t size);
+esp_err_t profile_decode(const uint8_t *buf, size_t len, reflow_profile_t *profile);
+bool profile_target_valid(int target);
+
+#endif
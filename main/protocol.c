@@ -0,0 +1,814 @@
+#include "esp_log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include "controller.h"
+#include "actuator.h"
+#include "energy.h"
+#include "telemetry.h"
+#include "history.h"
+#include "runlog.h"
+#include "command.h"
+#include "profile.h"
+#include "library.h"
+#include "persist.h"
+#include "presets.h"
+#include "quality.h"
+#include "protocol.h"
+
+static const char *tag = "Protocol";
+
+static const proto_transport_t *transport;
+
+#define PROTO_CONNS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+/*
+ * Fixed size values, shared by the reads and the change detection below.
+ * Each returns the length of the value.
+ */
+static uint16_t proto_target_value(void *buf) {
+    int16_t target = atomic_load(&ato_target) * 10;
+    memcpy(buf, &target, sizeof target);
+    return sizeof target;
+}
+
+/* Notifications only carry the header, clients read the profile back */
+static uint16_t proto_profile_value(void *buf) {
+    profile_header_t header = {
+        .version = PROFILE_VERSION,
+        .length = PROFILE_PAYLOAD_LEN(get_profile_steps()),
+        .crc = get_profile_crc(),
+    };
+    memcpy(buf, &header, sizeof header);
+    return sizeof header;
+}
+
+static uint16_t proto_ac_freq_value(void *buf) {
+    uint16_t half_ac_freq = atomic_load(&ato_half_ac_freq);
+    memcpy(buf, &half_ac_freq, sizeof half_ac_freq);
+    return sizeof half_ac_freq;
+}
+
+static uint16_t proto_duty_value(void *buf) {
+    uint16_t power[ACTUATOR_CHANNELS];
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        power[ch] = actuator_get_power(ch);
+    }
+    memcpy(buf, power, sizeof power);
+    return sizeof power;
+}
+
+static uint16_t proto_zone_offset_value(void *buf) {
+    int16_t offset[ACTUATOR_CHANNELS];
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        offset[ch] = get_zone_offset(ch) * 10;
+    }
+    memcpy(buf, offset, sizeof offset);
+    return sizeof offset;
+}
+
+/* Joules delivered since the start of the run and of the current step */
+static uint16_t proto_energy_value(void *buf) {
+    struct __attribute__((packed)) {
+        uint32_t run;
+        uint32_t step;
+    } energy = {
+        .run = energy_get_run(),
+        .step = energy_get_step(),
+    };
+    memcpy(buf, &energy, sizeof energy);
+    return sizeof energy;
+}
+
+/* Pending writes and their outcome, so clients learn when changes are stored */
+static uint16_t proto_storage_value(void *buf) {
+    persist_stats_t stats;
+    persist_get_stats(&stats);
+    memcpy(buf, &stats, sizeof stats);
+    return sizeof stats;
+}
+
+/* Runs summarized so far, notified; reads return the summaries */
+static uint16_t proto_quality_value(void *buf) {
+    uint32_t total = quality_get_total();
+    memcpy(buf, &total, sizeof total);
+    return sizeof total;
+}
+
+static uint16_t proto_run_state_value(void *buf) {
+    struct __attribute__((packed)) {
+        uint8_t phase;   // reflow_phase_t
+        int16_t step;    // -1 when idle
+        uint8_t manual;  // bitmask of the channels under manual power
+    } state = {
+        .phase = reflow_get_phase(),
+        .step = reflow_get_step(),
+    };
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        if (get_manual_power(ch) >= 0) {
+            state.manual |= 1 << ch;
+        }
+    }
+    memcpy(buf, &state, sizeof state);
+    return sizeof state;
+}
+
+static uint16_t proto_progress_value(void *buf) {
+    reflow_progress_t progress;
+    reflow_get_progress(&progress);
+    memcpy(buf, &progress, sizeof progress);
+    return sizeof progress;
+}
+
+_Static_assert(sizeof(reflow_progress_t) <= PROTO_VALUE_MAX, "fixed values must fit");
+_Static_assert(ACTUATOR_CHANNELS * sizeof(uint16_t) <= PROTO_VALUE_MAX, "fixed values must fit");
+_Static_assert(sizeof(persist_stats_t) <= PROTO_VALUE_MAX, "fixed values must fit");
+_Static_assert(sizeof(library_index_t) <= PROTO_READ_MAX, "the library index is read whole");
+_Static_assert(1 + PRESET_COUNT * sizeof(preset_entry_t) <= PROTO_READ_MAX, "the presets are read whole");
+_Static_assert(sizeof(quality_history_t) <= PROTO_READ_MAX, "the quality history is read whole");
+
+static proto_status_t proto_target_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    int16_t target;
+
+    if (len != sizeof target) {
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(&target, data, sizeof target);
+    if (!profile_target_valid(target)) {
+        return PROTO_ERR_VALUE;
+    }
+    reflow_stop();
+    atomic_store(&ato_target, target / 10);
+    return PROTO_OK;
+}
+
+/* A single value applies to every channel */
+static proto_status_t proto_duty_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    uint16_t power[ACTUATOR_CHANNELS];
+
+    if (len != sizeof power[0] && len != sizeof power) {
+        return PROTO_ERR_LENGTH;
+    }
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        memcpy(&power[ch], len == sizeof power ? &data[ch * sizeof power[0]] : data, sizeof power[0]);
+        if (power[ch] > ACTUATOR_POWER_MAX) {
+            return PROTO_ERR_VALUE;
+        }
+    }
+    reflow_stop();
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        set_manual_power(ch, power[ch]);
+    }
+    return PROTO_OK;
+}
+
+static proto_status_t proto_zone_offset_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    int16_t offset[ACTUATOR_CHANNELS];
+
+    if (len != sizeof offset) {
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(offset, data, sizeof offset);
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        set_zone_offset(ch, offset[ch] / 10);
+    }
+    return PROTO_OK;
+}
+
+/*
+ * Profiles are transferred as a profile_header_t image (see profile.h),
+ * in chunks prefixed with the uint16 offset of their data in the image.
+ *
+ * A full image is larger than an attribute value may be, so each read of
+ * a connection returns the next chunk that fits the ATT MTU. The chunk
+ * that reaches the end of the image rewinds the connection to the start;
+ * clients read until they have the length given by the header. A write
+ * of the offset alone moves the next read of the connection there.
+ *
+ * Other writes upload a chunk: a chunk at offset 0 starts an upload, the
+ * following ones must be contiguous. A prepared (long) write of the whole
+ * image is a single chunk. The image is decoded and validated once
+ * complete; only then does it replace the active profile, so an
+ * interrupted or corrupt upload never reaches the controller. Writing a
+ * profile does not start a reflow.
+ */
+#define PROFILE_CHUNK_OFFSET_LEN sizeof(uint16_t)
+
+static struct {
+    uint16_t conn;  // uploader, PROTO_CONN_NONE when idle
+    bool nvs;       // upload to the NVS profile characteristic
+    uint16_t received;
+    uint8_t image[PROFILE_IMAGE_MAX];
+} profile_upload = {
+    .conn = PROTO_CONN_NONE,
+};
+
+static struct {
+    uint16_t conn;
+    uint16_t offset[2]; // of the next read, of the active and the NVS profile
+} profile_cursors[PROTO_CONNS];
+
+/* Only touched by the task running the protocol */
+static reflow_profile_t profile_scratch;
+static uint8_t profile_image[PROFILE_IMAGE_MAX];
+
+static proto_status_t proto_profile_upload(uint16_t conn, const uint8_t *data, uint16_t len, bool nvs) {
+    profile_header_t header;
+    uint16_t offset;
+    esp_err_t err;
+
+    if (len < PROFILE_CHUNK_OFFSET_LEN) {
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(&offset, data, sizeof offset);
+    data += PROFILE_CHUNK_OFFSET_LEN;
+    len -= PROFILE_CHUNK_OFFSET_LEN;
+
+    if (offset == 0) {
+        if (profile_upload.conn != PROTO_CONN_NONE &&
+            profile_upload.conn != conn &&
+            transport->connected(profile_upload.conn)) {
+            /* Another central is uploading */
+            return PROTO_ERR_BUSY;
+        }
+        profile_upload.conn = conn;
+        profile_upload.nvs = nvs;
+        profile_upload.received = 0;
+    } else if (profile_upload.conn != conn ||
+               profile_upload.nvs != nvs ||
+               offset != profile_upload.received) {
+        profile_upload.conn = PROTO_CONN_NONE;
+        return PROTO_ERR_OFFSET;
+    }
+
+    if (profile_upload.received + len > sizeof profile_upload.image) {
+        profile_upload.conn = PROTO_CONN_NONE;
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(&profile_upload.image[profile_upload.received], data, len);
+    profile_upload.received += len;
+
+    if (profile_upload.received < sizeof header) {
+        return PROTO_OK;
+    }
+    memcpy(&header, profile_upload.image, sizeof header);
+    if (profile_upload.received < sizeof header + header.length &&
+        sizeof header + header.length <= sizeof profile_upload.image) {
+        return PROTO_OK;
+    }
+
+    /* Complete, or too long for any valid profile */
+    profile_upload.conn = PROTO_CONN_NONE;
+    err = profile_decode(profile_upload.image, profile_upload.received, &profile_scratch);
+    if (err != ESP_OK) {
+        ESP_LOGW(tag, "Profile upload rejected: %s", esp_err_to_name(err));
+        return err == ESP_ERR_INVALID_SIZE ? PROTO_ERR_LENGTH : PROTO_ERR_VALUE;
+    }
+
+    ESP_LOGI(tag, "Profile of %i steps, CRC %08" PRIx32, profile_scratch.steps, header.crc);
+    for (int step = 0; step < profile_scratch.steps; step++) {
+        ESP_LOGD(tag, "%i °C for %i s", profile_scratch.data[step].temperature, profile_scratch.data[step].duration);
+    }
+    ESP_LOGI(tag, "Cool-down to %i °C at %i (0.1 °C/s)", profile_scratch.unload_temperature, profile_scratch.cooling_rate);
+
+    set_profile(&profile_scratch);
+    if (nvs && store_profile(&profile_scratch) != ESP_OK) {
+        return PROTO_ERR_FAILED;
+    }
+    return PROTO_OK;
+}
+
+static int proto_profile_cursor(uint16_t conn) {
+    int slot = transport->slot(conn);
+
+    if (slot >= 0 && profile_cursors[slot].conn != conn) {
+        profile_cursors[slot].conn = conn;
+        profile_cursors[slot].offset[0] = 0;
+        profile_cursors[slot].offset[1] = 0;
+    }
+    return slot;
+}
+
+static proto_status_t proto_profile_chunk(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len, bool nvs) {
+    int slot = proto_profile_cursor(conn);
+    uint16_t offset, count = 0;
+    size_t image_len = 0;
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    if (size > transport->mtu(conn) - 1) {
+        size = transport->mtu(conn) - 1;
+    }
+    if (size < PROFILE_CHUNK_OFFSET_LEN) {
+        return PROTO_ERR_LENGTH;
+    }
+    if (!nvs) {
+        get_profile(&profile_scratch);
+        image_len = profile_encode(&profile_scratch, profile_image, sizeof profile_image);
+    } else if (load_profile(&profile_scratch) == ESP_OK) {
+        image_len = profile_encode(&profile_scratch, profile_image, sizeof profile_image);
+    } /* else nothing stored yet, the image is empty */
+
+    offset = profile_cursors[slot].offset[nvs];
+    if (offset < image_len) {
+        count = image_len - offset;
+        if (count > size - PROFILE_CHUNK_OFFSET_LEN) {
+            count = size - PROFILE_CHUNK_OFFSET_LEN;
+        }
+    }
+    profile_cursors[slot].offset[nvs] = offset + count < image_len ? offset + count : 0;
+
+    memcpy(buf, &offset, sizeof offset);
+    memcpy(&buf[PROFILE_CHUNK_OFFSET_LEN], &profile_image[offset], count);
+    *len = PROFILE_CHUNK_OFFSET_LEN + count;
+    return PROTO_OK;
+}
+
+static proto_status_t proto_profile_seek(uint16_t conn, const uint8_t *data, bool nvs) {
+    int slot = proto_profile_cursor(conn);
+    uint16_t offset;
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    memcpy(&offset, data, sizeof offset);
+    if (offset >= PROFILE_IMAGE_MAX) {
+        return PROTO_ERR_OFFSET;
+    }
+    profile_cursors[slot].offset[nvs] = offset;
+    return PROTO_OK;
+}
+
+static proto_status_t proto_profile_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    return proto_profile_chunk(conn, buf, size, len, false);
+}
+
+static proto_status_t proto_nvs_profile_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    return proto_profile_chunk(conn, buf, size, len, true);
+}
+
+static proto_status_t proto_profile_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    if (len == PROFILE_CHUNK_OFFSET_LEN) {
+        return proto_profile_seek(conn, data, false);
+    }
+    return proto_profile_upload(conn, data, len, false);
+}
+
+static proto_status_t proto_nvs_profile_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    if (len == PROFILE_CHUNK_OFFSET_LEN) {
+        return proto_profile_seek(conn, data, true);
+    }
+    return proto_profile_upload(conn, data, len, true);
+}
+
+/* Per connection, as the telemetry streams */
+static proto_status_t proto_telemetry_rate_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    int slot = transport->slot(conn);
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    buf[0] = telemetry_get_rate(slot);
+    *len = 1;
+    return PROTO_OK;
+}
+
+static proto_status_t proto_telemetry_rate_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    int slot = transport->slot(conn);
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    if (len != 1) {
+        return PROTO_ERR_LENGTH;
+    }
+    if (data[0] < TELEMETRY_RATE_MIN || data[0] > TELEMETRY_RATE_MAX) {
+        return PROTO_ERR_VALUE;
+    }
+    telemetry_set_rate(slot, data[0]);
+    return PROTO_OK;
+}
+
+/*
+ * A write carries a batch of TLV commands (see command.h). The result is
+ * indicated to the writer once the batch has run: uint8 count, then one
+ * command_status_t per command. A malformed batch fails the write itself.
+ */
+static proto_status_t proto_command_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    uint8_t result[1 + COMMAND_BATCH_MAX];
+    int count;
+
+    if (len < 2) {
+        return PROTO_ERR_LENGTH;
+    }
+    count = command_run(data, len, &result[1]);
+    if (count < 0) {
+        return PROTO_ERR_LENGTH;
+    }
+    result[0] = count;
+    transport->indicate(conn, PROTO_COMMAND, result, 1 + count);
+    return PROTO_OK;
+}
+
+/*
+ * History readback (see history.h). A write of a uint32 sequence number
+ * sets where the next read of the connection starts, 0 for the oldest
+ * sample kept. Each read returns a chunk that fits the ATT MTU and moves
+ * on:
+ *   uint32 seq     sequence number of the first sample
+ *   uint8 stride   sequence numbers per sample, 1 or HISTORY_DECIMATION
+ *   uint8 count    samples in the chunk, 0 once caught up
+ *   count * telemetry_sample_t
+ */
+typedef struct __attribute__((packed)) history_chunk_header_t {
+    uint32_t seq;
+    uint8_t stride;
+    uint8_t count;
+} history_chunk_header_t;
+
+static struct {
+    uint16_t conn;
+    uint32_t seq;
+} history_cursors[PROTO_CONNS];
+
+static int proto_history_cursor(uint16_t conn) {
+    int slot = transport->slot(conn);
+
+    if (slot >= 0 && history_cursors[slot].conn != conn) {
+        history_cursors[slot].conn = conn;
+        history_cursors[slot].seq = 0;
+    }
+    return slot;
+}
+
+static proto_status_t proto_history_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    history_chunk_header_t header;
+    int slot = proto_history_cursor(conn);
+    uint32_t seq;
+    uint8_t stride;
+    int max;
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    /* A read response carries MTU - 1 bytes */
+    if (size > transport->mtu(conn) - 1) {
+        size = transport->mtu(conn) - 1;
+    }
+    if (size < sizeof header) {
+        return PROTO_ERR_LENGTH;
+    }
+    max = (size - sizeof header) / sizeof(telemetry_sample_t);
+    if (max > UINT8_MAX) {
+        max = UINT8_MAX;
+    }
+    /* Samples are packed, they are read in place after the header */
+    seq = history_cursors[slot].seq;
+    header.count = history_read(&seq, &stride, (telemetry_sample_t *)&buf[sizeof header], max);
+    header.seq = seq;
+    header.stride = stride;
+    history_cursors[slot].seq = seq + header.count * stride;
+
+    memcpy(buf, &header, sizeof header);
+    *len = sizeof header + header.count * sizeof(telemetry_sample_t);
+    return PROTO_OK;
+}
+
+static proto_status_t proto_history_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    int slot = proto_history_cursor(conn);
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    if (len != sizeof history_cursors[slot].seq) {
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(&history_cursors[slot].seq, data, len);
+    return PROTO_OK;
+}
+
+/* Profile library, reads list the slots from the cached index */
+static proto_status_t proto_library_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    library_index_t index;
+
+    if (size < sizeof index) {
+        return PROTO_ERR_LENGTH;
+    }
+    library_get_index(&index);
+    memcpy(buf, &index, sizeof index);
+    *len = sizeof index;
+    return PROTO_OK;
+}
+
+static proto_status_t proto_library_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    esp_err_t err;
+
+    if (len < 2) {
+        return PROTO_ERR_LENGTH;
+    }
+    switch (data[0]) {
+    case LIBRARY_OP_SELECT:
+    case LIBRARY_OP_DELETE:
+        if (len != 2) {
+            return PROTO_ERR_LENGTH;
+        }
+        err = data[0] == LIBRARY_OP_SELECT ? library_select(data[1]) : library_delete(data[1]);
+        break;
+
+    case LIBRARY_OP_STORE:
+        if (len < 3 || len > 2 + LIBRARY_NAME_MAX) {
+            return PROTO_ERR_LENGTH;
+        }
+        get_profile(&profile_scratch);
+        err = library_store(data[1], (const char *)&data[2], len - 2, &profile_scratch);
+        break;
+
+    default:
+        return PROTO_ERR_VALUE;
+    }
+
+    switch (err) {
+    case ESP_OK:
+        return PROTO_OK;
+    case ESP_ERR_INVALID_ARG:
+    case ESP_ERR_NOT_FOUND:
+        return PROTO_ERR_VALUE;
+    case ESP_ERR_NO_MEM:
+        return PROTO_ERR_BUSY;
+    default:
+        return PROTO_ERR_FAILED;
+    }
+}
+
+/* Built-in profiles, see presets.h; a write of uint8 index selects one */
+static proto_status_t proto_presets_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    if (size < 1 + PRESET_COUNT * sizeof(preset_entry_t)) {
+        return PROTO_ERR_LENGTH;
+    }
+    buf[0] = PRESET_COUNT;
+    *len = 1;
+    for (int i = 0; i < PRESET_COUNT; i++) {
+        const preset_t *preset = preset_get(i);
+        preset_entry_t entry = {
+            .liquidus = preset->liquidus,
+            .peak_min = preset->peak_min,
+            .peak_max = preset->peak_max,
+            .steps = preset->steps,
+        };
+        strncpy(entry.name, preset->name, sizeof entry.name);
+        preset_get_profile(i, &profile_scratch);
+        entry.crc = profile_crc(&profile_scratch);
+        memcpy(&buf[*len], &entry, sizeof entry);
+        *len += sizeof entry;
+    }
+    return PROTO_OK;
+}
+
+static proto_status_t proto_presets_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    if (len != 1) {
+        return PROTO_ERR_LENGTH;
+    }
+    return preset_select(data[0]) == ESP_OK ? PROTO_OK : PROTO_ERR_VALUE;
+}
+
+/* Summaries of the last runs, newest first, see quality.h */
+static proto_status_t proto_quality_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    quality_history_t history;
+    uint16_t history_len;
+
+    quality_get_history(&history);
+    history_len = offsetof(quality_history_t, runs) + history.count * sizeof(quality_summary_t);
+    if (size < history_len) {
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(buf, &history, history_len);
+    *len = history_len;
+    return PROTO_OK;
+}
+
+/*
+ * Run log download: a write selects the stream, uint32 stream followed by
+ * an optional uint32 offset, and each read returns the next chunk:
+ *   uint32 stream
+ *   uint32 offset  of the chunk in the stream
+ *   bytes of the stream, none once at the end
+ * Stream RUNLOG_STREAM_INDEX lists the runs kept, see runlog.h.
+ */
+typedef struct __attribute__((packed)) runlog_chunk_header_t {
+    uint32_t stream;
+    uint32_t offset;
+} runlog_chunk_header_t;
+
+static struct {
+    uint16_t conn;
+    uint32_t stream;
+    uint32_t offset;
+} runlog_cursors[PROTO_CONNS];
+
+static int proto_runlog_cursor(uint16_t conn) {
+    int slot = transport->slot(conn);
+
+    if (slot >= 0 && runlog_cursors[slot].conn != conn) {
+        runlog_cursors[slot].conn = conn;
+        runlog_cursors[slot].stream = RUNLOG_STREAM_INDEX;
+        runlog_cursors[slot].offset = 0;
+    }
+    return slot;
+}
+
+static proto_status_t proto_runlog_read(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len) {
+    runlog_chunk_header_t header;
+    int slot = proto_runlog_cursor(conn);
+    int count;
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    if (size > transport->mtu(conn) - 1) {
+        size = transport->mtu(conn) - 1;
+    }
+    if (size < sizeof header) {
+        return PROTO_ERR_LENGTH;
+    }
+    header.stream = runlog_cursors[slot].stream;
+    header.offset = runlog_cursors[slot].offset;
+    count = runlog_read(header.stream, header.offset, &buf[sizeof header], size - sizeof header);
+    if (count < 0) {
+        return PROTO_ERR_VALUE;
+    }
+    runlog_cursors[slot].offset += count;
+
+    memcpy(buf, &header, sizeof header);
+    *len = sizeof header + count;
+    return PROTO_OK;
+}
+
+static proto_status_t proto_runlog_write(uint16_t conn, const uint8_t *data, uint16_t len) {
+    runlog_chunk_header_t header = { 0 };
+    int slot = proto_runlog_cursor(conn);
+
+    if (slot < 0) {
+        return PROTO_ERR_UNLIKELY;
+    }
+    if (len != sizeof header.stream && len != sizeof header) {
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(&header, data, len);
+    runlog_cursors[slot].stream = header.stream;
+    runlog_cursors[slot].offset = header.offset;
+    return PROTO_OK;
+}
+
+/*
+ * .value returns the fixed size values, and what the notifications of the
+ * profile and quality carry; .read, when present, serves the reads from
+ * connections instead and is given the whole buffer. A read without a
+ * connection builds a notification or indication, and always gets .value.
+ * A missing handler rejects the operation.
+ */
+typedef struct proto_handler_t {
+    uint16_t (*value)(void *buf);
+    proto_status_t (*read)(uint16_t conn, uint8_t *buf, uint16_t size, uint16_t *len);
+    proto_status_t (*write)(uint16_t conn, const uint8_t *data, uint16_t len);
+} proto_handler_t;
+
+static const proto_handler_t proto_handlers[PROTO_CHRS] = {
+    [PROTO_TARGET] = { .value = proto_target_value, .write = proto_target_write },
+    [PROTO_PROFILE] = { .value = proto_profile_value, .read = proto_profile_read, .write = proto_profile_write },
+    [PROTO_NVS_PROFILE] = { .read = proto_nvs_profile_read, .write = proto_nvs_profile_write },
+    [PROTO_AC_FREQ] = { .value = proto_ac_freq_value },
+    [PROTO_DUTY] = { .value = proto_duty_value, .write = proto_duty_write },
+    [PROTO_ZONE_OFFSET] = { .value = proto_zone_offset_value, .write = proto_zone_offset_write },
+    [PROTO_ENERGY] = { .value = proto_energy_value },
+    [PROTO_TELEMETRY_RATE] = { .read = proto_telemetry_rate_read, .write = proto_telemetry_rate_write },
+    [PROTO_RUN_STATE] = { .value = proto_run_state_value },
+    [PROTO_COMMAND] = { .write = proto_command_write },
+    [PROTO_HISTORY] = { .read = proto_history_read, .write = proto_history_write },
+    [PROTO_PROGRESS] = { .value = proto_progress_value },
+    [PROTO_RUNLOG] = { .read = proto_runlog_read, .write = proto_runlog_write },
+    [PROTO_LIBRARY] = { .read = proto_library_read, .write = proto_library_write },
+    [PROTO_STORAGE] = { .value = proto_storage_value },
+    [PROTO_PRESETS] = { .read = proto_presets_read, .write = proto_presets_write },
+    [PROTO_QUALITY] = { .value = proto_quality_value, .read = proto_quality_read },
+};
+
+proto_status_t proto_read(uint16_t conn, proto_chr_t chr, uint8_t *buf, uint16_t size, uint16_t *len) {
+    const proto_handler_t *handler;
+    uint8_t value[PROTO_VALUE_MAX];
+
+    *len = 0;
+    if (chr >= PROTO_CHRS) {
+        return PROTO_ERR_NOT_PERMITTED;
+    }
+    handler = &proto_handlers[chr];
+    if (handler->read && conn != PROTO_CONN_NONE) {
+        return handler->read(conn, buf, size, len);
+    }
+    if (!handler->value) {
+        return PROTO_ERR_NOT_PERMITTED;
+    }
+    uint16_t value_len = handler->value(value);
+    if (value_len > size) {
+        return PROTO_ERR_LENGTH;
+    }
+    memcpy(buf, value, value_len);
+    *len = value_len;
+    return PROTO_OK;
+}
+
+proto_status_t proto_write(uint16_t conn, proto_chr_t chr, const uint8_t *data, uint16_t len) {
+    if (chr >= PROTO_CHRS || !proto_handlers[chr].write) {
+        return PROTO_ERR_NOT_PERMITTED;
+    }
+    return proto_handlers[chr].write(conn, data, len);
+}
+
+/*
+ * Change detection, polled by the controller task. A characteristic is
+ * flagged as updated once per actual change of its value; the transport
+ * then notifies or indicates every subscribed connection, so nothing goes
+ * over the air while the oven state is steady.
+ */
+#define AC_FREQ_DEADBAND 10 // 0.1 Hz, filters the measurement noise
+#define DUTY_MIN_INTERVAL_MS 500 // the on/off loop may switch every tick
+#define PROGRESS_INTERVAL_S 5 // between notifications within a step
+
+typedef struct proto_watch_t {
+    proto_chr_t chr;
+    bool (*changed)(const void *last, const void *now);
+    uint32_t min_interval_ms;
+    uint8_t last[PROTO_VALUE_MAX];
+    uint16_t last_len; // 0 until the first poll
+    int64_t last_time;
+} proto_watch_t;
+
+static bool proto_ac_freq_changed(const void *last, const void *now) {
+    uint16_t last_freq, now_freq;
+    memcpy(&last_freq, last, sizeof last_freq);
+    memcpy(&now_freq, now, sizeof now_freq);
+    return abs(now_freq - last_freq) >= AC_FREQ_DEADBAND;
+}
+
+/* Step and phase changes right away, the running times at a low rate */
+static bool proto_progress_changed(const void *last, const void *now) {
+    reflow_progress_t last_progress, now_progress;
+    memcpy(&last_progress, last, sizeof last_progress);
+    memcpy(&now_progress, now, sizeof now_progress);
+    return last_progress.phase != now_progress.phase ||
+           last_progress.step != now_progress.step ||
+           last_progress.steps != now_progress.steps ||
+           abs(now_progress.elapsed - last_progress.elapsed) >= PROGRESS_INTERVAL_S;
+}
+
+static proto_watch_t proto_watches[] = {
+    { .chr = PROTO_TARGET },
+    { .chr = PROTO_PROFILE },
+    { .chr = PROTO_AC_FREQ, .changed = proto_ac_freq_changed },
+    { .chr = PROTO_DUTY, .min_interval_ms = DUTY_MIN_INTERVAL_MS },
+    { .chr = PROTO_RUN_STATE },
+    { .chr = PROTO_PROGRESS, .changed = proto_progress_changed },
+    { .chr = PROTO_STORAGE },
+    { .chr = PROTO_QUALITY },
+};
+
+void proto_poll_changes(void) {
+    int64_t now = transport->time_us();
+
+    for (size_t i = 0; i < sizeof proto_watches / sizeof proto_watches[0]; i++) {
+        proto_watch_t *watch = &proto_watches[i];
+        uint8_t value[PROTO_VALUE_MAX];
+        uint16_t len = proto_handlers[watch->chr].value(value);
+
+        if (watch->last_len) {
+            if (len == watch->last_len &&
+                (watch->changed ? !watch->changed(watch->last, value)
+                                : memcmp(watch->last, value, len) == 0)) {
+                continue;
+            }
+            if (now - watch->last_time < (int64_t)watch->min_interval_ms * 1000) {
+                continue;
+            }
+            transport->updated(watch->chr);
+        }
+        memcpy(watch->last, value, len);
+        watch->last_len = len;
+        watch->last_time = now;
+    }
+}
+
+void proto_init(const proto_transport_t *t) {
+    transport = t;
+    profile_upload.conn = PROTO_CONN_NONE;
+    for (int slot = 0; slot < PROTO_CONNS; slot++) {
+        profile_cursors[slot].conn = PROTO_CONN_NONE;
+        history_cursors[slot].conn = PROTO_CONN_NONE;
+        runlog_cursors[slot].conn = PROTO_CONN_NONE;
+    }
+    for (size_t i = 0; i < sizeof proto_watches / sizeof proto_watches[0]; i++) {
+        proto_watches[i].last_len = 0;
+    }
+}
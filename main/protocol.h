@@ -0,0 +1,66 @@
+#ifndef H_PROTOCOL_
+#define H_PROTOCOL_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "profile.h"
+
+/*
+ * Encoding, decoding and dispatch of the Reflow service characteristics,
+ * independent of the BLE stack. gatt_svr.c maps the attributes to these
+ * identifiers and the status codes to ATT errors; the host test harness
+ * drives the same functions through a loopback transport.
+ */
+typedef enum {
+    PROTO_TARGET,
+    PROTO_PROFILE,
+    PROTO_NVS_PROFILE,
+    PROTO_AC_FREQ,
+    PROTO_DUTY,
+    PROTO_ZONE_OFFSET,
+    PROTO_ENERGY,
+    PROTO_TELEMETRY_RATE,
+    PROTO_RUN_STATE,
+    PROTO_COMMAND,
+    PROTO_HISTORY,
+    PROTO_PROGRESS,
+    PROTO_RUNLOG,
+    PROTO_LIBRARY,
+    PROTO_STORAGE,
+    PROTO_PRESETS,
+    PROTO_QUALITY,
+    PROTO_CHRS,
+} proto_chr_t;
+
+typedef enum {
+    PROTO_OK,
+    PROTO_ERR_LENGTH,        // wrong value length
+    PROTO_ERR_VALUE,         // value out of range or invalid
+    PROTO_ERR_OFFSET,        // profile chunk out of sequence
+    PROTO_ERR_BUSY,          // another connection holds the resource, or too many pending writes
+    PROTO_ERR_NOT_PERMITTED, // operation not supported by the characteristic
+    PROTO_ERR_FAILED,        // valid, but failed to apply, e.g. NVS error
+    PROTO_ERR_UNLIKELY,      // unknown connection
+} proto_status_t;
+
+#define PROTO_CONN_NONE 0xffff           // reads of the value notifications carry
+#define PROTO_VALUE_MAX 32               // largest fixed size value, and so notified one
+#define PROTO_READ_MAX 512  // largest attribute value, profiles are read in chunks
+#define PROTO_WRITE_MAX 512
+
+typedef struct proto_transport_t {
+    int (*slot)(uint16_t conn);          // per-connection state index, -1 when unknown
+    bool (*connected)(uint16_t conn);
+    uint16_t (*mtu)(uint16_t conn);
+    void (*updated)(proto_chr_t chr);    // notify or indicate every subscriber, read with PROTO_CONN_NONE
+    void (*indicate)(uint16_t conn, proto_chr_t chr, const void *data, uint16_t len);
+    int64_t (*time_us)(void);
+} proto_transport_t;
+
+void proto_init(const proto_transport_t *transport);
+
+proto_status_t proto_read(uint16_t conn, proto_chr_t chr, uint8_t *buf, uint16_t size, uint16_t *len);
+proto_status_t proto_write(uint16_t conn, proto_chr_t chr, const uint8_t *data, uint16_t len);
+void proto_poll_changes(void);
+
+#endif
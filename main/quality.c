@@ -0,0 +1,254 @@
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "controller.h"
+#include "runlog.h"
+#include "profile.h"
+#include "presets.h"
+#include "persist.h"
+#include "quality.h"
+
+static const char *tag = "Quality";
+
+#define QUALITY_NAMESPACE "quality"
+#define QUALITY_KEY "history"
+#define QUALITY_EPOCH_MIN 1600000000 // earlier clocks were never set
+
+#define MAX(a, b)  (((a) > (b)) ? (a) : (b))
+
+/*
+ * Metrics of the run in progress, updated by the controller task at every
+ * sample in constant time and space: running extremes and sums, and the
+ * last few seconds of temperatures for the slopes.
+ */
+typedef struct quality_state_t {
+    bool active;
+    quality_summary_t summary;   // identity of the run, and the liquidus
+    uint16_t peak_min;           // °C
+    uint16_t peak_max;
+    uint16_t cooling_max;        // 0.01 °C/s
+
+    uint32_t start_ms;
+    uint32_t last_ms;            // 0 until the first sample
+    int16_t peak;                // 0.25 °C
+    uint32_t above_ms;
+    uint32_t soak_ms;
+    uint32_t second;             // of the last slope sample
+    int16_t window[QUALITY_RATE_WINDOW_S]; // 0.25 °C, one per second
+    uint8_t window_head;
+    uint8_t window_count;
+    int max_ramp;                // 0.01 °C/s
+    int max_cooling;
+    int64_t error_sum;           // 0.01 °C
+    int64_t error_squares;
+    uint32_t error_count;
+    int error_max;
+} quality_state_t;
+
+static portMUX_TYPE state_lock = portMUX_INITIALIZER_UNLOCKED;
+static quality_state_t state;
+
+/* Kept in RAM, written through the persistence task at the end of the runs */
+static portMUX_TYPE history_lock = portMUX_INITIALIZER_UNLOCKED;
+static quality_history_t history;
+static quality_history_t record;  // only used by the single quality_end_run() of a run
+
+void quality_begin_run(const reflow_profile_t *profile, bool resumed) {
+    const preset_t *preset = preset_find(profile);
+    time_t now = time(NULL);
+    int peak = 0;
+
+    for (int step = 0; step < profile->steps; step++) {
+        peak = MAX(peak, profile->data[step].temperature);
+    }
+    quality_state_t fresh = {
+        .active = true,
+        .summary = {
+            .run = runlog_get_run(),
+            .epoch = now >= QUALITY_EPOCH_MIN ? now : 0,
+            .profile_crc = profile_crc(profile),
+            .flags = resumed ? QUALITY_FLAG_RESUMED : 0,
+            .liquidus = preset != NULL ? preset->liquidus : 0,
+        },
+        /* The paste range for the presets, around the highest step otherwise */
+        .peak_min = preset != NULL ? preset->peak_min : MAX(peak - QUALITY_PEAK_TOLERANCE, 0),
+        .peak_max = preset != NULL ? preset->peak_max : peak + QUALITY_PEAK_TOLERANCE,
+        .cooling_max = (profile->cooling_rate ? profile->cooling_rate : CONFIG_REFLOW_COOLING_RATE) * 10
+                       + QUALITY_COOLING_MARGIN,
+        .peak = INT16_MIN,
+    };
+
+    portENTER_CRITICAL(&state_lock);
+    state = fresh;
+    portEXIT_CRITICAL(&state_lock);
+}
+
+/* Controller task, every sample of the run */
+void quality_push(const telemetry_sample_t *sample, reflow_phase_t phase) {
+    uint32_t second = sample->timestamp / 1000;
+    uint32_t dt;
+
+    portENTER_CRITICAL(&state_lock);
+    if (!state.active || phase == REFLOW_IDLE) {
+        portEXIT_CRITICAL(&state_lock);
+        return;
+    }
+    if (state.last_ms == 0) {
+        state.start_ms = sample->timestamp;
+        state.second = second - 1;
+    }
+    dt = state.last_ms ? sample->timestamp - state.last_ms : 0;
+    state.last_ms = sample->timestamp;
+
+    if (sample->temperature > state.peak) {
+        state.peak = sample->temperature;
+    }
+    if (state.summary.liquidus) {
+        if (sample->temperature >= state.summary.liquidus * 4) {
+            state.above_ms += dt;
+        }
+        if (phase == REFLOW_HOLD && sample->target < state.summary.liquidus) {
+            state.soak_ms += dt;
+        }
+    }
+
+    /* Slope over the window, once per second */
+    if (second != state.second) {
+        state.second = second;
+        if (state.window_count == QUALITY_RATE_WINDOW_S) {
+            int rate = (sample->temperature - state.window[state.window_head]) * 25 / QUALITY_RATE_WINDOW_S;
+            state.max_ramp = MAX(state.max_ramp, rate);
+            state.max_cooling = MAX(state.max_cooling, -rate);
+        } else {
+            state.window_count++;
+        }
+        state.window[state.window_head] = sample->temperature;
+        state.window_head = (state.window_head + 1) % QUALITY_RATE_WINDOW_S;
+    }
+
+    /* Ramps chase a setpoint far ahead, only the holds tell the tracking */
+    if (phase == REFLOW_HOLD) {
+        int error = sample->temperature * 25 - sample->target * 100;
+        state.error_sum += error;
+        state.error_squares += (int64_t)error * error;
+        state.error_count++;
+        state.error_max = MAX(state.error_max, abs(error));
+    }
+    portEXIT_CRITICAL(&state_lock);
+}
+
+static uint8_t quality_flags(const quality_state_t *run, const quality_summary_t *summary) {
+    uint8_t flags = summary->flags;
+
+    if (summary->status != RUNLOG_COMPLETE) {
+        flags |= QUALITY_FLAG_INCOMPLETE;
+    }
+    if (summary->peak < run->peak_min * 4) {
+        flags |= QUALITY_FLAG_PEAK_LOW;
+    } else if (summary->peak > run->peak_max * 4) {
+        flags |= QUALITY_FLAG_PEAK_HIGH;
+    }
+    if (summary->liquidus) {
+        if (summary->time_above_liquidus < QUALITY_TAL_MIN) {
+            flags |= QUALITY_FLAG_TAL_SHORT;
+        } else if (summary->time_above_liquidus > QUALITY_TAL_MAX) {
+            flags |= QUALITY_FLAG_TAL_LONG;
+        }
+    }
+    if (summary->max_ramp > QUALITY_RAMP_MAX) {
+        flags |= QUALITY_FLAG_RAMP_FAST;
+    }
+    if (summary->max_cooling > run->cooling_max) {
+        flags |= QUALITY_FLAG_COOLING_FAST;
+    }
+    return flags;
+}
+
+static void quality_persisted(void *arg, esp_err_t err) {
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Run summary lost at the next reboot: %s", esp_err_to_name(err));
+    }
+}
+
+/* From the reflow task at the end of the run, completed or stopped */
+void quality_end_run(runlog_status_t status) {
+    quality_state_t run;
+    quality_summary_t summary;
+
+    portENTER_CRITICAL(&state_lock);
+    run = state;
+    state.active = false;
+    portEXIT_CRITICAL(&state_lock);
+    if (!run.active || run.last_ms == 0) {
+        return;
+    }
+
+    summary = run.summary;
+    summary.status = status;
+    summary.peak = run.peak;
+    summary.time_above_liquidus = run.above_ms / 1000;
+    summary.soak = run.soak_ms / 1000;
+    summary.max_ramp = run.max_ramp;
+    summary.max_cooling = run.max_cooling;
+    summary.duration = (run.last_ms - run.start_ms) / 1000;
+    if (run.error_count) {
+        summary.error_mean = run.error_sum / run.error_count;
+        summary.error_max = run.error_max;
+        summary.error_rms = sqrt((double)run.error_squares / run.error_count);
+    }
+    summary.flags = quality_flags(&run, &summary);
+
+    portENTER_CRITICAL(&history_lock);
+    memmove(&history.runs[1], &history.runs[0], (QUALITY_HISTORY - 1) * sizeof history.runs[0]);
+    history.runs[0] = summary;
+    if (history.count < QUALITY_HISTORY) {
+        history.count++;
+    }
+    history.total++;
+    record = history;
+    portEXIT_CRITICAL(&history_lock);
+    persist_write(QUALITY_NAMESPACE, QUALITY_KEY, &record, sizeof record, quality_persisted, NULL);
+
+    ESP_LOGI(tag, "Run %" PRIu32 " %s: peak %i.%02i °C, %u s above %u °C, soak %u s, ramp %u, cooling %u (0.01 °C/s), "
+             "error %i/%u/%u (0.01 °C), flags 0x%02x",
+             summary.run, summary.flags & QUALITY_FLAGS_FAIL ? "failed" : "passed",
+             summary.peak / 4, summary.peak % 4 * 25, summary.time_above_liquidus, summary.liquidus,
+             summary.soak, summary.max_ramp, summary.max_cooling,
+             summary.error_mean, summary.error_max, summary.error_rms, summary.flags);
+}
+
+void quality_get_history(quality_history_t *copy) {
+    portENTER_CRITICAL(&history_lock);
+    *copy = history;
+    portEXIT_CRITICAL(&history_lock);
+}
+
+uint32_t quality_get_total(void) {
+    uint32_t total;
+
+    portENTER_CRITICAL(&history_lock);
+    total = history.total;
+    portEXIT_CRITICAL(&history_lock);
+    return total;
+}
+
+void quality_init(void) {
+    size_t len = sizeof record;
+    esp_err_t err;
+
+    history = (quality_history_t){ .version = QUALITY_VERSION };
+    err = persist_read(QUALITY_NAMESPACE, QUALITY_KEY, &record, &len);
+    if (err == ESP_OK && len == sizeof record && record.version == QUALITY_VERSION &&
+        record.count <= QUALITY_HISTORY) {
+        history = record;
+    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGW(tag, "History rejected (%s), starting over", esp_err_to_name(err));
+    }
+}
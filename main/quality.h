@@ -0,0 +1,75 @@
+#ifndef H_QUALITY_
+#define H_QUALITY_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "telemetry.h"
+#include "controller.h"
+#include "runlog.h"
+
+#define QUALITY_VERSION 1
+#define QUALITY_HISTORY 8          // summaries kept in NVS, the oldest ones are dropped
+#define QUALITY_RATE_WINDOW_S 5    // slopes are measured over this, the thermocouple is noisy
+
+/* Limits the profile does not set, from the paste datasheets and J-STD-020 */
+#define QUALITY_PEAK_TOLERANCE 5   // °C around the highest step, for profiles of no known paste
+#define QUALITY_TAL_MIN 30         // s above liquidus
+#define QUALITY_TAL_MAX 90
+#define QUALITY_RAMP_MAX 300       // 0.01 °C/s
+#define QUALITY_COOLING_MARGIN 50  // 0.01 °C/s over the cooling rate of the profile
+
+typedef enum {
+    QUALITY_FLAG_PEAK_LOW = 0x01,
+    QUALITY_FLAG_PEAK_HIGH = 0x02,
+    QUALITY_FLAG_TAL_SHORT = 0x04,     // time above liquidus
+    QUALITY_FLAG_TAL_LONG = 0x08,
+    QUALITY_FLAG_RAMP_FAST = 0x10,
+    QUALITY_FLAG_COOLING_FAST = 0x20,
+    QUALITY_FLAG_INCOMPLETE = 0x40,    // aborted, or interrupted by a reset
+    QUALITY_FLAG_RESUMED = 0x80,       // after a reset, the metrics miss the start
+} quality_flag_t;
+
+#define QUALITY_FLAGS_FAIL 0x7f        // a run passes when none of these is set
+
+/*
+ * Summary of a run (packed, little-endian). Liquidus, time above it and
+ * soak are 0 for profiles of no known paste. The tracking error is the
+ * temperature minus the setpoint, during the holds.
+ */
+typedef struct __attribute__((packed)) quality_summary_t {
+    uint32_t run;             // in the run log, 0 when not logged
+    uint32_t epoch;           // s since 1970, 0 when the clock was never set
+    uint32_t profile_crc;
+    uint8_t status;           // runlog_status_t
+    uint8_t flags;            // quality_flag_t
+    int16_t peak;             // 0.25 °C
+    uint16_t liquidus;        // °C
+    uint16_t time_above_liquidus; // s
+    uint16_t soak;            // s held below liquidus
+    uint16_t max_ramp;        // 0.01 °C/s
+    uint16_t max_cooling;     // 0.01 °C/s
+    int16_t error_mean;       // 0.01 °C
+    uint16_t error_max;       // 0.01 °C, absolute
+    uint16_t error_rms;       // 0.01 °C
+    uint16_t duration;        // s
+} quality_summary_t;
+
+/* Quality characteristic read, and the NVS record: count summaries, newest first */
+typedef struct __attribute__((packed)) quality_history_t {
+    uint8_t version;
+    uint8_t count;
+    uint16_t reserved;
+    uint32_t total;           // runs summarized, notified when it changes
+    quality_summary_t runs[QUALITY_HISTORY];
+} quality_history_t;
+
+void quality_init(void);
+
+void quality_begin_run(const reflow_profile_t *profile, bool resumed);
+void quality_end_run(runlog_status_t status);
+void quality_push(const telemetry_sample_t *sample, reflow_phase_t phase);
+
+void quality_get_history(quality_history_t *history);
+uint32_t quality_get_total(void);
+
+#endif
@@ -0,0 +1,616 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "actuator.h"
+#include "energy.h"
+#include "profile.h"
+#include "runlog.h"
+
+static const char *tag = "Run log";
+
+#define RUNLOG_SUBTYPE 0x40        // see partitions.csv
+#define RUNLOG_SECTOR 4096         // erase unit
+#define RUNLOG_MAGIC 0x474f4c52    // "RLOG"
+#define RUNLOG_STAGING_LEN 64      // s of samples
+#define RUNLOG_BATCH 32            // samples per flash write
+#define RUNLOG_SPARE_SECTORS 4     // kept erased ahead, about 40 min of samples
+#define RUNLOG_IDLE_MS 1000
+#define RUNLOG_EPOCH_MIN 1600000000 // earlier clocks were never set
+#define RUNLOG_NONE UINT32_MAX
+
+#define ALIGN4(x) (((x) + 3) & ~3u)
+
+/*
+ * The partition is a circular log of 4 KB sectors. Each sector in use
+ * starts with a runlog_sector_t whose sequence number increases with every
+ * sector written, then holds whole entries, 4-byte aligned, until the
+ * first erased header. The newest sector is found again at boot from the
+ * sequence numbers, and the oldest one is erased to make room: writes and
+ * erases go round the whole partition, and old runs are recycled.
+ *
+ * Samples are staged in RAM by the controller task, which never touches
+ * the flash, and a writer task appends them in batches. The writer keeps a
+ * few sectors erased ahead while the oven is idle, so a run only programs
+ * pages: an erase stalls the flash cache, and the non-IRAM interrupts with
+ * it, for tens of milliseconds.
+ *
+ * Reads go through a memory mapping of the partition. The payload of an
+ * entry is written before its header, so readers, which stop at the first
+ * erased header, never see a partial entry.
+ */
+typedef struct runlog_sector_t {
+    uint32_t magic;
+    uint32_t seq;
+} runlog_sector_t;
+
+typedef struct runlog_staged_t {
+    uint32_t run;
+    runlog_sample_t sample;
+} runlog_staged_t;
+
+static const esp_partition_t *partition;
+static const uint8_t *log_map;
+static esp_partition_mmap_handle_t log_map_handle;
+static uint32_t sectors;
+
+/* Writer task only, once runlog_init() has scanned the partition */
+static uint32_t head;         // sector being written
+static uint32_t head_seq;
+static uint32_t write_offset; // in the head sector
+static uint32_t spare;        // erased sectors following the head
+static uint32_t current_run;  // being written, 0 for none
+static uint32_t closed_run;   // last one ended
+
+/* Staged samples, a single producer, single consumer ring */
+static runlog_staged_t staging[RUNLOG_STAGING_LEN];
+static atomic_uint ato_staging_head; // written by the controller task only
+static atomic_uint ato_staging_tail; // written by the writer only
+static atomic_uint ato_dropped;
+static uint32_t last_period;         // controller task only
+
+/*
+ * Run being logged, 0 for none. The start and end of a run are handed to
+ * the writer through a single slot each: runs last far longer than the
+ * writer takes to pick them up.
+ */
+static atomic_uint ato_run;
+static atomic_uint ato_next_run;
+static atomic_uint ato_run_start_ms;
+static uint8_t start_payload[sizeof(runlog_start_t) + PROFILE_IMAGE_MAX];
+static uint16_t start_len;
+static atomic_uint ato_start_run; // pending start, 0 for none
+static runlog_end_t end_payload;
+static atomic_uint ato_end_run;   // pending end, 0 for none
+
+/* Runs kept, oldest first, along with the address of their start entry */
+static portMUX_TYPE index_lock = portMUX_INITIALIZER_UNLOCKED;
+static runlog_index_t runs[RUNLOG_INDEX_MAX];
+static uint32_t run_addr[RUNLOG_INDEX_MAX];
+static int run_count;
+
+static TaskHandle_t runlog_handle;
+
+static runlog_sector_t runlog_sector_header(uint32_t sector) {
+    runlog_sector_t header;
+    memcpy(&header, &log_map[sector * RUNLOG_SECTOR], sizeof header);
+    return header;
+}
+
+/* Copies the entry at addr, false past the last one of its sector */
+static bool runlog_entry_at(uint32_t addr, runlog_entry_t *entry) {
+    uint32_t end = (addr / RUNLOG_SECTOR + 1) * RUNLOG_SECTOR;
+
+    if (addr + sizeof *entry > end) {
+        return false;
+    }
+    memcpy(entry, &log_map[addr], sizeof *entry);
+    return entry->type >= RUNLOG_ENTRY_START && entry->type <= RUNLOG_ENTRY_END &&
+           addr + sizeof *entry + entry->len <= end;
+}
+
+/* Entry following the one at addr, in the next sector if written right after */
+static uint32_t runlog_next(uint32_t addr) {
+    uint32_t sector = addr / RUNLOG_SECTOR;
+    uint32_t following = (sector + 1) % sectors;
+    runlog_sector_t header, next_header;
+    runlog_entry_t entry;
+
+    if (!runlog_entry_at(addr, &entry)) {
+        return RUNLOG_NONE;
+    }
+    addr += ALIGN4(sizeof entry + entry.len);
+    if (runlog_entry_at(addr, &entry)) {
+        return addr;
+    }
+
+    header = runlog_sector_header(sector);
+    next_header = runlog_sector_header(following);
+    if (next_header.magic != RUNLOG_MAGIC || next_header.seq != header.seq + 1) {
+        return RUNLOG_NONE;
+    }
+    addr = following * RUNLOG_SECTOR + sizeof next_header;
+    return runlog_entry_at(addr, &entry) ? addr : RUNLOG_NONE;
+}
+
+static void runlog_index_start(uint32_t run, uint32_t addr, uint32_t epoch, uint32_t size) {
+    portENTER_CRITICAL(&index_lock);
+    if (run_count == RUNLOG_INDEX_MAX) {
+        memmove(runs, &runs[1], (RUNLOG_INDEX_MAX - 1) * sizeof runs[0]);
+        memmove(run_addr, &run_addr[1], (RUNLOG_INDEX_MAX - 1) * sizeof run_addr[0]);
+        run_count--;
+    }
+    runs[run_count] = (runlog_index_t){
+        .run = run,
+        .epoch = epoch,
+        .size = size,
+        .status = RUNLOG_RUNNING,
+    };
+    run_addr[run_count] = addr;
+    run_count++;
+    portEXIT_CRITICAL(&index_lock);
+}
+
+/* Accounts an entry of the newest run */
+static void runlog_index_entry(uint32_t run, uint32_t size, int status) {
+    portENTER_CRITICAL(&index_lock);
+    if (run_count && runs[run_count - 1].run == run) {
+        runs[run_count - 1].size += size;
+        if (status >= 0) {
+            runs[run_count - 1].status = status;
+        }
+    }
+    portEXIT_CRITICAL(&index_lock);
+}
+
+/* Runs whose start entry was in an erased sector are gone */
+static void runlog_index_erased(uint32_t sector) {
+    int kept = 0;
+
+    portENTER_CRITICAL(&index_lock);
+    for (int i = 0; i < run_count; i++) {
+        if (run_addr[i] / RUNLOG_SECTOR != sector) {
+            runs[kept] = runs[i];
+            run_addr[kept] = run_addr[i];
+            kept++;
+        }
+    }
+    run_count = kept;
+    portEXIT_CRITICAL(&index_lock);
+}
+
+static bool runlog_erase(uint32_t sector) {
+    esp_err_t err;
+
+    runlog_index_erased(sector);
+    err = esp_partition_erase_range(partition, sector * RUNLOG_SECTOR, RUNLOG_SECTOR);
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Erase of sector %" PRIu32 " failed: %s", sector, esp_err_to_name(err));
+        return false;
+    }
+    return true;
+}
+
+/* Only while idle, see above */
+static void runlog_erase_ahead(void) {
+    while (spare < RUNLOG_SPARE_SECTORS && spare < sectors - 1) {
+        if (!runlog_erase((head + spare + 1) % sectors)) {
+            return;
+        }
+        spare++;
+    }
+}
+
+static bool runlog_next_sector(void) {
+    uint32_t next = (head + 1) % sectors;
+    runlog_sector_t header = {
+        .magic = RUNLOG_MAGIC,
+        .seq = head_seq + 1,
+    };
+
+    if (spare) {
+        spare--;
+    } else {
+        ESP_LOGW(tag, "No erased sector left, erasing during the run");
+        if (!runlog_erase(next)) {
+            return false;
+        }
+    }
+    if (esp_partition_write(partition, next * RUNLOG_SECTOR, &header, sizeof header) != ESP_OK) {
+        return false;
+    }
+    head = next;
+    head_seq = header.seq;
+    write_offset = sizeof header;
+    return true;
+}
+
+/* Returns the address of the entry, RUNLOG_NONE when it could not be written */
+static uint32_t runlog_append(uint8_t type, uint32_t run, const void *payload, uint16_t len) {
+    runlog_entry_t entry = {
+        .type = type,
+        .len = len,
+        .run = run,
+    };
+    uint32_t size = ALIGN4(sizeof entry + len);
+    uint32_t addr;
+    esp_err_t err;
+
+    if (write_offset + size > RUNLOG_SECTOR && !runlog_next_sector()) {
+        return RUNLOG_NONE;
+    }
+    addr = head * RUNLOG_SECTOR + write_offset;
+    write_offset += size;
+
+    /* Payload first: the header makes the entry visible */
+    err = esp_partition_write(partition, addr + sizeof entry, payload, len);
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition, addr, &entry, sizeof entry);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Write at %08" PRIx32 " failed: %s", addr, esp_err_to_name(err));
+        return RUNLOG_NONE;
+    }
+    return addr;
+}
+
+/*
+ * Writes the staged samples of the current run, a batch at a time, or all
+ * of them when the run ends. Samples left from a run already closed are
+ * dropped, those of a run not started yet wait for it.
+ */
+static void runlog_flush(bool all) {
+    static runlog_sample_t batch[RUNLOG_BATCH];
+
+    for ( ;; ) {
+        unsigned int tail = atomic_load_explicit(&ato_staging_tail, memory_order_relaxed);
+        unsigned int head_index = atomic_load_explicit(&ato_staging_head, memory_order_acquire);
+        int count = 0;
+
+        while (tail + count != head_index && count < RUNLOG_BATCH) {
+            const runlog_staged_t *staged = &staging[(tail + count) % RUNLOG_STAGING_LEN];
+            if (current_run && staged->run == current_run) {
+                batch[count++] = staged->sample;
+            } else if (count == 0 && staged->run <= (current_run > closed_run ? current_run : closed_run)) {
+                tail++;
+            } else {
+                break;
+            }
+        }
+        if (count == 0 || (count < RUNLOG_BATCH && !all)) {
+            atomic_store_explicit(&ato_staging_tail, tail, memory_order_release);
+            return;
+        }
+
+        uint16_t len = count * sizeof batch[0];
+        if (runlog_append(RUNLOG_ENTRY_SAMPLES, current_run, batch, len) != RUNLOG_NONE) {
+            runlog_index_entry(current_run, sizeof(runlog_entry_t) + len, -1);
+        }
+        atomic_store_explicit(&ato_staging_tail, tail + count, memory_order_release);
+    }
+}
+
+static void runlog_handle_end(void) {
+    uint32_t run = atomic_load(&ato_end_run);
+
+    if (run == 0 || run == atomic_load(&ato_start_run)) {
+        /* Nothing to end, or its start goes first */
+        return;
+    }
+    if (run == current_run) {
+        runlog_end_t end = end_payload;
+        runlog_flush(true);
+        if (runlog_append(RUNLOG_ENTRY_END, run, &end, sizeof end) != RUNLOG_NONE) {
+            runlog_index_entry(run, sizeof(runlog_entry_t) + sizeof end, end.status);
+        }
+        ESP_LOGI(tag, "Run %" PRIu32 " logged, %" PRIu32 " samples dropped", run, end.dropped);
+        closed_run = run;
+        current_run = 0;
+    }
+    atomic_store(&ato_end_run, 0);
+}
+
+static void runlog_handle_start(void) {
+    uint32_t run = atomic_load(&ato_start_run);
+    runlog_start_t start;
+    uint32_t addr;
+
+    if (run == 0) {
+        return;
+    }
+    if (current_run) {
+        /* Its task was stopped before the end was handed over */
+        runlog_flush(true);
+        runlog_index_entry(current_run, 0, RUNLOG_INTERRUPTED);
+        closed_run = current_run;
+    }
+    memcpy(&start, start_payload, sizeof start);
+    addr = runlog_append(RUNLOG_ENTRY_START, run, start_payload, start_len);
+    if (addr != RUNLOG_NONE) {
+        runlog_index_start(run, addr, start.epoch, sizeof(runlog_entry_t) + start_len);
+        current_run = run;
+    } else {
+        current_run = 0;
+    }
+    atomic_store(&ato_start_run, 0);
+}
+
+static void runlog_task(void *param) {
+    runlog_erase_ahead();
+
+    for ( ;; ) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RUNLOG_IDLE_MS));
+
+        runlog_handle_end();
+        runlog_handle_start();
+        runlog_handle_end();
+        runlog_flush(false);
+        if (current_run == 0) {
+            runlog_erase_ahead();
+        }
+    }
+}
+
+void runlog_begin_run(const reflow_profile_t *profile, uint16_t fan_gain) {
+    time_t now = time(NULL);
+    runlog_start_t start = {
+        .version = RUNLOG_START_VERSION,
+        .channels = ACTUATOR_CHANNELS,
+        .fan_gain = fan_gain,
+        .epoch = now >= RUNLOG_EPOCH_MIN ? now : 0,
+        .uptime = esp_timer_get_time() / 1000000,
+    };
+    uint32_t run;
+
+    if (partition == NULL) {
+        return;
+    }
+    if (atomic_load(&ato_start_run) || atomic_load(&ato_end_run)) {
+        ESP_LOGW(tag, "Previous run not written yet, not logging this one");
+        return;
+    }
+    for (int ch = 0; ch < ACTUATOR_CHANNELS; ch++) {
+        start.zone_offset[ch] = get_zone_offset(ch);
+    }
+    memcpy(start_payload, &start, sizeof start);
+    start_len = sizeof start + profile_encode(profile, &start_payload[sizeof start],
+                                              sizeof start_payload - sizeof start);
+
+    run = atomic_fetch_add(&ato_next_run, 1);
+    atomic_store(&ato_run_start_ms, esp_timer_get_time() / 1000);
+    atomic_store(&ato_start_run, run);
+    atomic_store(&ato_run, run);
+    xTaskNotifyGive(runlog_handle);
+    ESP_LOGI(tag, "Logging run %" PRIu32, run);
+}
+
+void runlog_end_run(runlog_status_t status) {
+    uint32_t run = atomic_exchange(&ato_run, 0);
+    uint32_t now_ms = esp_timer_get_time() / 1000;
+
+    if (run == 0) {
+        return;
+    }
+    end_payload = (runlog_end_t){
+        .status = status,
+        .duration = (now_ms - atomic_load(&ato_run_start_ms)) / 1000,
+        .energy = energy_get_run(),
+        .dropped = atomic_exchange(&ato_dropped, 0),
+    };
+    atomic_store(&ato_end_run, run);
+    xTaskNotifyGive(runlog_handle);
+}
+
+/* Run being logged, 0 for none */
+uint32_t runlog_get_run(void) {
+    return atomic_load(&ato_run);
+}
+
+/* Controller task, every period; one sample per RUNLOG_PERIOD_MS is kept */
+void runlog_push(const telemetry_sample_t *sample) {
+    uint32_t run = atomic_load(&ato_run);
+    uint32_t period = sample->timestamp / RUNLOG_PERIOD_MS;
+
+    if (run == 0 || period == last_period) {
+        return;
+    }
+    last_period = period;
+
+    unsigned int head_index = atomic_load_explicit(&ato_staging_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ato_staging_tail, memory_order_acquire);
+    if (head_index - tail >= RUNLOG_STAGING_LEN) {
+        atomic_fetch_add(&ato_dropped, 1);
+        return;
+    }
+    staging[head_index % RUNLOG_STAGING_LEN] = (runlog_staged_t){
+        .run = run,
+        .sample = {
+            .time = (sample->timestamp - atomic_load(&ato_run_start_ms)) / 1000,
+            .temperature = sample->temperature,
+            .target = sample->target,
+            .power = sample->power,
+            .step = sample->step,
+            .faults = sample->faults,
+        },
+    };
+    atomic_store_explicit(&ato_staging_head, head_index + 1, memory_order_release);
+    if ((head_index + 1 - tail) >= RUNLOG_BATCH) {
+        xTaskNotifyGive(runlog_handle);
+    }
+}
+
+/*
+ * Copies up to len bytes of a stream from offset on: RUNLOG_STREAM_INDEX
+ * for the runlog_index_t of every run kept, a run number for the entries
+ * of that run. Returns the number of bytes copied, 0 past the end, or -1
+ * for a run that is not, or no longer, kept.
+ */
+int runlog_read(uint32_t stream, uint32_t offset, uint8_t *buf, int len) {
+    uint32_t addr = RUNLOG_NONE;
+    uint32_t pos = 0;
+    int copied = 0;
+
+    if (partition == NULL) {
+        return -1;
+    }
+
+    portENTER_CRITICAL(&index_lock);
+    if (stream == RUNLOG_STREAM_INDEX) {
+        uint32_t size = run_count * sizeof runs[0];
+        if (offset < size) {
+            copied = size - offset < len ? size - offset : len;
+            memcpy(buf, (const uint8_t *)runs + offset, copied);
+        }
+        portEXIT_CRITICAL(&index_lock);
+        return copied;
+    }
+    for (int i = 0; i < run_count; i++) {
+        if (runs[i].run == stream) {
+            addr = run_addr[i];
+        }
+    }
+    portEXIT_CRITICAL(&index_lock);
+    if (addr == RUNLOG_NONE) {
+        return -1;
+    }
+
+    /* The entries of a run follow each other */
+    while (addr != RUNLOG_NONE && copied < len) {
+        runlog_entry_t entry;
+        if (!runlog_entry_at(addr, &entry) || entry.run != stream) {
+            break;
+        }
+        uint32_t size = sizeof entry + entry.len;
+        uint32_t at = offset + copied;
+        if (at < pos + size) {
+            int n = pos + size - at < len - copied ? pos + size - at : len - copied;
+            memcpy(&buf[copied], &log_map[addr + at - pos], n);
+            copied += n;
+        }
+        pos += size;
+        addr = runlog_next(addr);
+    }
+    return copied;
+}
+
+static bool runlog_sector_erased(uint32_t sector) {
+    const uint32_t *words = (const uint32_t *)&log_map[sector * RUNLOG_SECTOR];
+    for (int i = 0; i < RUNLOG_SECTOR / sizeof *words; i++) {
+        if (words[i] != UINT32_MAX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Rebuilds the writer position and the index from the partition */
+static void runlog_scan(void) {
+    uint32_t last_run = 0;
+    bool found = false;
+
+    for (uint32_t sector = 0; sector < sectors; sector++) {
+        runlog_sector_t header = runlog_sector_header(sector);
+        if (header.magic == RUNLOG_MAGIC && (!found || header.seq > head_seq)) {
+            head = sector;
+            head_seq = header.seq;
+            found = true;
+        }
+    }
+    if (!found) {
+        /* Blank or foreign partition: the first write takes sector 0 */
+        head = sectors - 1;
+        head_seq = 0;
+        write_offset = RUNLOG_SECTOR;
+        spare = 0;
+        ESP_LOGI(tag, "Empty log, %" PRIu32 " sectors", sectors);
+        atomic_store(&ato_next_run, 1);
+        return;
+    }
+
+    /* Oldest sector first, they were written in address order */
+    for (uint32_t i = 1; i <= sectors; i++) {
+        uint32_t sector = (head + i) % sectors;
+        runlog_sector_t header = runlog_sector_header(sector);
+        uint32_t addr = sector * RUNLOG_SECTOR + sizeof header;
+        runlog_entry_t entry;
+
+        if (header.magic != RUNLOG_MAGIC || header.seq > head_seq) {
+            continue;
+        }
+        while (runlog_entry_at(addr, &entry)) {
+            uint32_t size = sizeof entry + entry.len;
+            if (entry.type == RUNLOG_ENTRY_START) {
+                runlog_start_t start;
+                memcpy(&start, &log_map[addr + sizeof entry], sizeof start);
+                runlog_index_start(entry.run, addr, start.epoch, size);
+            } else {
+                int status = -1;
+                if (entry.type == RUNLOG_ENTRY_END) {
+                    status = log_map[addr + sizeof entry];
+                }
+                runlog_index_entry(entry.run, size, status);
+            }
+            if (entry.run > last_run) {
+                last_run = entry.run;
+            }
+            addr += ALIGN4(size);
+        }
+        if (sector == head) {
+            write_offset = addr - sector * RUNLOG_SECTOR;
+        }
+    }
+    for (int i = 0; i < run_count; i++) {
+        if (runs[i].status == RUNLOG_RUNNING) {
+            runs[i].status = RUNLOG_INTERRUPTED;
+        }
+    }
+
+    spare = 0;
+    while (spare < RUNLOG_SPARE_SECTORS && spare < sectors - 1 &&
+           runlog_sector_erased((head + spare + 1) % sectors)) {
+        spare++;
+    }
+    closed_run = last_run;
+    atomic_store(&ato_next_run, last_run + 1);
+    ESP_LOGI(tag, "%i runs kept, next is %" PRIu32, run_count, last_run + 1);
+}
+
+void runlog_init(void) {
+    esp_err_t err;
+
+    atomic_init(&ato_staging_head, 0);
+    atomic_init(&ato_staging_tail, 0);
+    atomic_init(&ato_dropped, 0);
+    atomic_init(&ato_run, 0);
+    atomic_init(&ato_next_run, 1);
+    atomic_init(&ato_run_start_ms, 0);
+    atomic_init(&ato_start_run, 0);
+    atomic_init(&ato_end_run, 0);
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, RUNLOG_SUBTYPE, NULL);
+    if (partition == NULL) {
+        ESP_LOGW(tag, "No run log partition, runs are not logged");
+        return;
+    }
+    err = esp_partition_mmap(partition, 0, partition->size, ESP_PARTITION_MMAP_DATA,
+                             (const void **)&log_map, &log_map_handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "Cannot map the run log: %s", esp_err_to_name(err));
+        partition = NULL;
+        return;
+    }
+    sectors = partition->size / RUNLOG_SECTOR;
+    runlog_scan();
+}
+
+void runlog_start(void) {
+    if (partition != NULL) {
+        xTaskCreate(runlog_task, "runlog_task", 4096, NULL, 1, &runlog_handle);
+    }
+}
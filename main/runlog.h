@@ -0,0 +1,87 @@
+#ifndef H_RUNLOG_
+#define H_RUNLOG_
+
+#include <stdint.h>
+#include "telemetry.h"
+#include "controller.h"
+
+#define RUNLOG_PERIOD_MS 1000   // one sample record per second
+#define RUNLOG_INDEX_MAX 64     // runs listed, the oldest ones beyond are skipped
+#define RUNLOG_STREAM_INDEX 0   // see runlog_read()
+#define RUNLOG_ZONES 3          // largest CONFIG_HEATER_CHANNELS
+
+/*
+ * Stored runs, as downloaded (packed, little-endian). A run is a sequence
+ * of entries, each a runlog_entry_t followed by len bytes of payload:
+ *   RUNLOG_ENTRY_START    runlog_start_t, then the profile image (profile.h)
+ *   RUNLOG_ENTRY_SAMPLES  len / sizeof(runlog_sample_t) sample records
+ *   RUNLOG_ENTRY_END      runlog_end_t, missing when power was lost
+ */
+typedef enum {
+    RUNLOG_ENTRY_START = 0x01,
+    RUNLOG_ENTRY_SAMPLES = 0x02,
+    RUNLOG_ENTRY_END = 0x03,
+} runlog_entry_type_t;
+
+typedef struct __attribute__((packed)) runlog_entry_t {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t len;
+    uint32_t run;
+} runlog_entry_t;
+
+#define RUNLOG_START_VERSION 1
+
+typedef struct __attribute__((packed)) runlog_start_t {
+    uint8_t version;
+    uint8_t channels;
+    uint16_t fan_gain;                 // fan per-mille per °C above the cool-down ramp
+    int16_t zone_offset[RUNLOG_ZONES]; // °C
+    uint32_t epoch;                    // s since 1970, 0 when the clock was never set
+    uint32_t uptime;                   // s since boot
+} runlog_start_t;
+
+typedef struct __attribute__((packed)) runlog_sample_t {
+    uint16_t time;          // s since the start of the run
+    int16_t temperature;    // 0.25 °C
+    int16_t target;         // °C
+    uint16_t power;         // per-mille, averaged over the heater channels
+    int16_t step;           // REFLOW_STEP_COOLDOWN during the cool-down
+    uint8_t faults;         // TELEMETRY_FAULT_*
+    uint8_t reserved;
+} runlog_sample_t;
+
+typedef enum {
+    RUNLOG_COMPLETE,
+    RUNLOG_ABORTED,       // stopped by a client or the panel
+    RUNLOG_INTERRUPTED,   // no end entry: reset or power loss during the run
+    RUNLOG_RUNNING,
+} runlog_status_t;
+
+typedef struct __attribute__((packed)) runlog_end_t {
+    uint8_t status;         // runlog_status_t
+    uint8_t reserved;
+    uint16_t duration;      // s
+    uint32_t energy;        // J
+    uint32_t dropped;       // samples lost to a full staging buffer
+} runlog_end_t;
+
+/* Index stream, one per run kept, oldest first */
+typedef struct __attribute__((packed)) runlog_index_t {
+    uint32_t run;
+    uint32_t epoch;
+    uint32_t size;          // bytes of the run stream
+    uint8_t status;         // runlog_status_t
+} runlog_index_t;
+
+void runlog_init(void);
+void runlog_start(void);
+
+void runlog_begin_run(const reflow_profile_t *profile, uint16_t fan_gain);
+void runlog_end_run(runlog_status_t status);
+uint32_t runlog_get_run(void);
+void runlog_push(const telemetry_sample_t *sample);
+
+int runlog_read(uint32_t stream, uint32_t offset, uint8_t *buf, int len);
+
+#endif
@@ -0,0 +1,157 @@
+#include "esp_log.h"
+#include "esp_vfs_dev.h"
+#include "driver/uart.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "runlog.h"
+#include "controller.h"
+#include "calibration.h"
+#include "serial.h"
+
+static const char *tag = "Serial";
+
+#define SERIAL_LINE_MAX 64
+#define SERIAL_DUMP_CHUNK 32 // bytes per hex line
+
+/*
+ * Line commands on the console UART, for bench use without a BLE client.
+ * Output is plain text; run streams are dumped as hex lines prefixed with
+ * their offset, the same bytes as the BLE download.
+ */
+typedef struct serial_command_t {
+    const char *name;
+    const char *help;
+    void (*run)(const char *args);
+} serial_command_t;
+
+static void serial_runlog_index(void) {
+    runlog_index_t run;
+    uint32_t offset = 0;
+
+    while (runlog_read(RUNLOG_STREAM_INDEX, offset, (uint8_t *)&run, sizeof run) == sizeof run) {
+        printf("run %" PRIu32 " epoch %" PRIu32 " size %" PRIu32 " status %u\n",
+               run.run, run.epoch, run.size, run.status);
+        offset += sizeof run;
+    }
+    printf("%" PRIu32 " runs\n", offset / (uint32_t)sizeof run);
+}
+
+static void serial_runlog(const char *args) {
+    uint8_t buf[SERIAL_DUMP_CHUNK];
+    uint32_t offset = 0;
+    char *end;
+    unsigned long run;
+    int len;
+
+    if (*args == '\0') {
+        serial_runlog_index();
+        return;
+    }
+    run = strtoul(args, &end, 0);
+    if (end == args || run == RUNLOG_STREAM_INDEX) {
+        printf("error: bad run number\n");
+        return;
+    }
+    while ((len = runlog_read(run, offset, buf, sizeof buf)) > 0) {
+        printf("%08" PRIx32 ":", offset);
+        for (int i = 0; i < len; i++) {
+            printf(" %02x", buf[i]);
+        }
+        printf("\n");
+        offset += len;
+    }
+    if (len < 0) {
+        printf("error: run %lu not kept\n", run);
+    } else {
+        printf("end %" PRIu32 "\n", offset);
+    }
+}
+
+static void serial_calibration(const char *args) {
+    calibration_t cal;
+
+    if (strcmp(args, "reset") == 0) {
+        reset_calibration();
+    } else if (*args != '\0') {
+        printf("error: unknown argument\n");
+        return;
+    }
+    calibration_get(&cal);
+    printf("version %u runs %u fit %u\n", cal.version, cal.runs, cal.fit_error);
+    printf("heating %u cooling %u lag %u hold %u\n", cal.heating_rate, cal.cooling_rate, cal.lag, cal.hold_loss);
+    printf("zone offsets");
+    for (int ch = 0; ch < CALIBRATION_ZONES; ch++) {
+        printf(" %i", cal.zone_offset[ch]);
+    }
+    printf("\n");
+}
+
+static void serial_help(const char *args);
+
+static const serial_command_t serial_commands[] = {
+    { "runlog", "[run]  list the runs kept, or dump one", serial_runlog },
+    { "calibration", "[reset]  show the learned oven model, or reset it", serial_calibration },
+    { "help", "       this list", serial_help },
+};
+
+static void serial_help(const char *args) {
+    for (size_t i = 0; i < sizeof serial_commands / sizeof serial_commands[0]; i++) {
+        printf("%s %s\n", serial_commands[i].name, serial_commands[i].help);
+    }
+}
+
+static void serial_task(void *param) {
+    static char line[SERIAL_LINE_MAX];
+
+    for ( ;; ) {
+        if (fgets(line, sizeof line, stdin) == NULL) {
+            clearerr(stdin);
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char *args = line + strcspn(line, " ");
+        if (*args) {
+            *args++ = '\0';
+            args += strspn(args, " ");
+        }
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        size_t i;
+        for (i = 0; i < sizeof serial_commands / sizeof serial_commands[0]; i++) {
+            if (strcmp(line, serial_commands[i].name) == 0) {
+                serial_commands[i].run(args);
+                break;
+            }
+        }
+        if (i == sizeof serial_commands / sizeof serial_commands[0]) {
+            printf("error: unknown command, try help\n");
+        }
+        fflush(stdout);
+    }
+}
+
+void serial_init(void) {
+    esp_err_t err;
+
+    /* Blocking reads through the driver, the default VFS only polls */
+    err = uart_driver_install(CONFIG_ESP_CONSOLE_UART_NUM, 256, 0, 0, NULL, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(tag, "UART driver: %s", esp_err_to_name(err));
+        return;
+    }
+    esp_vfs_dev_uart_port_set_rx_line_endings(CONFIG_ESP_CONSOLE_UART_NUM, ESP_LINE_ENDINGS_CR);
+    esp_vfs_dev_uart_port_set_tx_line_endings(CONFIG_ESP_CONSOLE_UART_NUM, ESP_LINE_ENDINGS_CRLF);
+    esp_vfs_dev_uart_use_driver(CONFIG_ESP_CONSOLE_UART_NUM);
+}
+
+void serial_start(void) {
+    xTaskCreate(serial_task, "serial_task", 3072, NULL, 1, NULL);
+}
@@ -0,0 +1,7 @@
+#ifndef H_SERIAL_
+#define H_SERIAL_
+
+void serial_init(void);
+void serial_start(void);
+
+#endif
@@ -0,0 +1,184 @@
+#include "esp_log.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "bler946.h"
+#include "telemetry.h"
+
+static const char *tag = "Telemetry";
+
+#define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
+#define MIN(a, b)  (((a) < (b)) ? (a) : (b))
+
+/*
+ * Every connection gets its own stream: samples are decimated to the rate
+ * it asked for and batched into a single notification, up to the ATT
+ * payload of the connection or TELEMETRY_FLUSH_MS of samples.
+ *
+ * Notification layout:
+ *   uint8 count              samples in the batch
+ *   uint8 rate               Hz, sets the nominal sample interval
+ *   telemetry_sample_t       first sample
+ *   (count - 1) deltas       uint8 mask of the changed fields, followed by
+ *                            the zigzag varint delta of each of them
+ *
+ * The delta fields are, in bit order: timestamp (minus the nominal
+ * interval), temperature, target, power, cold junction, step, faults. A
+ * steady oven costs two bytes per sample.
+ */
+#define TELEMETRY_FLUSH_MS 500
+#define TELEMETRY_HEADER_LEN 2
+#define TELEMETRY_FIELDS 7
+#define TELEMETRY_DELTA_MAX (1 + TELEMETRY_FIELDS * 5)
+#define TELEMETRY_BATCH_MAX 244 // payload of the largest ATT MTU
+
+_Static_assert(TELEMETRY_HEADER_LEN + sizeof(telemetry_sample_t) <= 20,
+               "a batch must fit in the default ATT MTU");
+
+/* One stream per connection slot, batches only touched by the controller task */
+typedef struct telemetry_stream_t {
+    atomic_uint rate;
+    atomic_bool reset;
+    uint8_t batch[TELEMETRY_BATCH_MAX];
+    uint16_t batch_len;
+    uint8_t batch_count;
+    uint8_t batch_rate;
+    telemetry_sample_t batch_first;
+    telemetry_sample_t batch_last;
+    uint32_t next_sample;
+} telemetry_stream_t;
+
+static telemetry_stream_t streams[TELEMETRY_STREAMS];
+
+static int put_varint(uint8_t *buf, int32_t value) {
+    uint32_t zigzag = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+    int len = 0;
+    do {
+        buf[len] = zigzag & 0x7f;
+        zigzag >>= 7;
+        if (zigzag) {
+            buf[len] |= 0x80;
+        }
+        len++;
+    } while (zigzag);
+    return len;
+}
+
+static int encode_delta(uint8_t *buf, const telemetry_sample_t *prev,
+                        const telemetry_sample_t *sample, uint32_t interval) {
+    int32_t delta[TELEMETRY_FIELDS] = {
+        (int32_t)(sample->timestamp - prev->timestamp - interval),
+        sample->temperature - prev->temperature,
+        sample->target - prev->target,
+        sample->power - prev->power,
+        sample->cold_junction - prev->cold_junction,
+        sample->step - prev->step,
+        sample->faults - prev->faults,
+    };
+    uint8_t mask = 0;
+    int len = 1;
+    for (int field = 0; field < TELEMETRY_FIELDS; field++) {
+        if (delta[field]) {
+            mask |= 1 << field;
+            len += put_varint(&buf[len], delta[field]);
+        }
+    }
+    buf[0] = mask;
+    return len;
+}
+
+static void telemetry_flush(int id, telemetry_stream_t *stream) {
+    if (stream->batch_count) {
+        stream->batch[0] = stream->batch_count;
+        bler_tx_telemetry(id, stream->batch, stream->batch_len);
+        stream->batch_count = 0;
+    }
+}
+
+static void telemetry_begin(telemetry_stream_t *stream, const telemetry_sample_t *sample, uint8_t rate) {
+    stream->batch[1] = rate;
+    memcpy(&stream->batch[TELEMETRY_HEADER_LEN], sample, sizeof *sample);
+    stream->batch_len = TELEMETRY_HEADER_LEN + sizeof *sample;
+    stream->batch_count = 1;
+    stream->batch_rate = rate;
+    stream->batch_first = *sample;
+    stream->batch_last = *sample;
+}
+
+static void telemetry_stream_push(int id, telemetry_stream_t *stream, const telemetry_sample_t *sample) {
+    if (atomic_exchange(&stream->reset, false)) {
+        /* The slot went to another connection, drop what was pending */
+        stream->batch_count = 0;
+        stream->next_sample = sample->timestamp;
+    }
+
+    uint8_t rate = atomic_load(&stream->rate);
+    uint32_t interval = 1000 / rate;
+
+    if ((int32_t)(sample->timestamp - stream->next_sample) < 0) {
+        return;
+    }
+    stream->next_sample += interval;
+    if ((int32_t)(sample->timestamp - stream->next_sample) >= 0) {
+        /* Fell behind or just started, realign on this sample */
+        stream->next_sample = sample->timestamp + interval;
+    }
+
+    uint16_t max_len = MIN(bler_tx_telemetry_max_len(id), sizeof stream->batch);
+    if (max_len == 0) {
+        /* Not subscribed */
+        stream->batch_count = 0;
+        return;
+    }
+
+    bool appended = false;
+    if (stream->batch_count && stream->batch_rate == rate && stream->batch_count < UINT8_MAX) {
+        uint8_t delta[TELEMETRY_DELTA_MAX];
+        int len = encode_delta(delta, &stream->batch_last, sample, interval);
+        if (stream->batch_len + len <= max_len) {
+            memcpy(&stream->batch[stream->batch_len], delta, len);
+            stream->batch_len += len;
+            stream->batch_count++;
+            stream->batch_last = *sample;
+            appended = true;
+        }
+    }
+    if (!appended) {
+        telemetry_flush(id, stream);
+        telemetry_begin(stream, sample, rate);
+    }
+
+    /* Flush when the next sample would be older than the latency budget */
+    if (sample->timestamp + interval - stream->batch_first.timestamp >= TELEMETRY_FLUSH_MS) {
+        telemetry_flush(id, stream);
+    }
+}
+
+void telemetry_push(const telemetry_sample_t *sample) {
+    for (int id = 0; id < TELEMETRY_STREAMS; id++) {
+        telemetry_stream_push(id, &streams[id], sample);
+    }
+}
+
+void telemetry_set_rate(int stream, uint8_t hz) {
+    hz = CLAMP(hz, TELEMETRY_RATE_MIN, TELEMETRY_RATE_MAX);
+    ESP_LOGI(tag, "Stream %i rate: %i Hz", stream, hz);
+    atomic_store(&streams[stream].rate, hz);
+}
+
+uint8_t telemetry_get_rate(int stream) {
+    return atomic_load(&streams[stream].rate);
+}
+
+void telemetry_reset(int stream) {
+    atomic_store(&streams[stream].rate, TELEMETRY_RATE_DEFAULT);
+    atomic_store(&streams[stream].reset, true);
+}
+
+void telemetry_init(void) {
+    for (int id = 0; id < TELEMETRY_STREAMS; id++) {
+        atomic_init(&streams[id].rate, TELEMETRY_RATE_DEFAULT);
+        atomic_init(&streams[id].reset, true);
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef H_TELEMETRY_
+#define H_TELEMETRY_
+
+#include <stdint.h>
+
+#define TELEMETRY_RATE_MIN 1 // Hz
+#define TELEMETRY_RATE_MAX 20
+#define TELEMETRY_RATE_DEFAULT 10
+
+#define TELEMETRY_STREAMS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+#define TELEMETRY_FAULT_OPEN         (1 << 0) // thermocouple open circuit
+#define TELEMETRY_FAULT_SHORT_GND    (1 << 1)
+#define TELEMETRY_FAULT_SHORT_VCC    (1 << 2)
+
+/*
+ * One controller sample. The first sample of a notification is sent as is
+ * (little-endian, packed), the following ones as deltas.
+ */
+typedef struct __attribute__((packed)) telemetry_sample_t {
+    uint32_t timestamp;     // ms since boot
+    int16_t temperature;    // 0.25 °C
+    int16_t target;         // °C
+    uint16_t power;         // per-mille, averaged over the heater channels
+    int16_t cold_junction;  // 0.0625 °C
+    int16_t step;           // -1 when no reflow is running
+    uint8_t faults;
+} telemetry_sample_t;
+
+void telemetry_init(void);
+void telemetry_push(const telemetry_sample_t *sample);
+
+void telemetry_set_rate(int stream, uint8_t hz);
+uint8_t telemetry_get_rate(int stream);
+void telemetry_reset(int stream);
+
+#endif
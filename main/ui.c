@@ -12,6 +12,8 @@
 #include "esp_log.h"
 #include "segments.h"
 #include "controller.h"
+#include "library.h"
+#include "presets.h"
 
 #define PIN_BTN_A 32
 #define PIN_BTN_B 35
@@ -21,6 +23,10 @@
 #define BIT_BTN_A (1 << 1)
 #define BIT_BTN_B (1 << 2)
 #define BIT_BTN_C (1 << 3)
+#define BIT_BTN_C_DOUBLE (1 << 4)
+
+/* Profiles cycled through: the stored ones, then the built-in ones */
+#define UI_CHOICES (LIBRARY_SLOTS + PRESET_COUNT)
 
 
 static TaskHandle_t ui_handle;
@@ -40,6 +46,39 @@ static void button_c_cb(void* arg)
     xTaskNotifyFromISR(ui_handle, BIT_BTN_C, eSetBits, NULL);
 }
 
+static void button_c_double_cb(void* arg)
+{
+    xTaskNotifyFromISR(ui_handle, BIT_BTN_C_DOUBLE, eSetBits, NULL);
+}
+
+/* Selects the profile after the given choice, returns the new choice */
+static int ui_select_next(int choice)
+{
+    library_index_t index;
+    library_get_index(&index);
+
+    for (int i = 1; i <= UI_CHOICES; i++) {
+        int next = (choice + i) % UI_CHOICES;
+        if (next >= LIBRARY_SLOTS) {
+            if (preset_select(next - LIBRARY_SLOTS) == ESP_OK) {
+                return next;
+            }
+        } else if (index.slots[next].used && library_select(next) == ESP_OK) {
+            return next;
+        }
+    }
+    return choice;
+}
+
+/* Slot number for the stored profiles, peak temperature for the built-in ones */
+static int ui_choice_digits(int choice)
+{
+    if (choice < LIBRARY_SLOTS) {
+        return choice + 1;
+    }
+    return preset_peak(preset_get(choice - LIBRARY_SLOTS));
+}
+
 void ui_display_temperature(){
     xTaskNotify(ui_handle, BIT_TEMPERATURE, eSetBits);
 }
@@ -48,6 +87,8 @@ void ui_task(void *param){
     uint32_t ulNotificationValue;
     int temperature = 0;
     long press_time = 0;
+    long select_time = 0;
+    int choice = library_get_active() >= 0 ? library_get_active() : UI_CHOICES - 1;
 
     for( ;; )
     {
@@ -58,7 +99,9 @@ void ui_task(void *param){
 
         long time = esp_timer_get_time();
 
-        if (press_time + 1500 * 1000 < time) {
+        if (select_time + 1500 * 1000 >= time) {
+            write_digits(ui_choice_digits(choice));
+        } else if (press_time + 1500 * 1000 < time) {
             write_digits(temperature);
         } else {
             int target;
@@ -85,6 +128,14 @@ void ui_task(void *param){
             }
         }
 
+        /* Next profile, stored or built-in */
+        if (ulNotificationValue & (BIT_BTN_C_DOUBLE)) {
+            if (!reflow_is_running()) {
+                choice = ui_select_next(choice);
+                select_time = time;
+            }
+        }
+
         if (ulNotificationValue & (BIT_TEMPERATURE)) {
             temperature = get_temperature();
         }
@@ -93,7 +144,7 @@ void ui_task(void *param){
 
 void ui_init(void)
 {
-    xTaskCreate(ui_task, "ui_task", 2048, NULL, 2, &ui_handle);
+    xTaskCreate(ui_task, "ui_task", 3072, NULL, 2, &ui_handle);
 
     button_config_t btn_a_cfg = {
         .type = BUTTON_TYPE_GPIO,
@@ -126,4 +177,5 @@ void ui_init(void)
     };
     button_handle_t btn_c_handle = iot_button_create(&btn_c_cfg);
     iot_button_register_cb(btn_c_handle, BUTTON_LONG_PRESS_START, &button_c_cb, "C");
+    iot_button_register_cb(btn_c_handle, BUTTON_DOUBLE_CLICK, &button_c_double_cb, "C");
 }